@@ -0,0 +1,130 @@
+/*
+ * UPnP relay daemon - cache admission control
+ *
+ * Every SSDP announcement of an unknown USN creates a cache entry, so a host
+ * that makes up a new USN for each announcement would otherwise grow the cache
+ * without bound. Before a new device is stored, its sender and the interface
+ * it arrived on each have to take a token from a bucket that refills at a
+ * configured rate. A sender that runs its bucket dry is quarantined for a
+ * while, during which none of its new devices are accepted. Keep-alives of
+ * devices already cached are never limited, and neither are other hosts, so
+ * well-behaved devices are not affected.
+ *
+ * The buckets live in small fixed-size hash tables, such that a flood of
+ * spoofed source addresses cannot make the tables themselves grow. When a
+ * table is full, the bucket used least recently is reused, preferably one that
+ * is not in quarantine.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Slots probed for a key before a bucket is reused
+#define ADMIT_PROBES 8
+
+// Longest refill interval considered, which keeps the arithmetic in range
+#define ADMIT_MAX_ELAPSED_MS (3600 * 1000)
+
+/* Whether bucket a should rather be reused than bucket b */
+static int evict_before(upnprd_t *ctx, struct admit_bucket *a, struct admit_bucket *b) {
+	int a_quarantined = a->quarantined_until > ctx->now;
+	int b_quarantined = b->quarantined_until > ctx->now;
+	if(a_quarantined != b_quarantined) {
+		return b_quarantined;
+	}
+	return ctx->now_ms - a->updated_ms > ctx->now_ms - b->updated_ms;
+}
+
+static struct admit_bucket *find_bucket(upnprd_t *ctx, struct admit_bucket *table, unsigned int size, uint32_t key, unsigned int burst) {
+	// Fibonacci hashing spreads consecutive addresses and interface
+	// indices over the table
+	unsigned int slot = (key * 2654435769u) >> 16;
+	struct admit_bucket *victim = NULL;
+	int i;
+	for(i=0; i<ADMIT_PROBES; i++) {
+		struct admit_bucket *bucket = &table[(slot + i) & (size - 1)];
+		if(!bucket->used) {
+			// Buckets are only ever reused, never emptied, so the key
+			// cannot be further on
+			victim = bucket;
+			break;
+		}
+		if(bucket->key == key) {
+			return bucket;
+		}
+		if(!victim || evict_before(ctx, bucket, victim)) {
+			victim = bucket;
+		}
+	}
+
+	// A new sender starts with a full bucket
+	victim->used = 1;
+	victim->key = key;
+	victim->tokens = burst * 1000;
+	victim->updated_ms = ctx->now_ms;
+	victim->quarantined_until = 0;
+	return victim;
+}
+
+/* Refill a bucket for the time passed and try to take a token from it */
+static int take_token(upnprd_t *ctx, struct admit_bucket *bucket, unsigned int rate, unsigned int burst) {
+	uint32_t elapsed = ctx->now_ms - bucket->updated_ms;
+	if(elapsed > ADMIT_MAX_ELAPSED_MS) {
+		elapsed = ADMIT_MAX_ELAPSED_MS;
+	}
+	bucket->updated_ms = ctx->now_ms;
+
+	// Tokens are counted in thousandths, rate is per minute
+	uint64_t tokens = bucket->tokens + (uint64_t)elapsed * rate / 60;
+	if(tokens > burst * 1000) {
+		tokens = burst * 1000;
+	}
+	if(tokens < 1000) {
+		bucket->tokens = tokens;
+		return 0;
+	}
+	bucket->tokens = tokens - 1000;
+	return 1;
+}
+
+int admit_device(upnprd_t *ctx, struct in_addr source, int ifindex) {
+	struct upnprd_config *config = &ctx->config;
+
+	struct admit_bucket *sender = NULL;
+	if(config->admit_rate) {
+		sender = find_bucket(ctx, ctx->admit_sources, ADMIT_SOURCES, source.s_addr, config->admit_burst);
+		if(sender->quarantined_until > ctx->now) {
+			ctx->stats.admissions_rejected++;
+			return 0;
+		}
+	}
+
+	// Check the interface before the sender, such that senders are not
+	// charged for devices the interface refused
+	if(config->admit_interface_rate && ifindex > 0) {
+		struct admit_bucket *interface = find_bucket(ctx, ctx->admit_interfaces, ADMIT_INTERFACES, ifindex, config->admit_interface_burst);
+		if(!take_token(ctx, interface, config->admit_interface_rate, config->admit_interface_burst)) {
+			ctx->stats.admissions_rejected_interface++;
+			return 0;
+		}
+	}
+
+	if(sender && !take_token(ctx, sender, config->admit_rate, config->admit_burst)) {
+		debugf("Quarantining %s for adding devices too fast\n", inet_ntoa(source));
+		sender->quarantined_until = ctx->now + config->admit_quarantine;
+		ctx->stats.admissions_rejected++;
+		ctx->stats.sources_quarantined++;
+		return 0;
+	}
+	return 1;
+}
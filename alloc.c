@@ -0,0 +1,154 @@
+/*
+ * UPnP relay daemon - allocation tracking
+ *
+ * Only compiled in with ALLOC_STATS. Each allocation carries a small header
+ * recording its size, the pipeline stage that made it and the message type
+ * being handled at the time, such that frees can be accounted to the same
+ * counters as the allocation.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef ALLOC_STATS
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+union alloc_header {
+	struct {
+		size_t size;
+		unsigned char stage;
+		unsigned char msg_type;
+	} info;
+
+	// Keep the payload suitably aligned for anything
+	max_align_t align;
+};
+
+#ifdef THREADS
+	#define ALLOC_LOCK(ctx) pthread_mutex_lock(&(ctx)->alloc_mutex)
+	#define ALLOC_UNLOCK(ctx) pthread_mutex_unlock(&(ctx)->alloc_mutex)
+#else
+	#define ALLOC_LOCK(ctx)
+	#define ALLOC_UNLOCK(ctx)
+#endif
+
+void *tracked_malloc(upnprd_t *ctx, int stage, size_t size) {
+	union alloc_header *header = (union alloc_header *)malloc(sizeof(union alloc_header) + size);
+	if(!header) {
+		return NULL;
+	}
+	header->info.size = size;
+	header->info.stage = stage;
+	header->info.msg_type = ctx->alloc_msg_type;
+
+	ALLOC_LOCK(ctx);
+	struct upnprd_alloc_counter *counter = &ctx->alloc_stats.counters[stage][header->info.msg_type];
+	counter->allocs++;
+	counter->live_bytes += size;
+	ctx->alloc_stats.live_bytes += size;
+	if(ctx->alloc_stats.live_bytes > ctx->alloc_stats.peak_bytes) {
+		ctx->alloc_stats.peak_bytes = ctx->alloc_stats.live_bytes;
+	}
+	ALLOC_UNLOCK(ctx);
+
+	return header + 1;
+}
+
+void tracked_free(upnprd_t *ctx, void *ptr) {
+	if(!ptr) {
+		return;
+	}
+	union alloc_header *header = (union alloc_header *)ptr - 1;
+
+	ALLOC_LOCK(ctx);
+	struct upnprd_alloc_counter *counter = &ctx->alloc_stats.counters[header->info.stage][header->info.msg_type];
+	counter->frees++;
+	counter->live_bytes -= header->info.size;
+	ctx->alloc_stats.live_bytes -= header->info.size;
+	ALLOC_UNLOCK(ctx);
+
+	free(header);
+}
+
+/*
+ * Record a sample of the heap usage once a minute. The history is a ring
+ * buffer starting at alloc_history_start. The interval is measured on the
+ * instance's monotonic clock, the samples are stamped with the wall clock.
+ */
+void alloc_stats_sample(upnprd_t *ctx) {
+	if(ctx->alloc_last_sample && ctx->alloc_last_sample + 60 > ctx->now) {
+		return;
+	}
+	ctx->alloc_last_sample = ctx->now;
+	time_t now = time(NULL);
+
+	ALLOC_LOCK(ctx);
+	struct upnprd_alloc_stats *stats = &ctx->alloc_stats;
+	int slot;
+	if(stats->history_length < UPNPRD_ALLOC_HISTORY) {
+		slot = stats->history_length++;
+	}
+	else {
+		slot = ctx->alloc_history_start;
+		ctx->alloc_history_start = (ctx->alloc_history_start + 1) % UPNPRD_ALLOC_HISTORY;
+	}
+	stats->history[slot].time = now;
+	stats->history[slot].live_bytes = stats->live_bytes;
+	stats->history[slot].peak_bytes = stats->peak_bytes;
+	ALLOC_UNLOCK(ctx);
+}
+
+void upnprd_alloc_stats(upnprd_t *ctx, struct upnprd_alloc_stats *stats) {
+	ALLOC_LOCK(ctx);
+	*stats = ctx->alloc_stats;
+	ALLOC_UNLOCK(ctx);
+
+	// Linearize the history ring
+	int i;
+	for(i=0; i<stats->history_length; i++) {
+		stats->history[i] = ctx->alloc_stats.history[(ctx->alloc_history_start + i) % UPNPRD_ALLOC_HISTORY];
+	}
+}
+
+void upnprd_alloc_report(upnprd_t *ctx, FILE *out) {
+	static const char *stage_names[] = { "setup", "store", "reply", "send", "proxy" };
+	static const char *msg_type_names[] = { "none", "notify", "search", "sync" };
+
+	struct upnprd_alloc_stats stats;
+	upnprd_alloc_stats(ctx, &stats);
+
+	fprintf(out, "%-8s %-8s %10s %10s %12s\n", "stage", "message", "allocs", "frees", "live bytes");
+	int stage, msg_type;
+	for(stage=0; stage<UPNPRD_ALLOC_STAGES; stage++) {
+		for(msg_type=0; msg_type<UPNPRD_MSG_TYPES; msg_type++) {
+			struct upnprd_alloc_counter *counter = &stats.counters[stage][msg_type];
+			if(counter->allocs == 0) {
+				continue;
+			}
+			fprintf(out, "%-8s %-8s %10lu %10lu %12zu\n", stage_names[stage], msg_type_names[msg_type],
+				counter->allocs, counter->frees, counter->live_bytes);
+		}
+	}
+	fprintf(out, "live: %zu bytes, peak: %zu bytes\n", stats.live_bytes, stats.peak_bytes);
+
+	int i;
+	for(i=0; i<stats.history_length; i++) {
+		char timestamp[32];
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&stats.history[i].time));
+		fprintf(out, "  %s live %10zu peak %10zu\n", timestamp, stats.history[i].live_bytes, stats.history[i].peak_bytes);
+	}
+}
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Compare benchmark results against a baseline
+#
+# Usage: perf_check.sh <results> <baseline> [tolerance in percent]
+#
+# Both files start with a comment line describing the host and build they
+# were recorded on, followed by lines of the form
+# `<name> <value> <unit> <higher|lower>'. The tolerance only covers the noise
+# between runs on one host, so files from different hosts or builds are not
+# compared at all. Otherwise, prints a table of both values and the relative
+# change, and exits non-zero if any benchmark got worse by more than the
+# tolerance (default 15%) or is missing from the results.
+#
+
+RESULTS="$1"
+BASELINE="$2"
+TOLERANCE="${3:-15}"
+
+if [ ! -r "$RESULTS" -o ! -r "$BASELINE" ]; then
+	echo "Usage: $0 <results> <baseline> [tolerance]" >&2
+	exit 2
+fi
+
+RESULTS_HOST=$(head -n 1 "$RESULTS")
+BASELINE_HOST=$(head -n 1 "$BASELINE")
+if [ "$RESULTS_HOST" != "$BASELINE_HOST" ]; then
+	echo "The baseline was recorded on a different host or build:" >&2
+	echo "  baseline: $BASELINE_HOST" >&2
+	echo "  results:  $RESULTS_HOST" >&2
+	echo "Record a baseline on this host with \`make perf-baseline' first." >&2
+	exit 2
+fi
+
+awk -v tolerance="$TOLERANCE" '
+	/^#/ || NF < 4 { next }
+	FNR == NR { current[$1] = $2; next }
+	{
+		name = $1; base = $2; unit = $3; better = $4
+		if(!(name in current)) {
+			printf "%-24s %14.1f %14s %-6s %9s  %s\n", name, base, "-", unit, "-", "MISSING"
+			failed++
+			next
+		}
+		change = base != 0 ? (current[name] - base) / base * 100 : 0
+		worse = better == "higher" ? -change : change
+		status = worse > tolerance ? "REGRESSED" : (worse < -tolerance ? "improved" : "ok")
+		if(status == "REGRESSED") failed++
+		if(!header++) {
+			printf "%-24s %14s %14s %-6s %9s  %s\n", "benchmark", "baseline", "current", "unit", "change", "status"
+		}
+		printf "%-24s %14.1f %14.1f %-6s %+8.1f%%  %s\n", name, base, current[name], unit, change, status
+	}
+	END {
+		if(failed) {
+			printf "\n%d benchmark(s) regressed by more than %s%%\n", failed, tolerance
+			exit 1
+		}
+		printf "\nAll benchmarks within %s%% of the baseline\n", tolerance
+	}
+' "$RESULTS" "$BASELINE"
@@ -0,0 +1,1207 @@
+/*
+ * UPnP relay daemon - benchmarks
+ *
+ * Runs the parser, store, shared-memory, end-to-end loopback, relay-to-relay,
+ * description proxy, local query, subscription and liveness check benchmarks and
+ * prints one line per result:
+ *
+ *   <name> <value> <unit> <higher|lower>
+ *
+ * where the last column says which direction is better. perf_check.sh compares
+ * this output against the committed baseline.
+ *
+ * Usage: upnprd_bench [-p port] [-r repetitions]
+ *
+ * Along the way, the benchmarks check the outcomes they measure, e.g. which
+ * devices the filter rules reject, and exit non-zero if one is wrong.
+ *
+ * When compiled with ALLOC_STATS, this instead verifies that the relay handles
+ * keep-alives and searches without any heap allocations once it reached its
+ * steady state, and that it does not allocate at all after startup in
+ * fixed-footprint mode, not even within libc. It exits non-zero if either
+ * fails.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../upnprd.h"
+#include "../upnprd_internal.h"
+#include "../upnprd_shm.h"
+
+#define STORE_DEVICES 1000
+#define E2E_DEVICES 100
+
+static unsigned short port = 19000;
+static int repetitions = 5;
+
+static const char *notify_template = "NOTIFY * HTTP/1.1\r\n"
+	"HOST: 239.255.255.250:1900\r\n"
+	"CACHE-CONTROL: max-age=1800\r\n"
+	"LOCATION: http://192.168.%d.%d:49152/description.xml\r\n"
+	"NT: urn:schemas-upnp-org:device:MediaRenderer:1\r\n"
+	"NTS: ssdp:alive\r\n"
+	"SERVER: Linux/3.0 UPnP/1.0 Bench/1.0\r\n"
+	"USN: uuid:4d696e69-444c-164e-9d41-%012d::urn:schemas-upnp-org:device:MediaRenderer:1\r\n"
+	"\r\n";
+
+static const char *search_message = "M-SEARCH * HTTP/1.1\r\n"
+	"HOST: 239.255.255.250:1900\r\n"
+	"MAN: \"ssdp:discover\"\r\n"
+	"MX: 2\r\n"
+	"ST: ssdp:all\r\n"
+	"\r\n";
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int format_notify(char *buf, size_t size, int n) {
+	return snprintf(buf, size, notify_template, (n >> 8) & 0xff, n & 0xff, n);
+}
+
+static upnprd_t *create_instance_with(struct upnprd_config *config) {
+	config->port = port;
+
+	// The benchmarks announce thousands of devices from one address, and
+	// search from one address in quick succession
+	config->admit_rate = 0;
+	config->admit_interface_rate = 0;
+	config->reply_burst = 0;
+
+	upnprd_t *ctx;
+	int err = upnprd_init(&ctx, config);
+	if(err) {
+		fprintf(stderr, "Failed to create relay instance on port %d: %d\n", port, err);
+		exit(1);
+	}
+	return ctx;
+}
+
+static upnprd_t *create_instance() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	return create_instance_with(&config);
+}
+
+static void report(const char *name, double value, const char *unit, const char *better) {
+	printf("%-24s %14.1f %-6s %s\n", name, value, unit, better);
+	fflush(stdout);
+}
+
+/** PARSER *********************************************/
+static double bench_parser() {
+	char message[1024];
+	char buffer[1024];
+	int length = format_notify(message, sizeof(message), 42);
+	const int iterations = 1000000;
+
+	double start = now();
+	int i;
+	for(i=0; i<iterations; i++) {
+		struct ssdp_headers msg;
+		// The parser works in place, so it needs a fresh copy every time
+		memcpy(buffer, message, length + 1);
+		parse_ssdp_headers(buffer, &msg);
+		if(msg.headers[USN][0] == 0) {
+			abort();
+		}
+	}
+	return iterations / (now() - start);
+}
+
+/** STORE **********************************************/
+static void store_fill(upnprd_t *ctx, int count) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int i;
+	for(i=0; i<count; i++) {
+		char buffer[1024];
+		struct ssdp_headers msg;
+		format_notify(buffer, sizeof(buffer), i);
+		parse_ssdp_headers(buffer, &msg);
+		update_device(ctx, &msg, &addr, 0);
+	}
+}
+
+static double bench_store_insert() {
+	const int rounds = 20;
+	double elapsed = 0;
+	int i;
+	for(i=0; i<rounds; i++) {
+		upnprd_t *ctx = create_instance();
+		double start = now();
+		store_fill(ctx, STORE_DEVICES);
+		elapsed += now() - start;
+		upnprd_shutdown(ctx);
+	}
+	return rounds * STORE_DEVICES / elapsed;
+}
+
+/*
+ * What filter rules mean: A device, the rules as filter_deny, filter_allow
+ * and filter_zones, and the expected verdict (-1 for a compile error), zones
+ * or error
+ */
+static const struct {
+	const char *usn, *st, *location;
+	const char *deny, *allow, *zones;
+	int cached;
+	unsigned char zone_bits;
+	const char *error;
+} filter_cases[] = {
+	// Globs match the whole value
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:urn:x", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:urn:x:*", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:x:1", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:urn:x:[!1]", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:2", "urn:x:2", "http://10.0.0.1:80/d.xml", "st:urn:x:[!1]", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:urn:x:\\*", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:*", "urn:x:*", "http://10.0.0.1:80/d.xml", "st:urn:x:\\*", "", "", 0, 0, NULL },
+
+	// Regular expressions match anywhere unless anchored
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "usn:/abc/", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "usn:/^abc/", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "usn:/^uuid:abc/", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "location:/xml$/", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "location:/d$/", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:/^urn:(y|x):1$/", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:z:1", "urn:z:1", "http://10.0.0.1:80/d.xml", "st:/^urn:(y|x):1$/", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "location:/:\\d+\\//", "", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://host/d.xml", "location:/:\\d+\\//", "", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "usn:/^\\w+:\\w+::/", "", "", 0, 0, NULL },
+	{ "uuid:a-b::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "usn:/^\\w+:\\w+::/", "", "", 1, 0, NULL },
+
+	// Deny takes precedence over allow, and zones are bits in order
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "st:urn:x:1", "st:urn:x:*", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "", "st:urn:y:*", "", 0, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "", "st:urn:x:*", "", 1, 0, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "", "", "eth*=st:urn:x:* wlan*=st:none,usn:/abc/", 1, 3, NULL },
+	{ "uuid:abc::urn:x:1", "urn:x:1", "http://10.0.0.1:80/d.xml", "", "", "eth*=st:none wlan*=usn:/abc/", 1, 2, NULL },
+
+	// Compile errors
+	{ "", "", "", "st:[abc", "", "", -1, 0, "unterminated [" },
+	{ "", "", "", "usn:/*a/", "", "", -1, 0, "nothing to repeat" },
+	{ "", "", "", "usn:/a)/", "", "", -1, 0, "unmatched )" },
+	{ "", "", "", "usn:/(a/", "", "", -1, 0, "unterminated (" },
+};
+
+static void check_filters() {
+	// filter_match() only reads the instance's rules
+	upnprd_t *ctx = (upnprd_t *)calloc(1, sizeof(upnprd_t));
+	int i;
+	for(i=0; i<sizeof(filter_cases)/sizeof(filter_cases[0]); i++) {
+		struct upnprd_config config;
+		upnprd_config_init(&config);
+		strcpy(config.filter_deny, filter_cases[i].deny);
+		strcpy(config.filter_allow, filter_cases[i].allow);
+		strcpy(config.filter_zones, filter_cases[i].zones);
+
+		char error[128] = "";
+		int cached = -1;
+		unsigned char zones = 0;
+		if(filter_compile(ctx, &config, &ctx->filter, error, sizeof(error)) == 0) {
+			cached = filter_match(ctx, filter_cases[i].usn, filter_cases[i].st, filter_cases[i].location, &zones);
+			filter_free(ctx, &ctx->filter);
+		}
+		if(cached != filter_cases[i].cached || (cached == 1 && zones != filter_cases[i].zone_bits) ||
+				(cached < 0 && strcmp(error, filter_cases[i].error) != 0)) {
+			fprintf(stderr, "Filter rules %s / %s / %s judged %s wrongly: %d, zones %d, error \"%s\"\n",
+				filter_cases[i].deny, filter_cases[i].allow, filter_cases[i].zones, filter_cases[i].usn, cached, zones, error);
+			exit(1);
+		}
+	}
+	free(ctx);
+}
+
+/*
+ * Inserts with a typical set of device filters, none of which rejects the
+ * devices inserted, to show the cost of evaluating them
+ */
+static double bench_store_insert_filtered() {
+	// Make sure the rules mean what they say before measuring them
+	check_filters();
+
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	strcpy(config.filter_deny, "st:urn:schemas-upnp-org:device:Printer:* st:urn:schemas-upnp-org:service:PrintBasic:* "
+		"usn:/^uuid:(cafe|beef)[0-9a-f-]*::/ location:/:(8080|5000)\\// st:urn:dial-multiscreen-org:*");
+	strcpy(config.filter_zones, "guest*=st:urn:schemas-upnp-org:device:MediaRenderer:*,st:upnp:rootdevice iot*=st:/^urn:.*:(Basic|Light):[0-9]+$/");
+	const int rounds = 20;
+	double elapsed = 0;
+	int i;
+	for(i=0; i<rounds; i++) {
+		upnprd_t *ctx = create_instance_with(&config);
+		double start = now();
+		store_fill(ctx, STORE_DEVICES);
+		elapsed += now() - start;
+
+		struct upnprd_stats stats;
+		upnprd_stats(ctx, &stats);
+		if(stats.devices_filtered) {
+			fprintf(stderr, "Filters rejected benchmark devices\n");
+			exit(1);
+		}
+		upnprd_shutdown(ctx);
+	}
+	return rounds * STORE_DEVICES / elapsed;
+}
+
+static double bench_store_keepalive() {
+	upnprd_t *ctx = create_instance();
+	store_fill(ctx, STORE_DEVICES);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// Pre-parse the keep-alives, only the store is measured here
+	static char buffers[STORE_DEVICES][1024];
+	static struct ssdp_headers msgs[STORE_DEVICES];
+	int i;
+	for(i=0; i<STORE_DEVICES; i++) {
+		format_notify(buffers[i], sizeof(buffers[i]), i);
+		parse_ssdp_headers(buffers[i], &msgs[i]);
+	}
+
+	const int iterations = 100000;
+	double start = now();
+	for(i=0; i<iterations; i++) {
+		update_device(ctx, &msgs[(i * 7919) % STORE_DEVICES], &addr, 0);
+	}
+	double result = iterations / (now() - start);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+/*
+ * Sweeps over a full store in which nothing has timed out yet, the common
+ * case. Measures the per-device cost of the timeout check.
+ */
+static double bench_store_sweep() {
+	upnprd_t *ctx = create_instance();
+	store_fill(ctx, STORE_DEVICES);
+
+	const int iterations = 20000;
+	double start = now();
+	int i;
+	for(i=0; i<iterations; i++) {
+		remove_outdated_devices(ctx);
+	}
+	double result = (double)iterations * STORE_DEVICES / (now() - start);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+/** SHARED MEMORY ***************************************/
+static upnprd_t *create_shm_instance() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	snprintf(config.shm_name, sizeof(config.shm_name), "/upnprd_bench_%d", (int)getpid());
+	config.shm_size = 1 << 20;
+	upnprd_t *ctx = create_instance_with(&config);
+	store_fill(ctx, STORE_DEVICES);
+	shm_publish(ctx);
+	return ctx;
+}
+
+/* Rewrites of a full table, as after every batch that changed the cache */
+static double bench_shm_publish() {
+	upnprd_t *ctx = create_shm_instance();
+
+	const int iterations = 10000;
+	double start = now();
+	int i;
+	for(i=0; i<iterations; i++) {
+		ctx->shm_dirty = 1;
+		shm_publish(ctx);
+	}
+	double result = iterations / (now() - start);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+/* USN lookups of a reader through the reader library */
+static double bench_shm_lookup() {
+	upnprd_t *ctx = create_shm_instance();
+	upnprd_shm_reader_t *shm = upnprd_shm_open(ctx->config.shm_name);
+	if(!shm) {
+		perror("upnprd_shm_open");
+		exit(1);
+	}
+
+	static char usns[STORE_DEVICES][128];
+	int i;
+	for(i=0; i<STORE_DEVICES; i++) {
+		snprintf(usns[i], sizeof(usns[i]), "uuid:4d696e69-444c-164e-9d41-%012d::urn:schemas-upnp-org:device:MediaRenderer:1", i);
+	}
+
+	const int iterations = 20000;
+	char location[256];
+	double start = now();
+	for(i=0; i<iterations; i++) {
+		if(upnprd_shm_find_location(shm, usns[(i * 7919) % STORE_DEVICES], location, sizeof(location)) < 0) {
+			abort();
+		}
+	}
+	double result = iterations / (now() - start);
+	upnprd_shm_close(shm);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+/** END TO END ******************************************/
+static int create_client(const char *ip, struct sockaddr_in *relay) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	memset(relay, 0, sizeof(*relay));
+	relay->sin_family = AF_INET;
+	relay->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	relay->sin_port = htons(port);
+	return fd;
+}
+
+/*
+ * Run the relay's event loop for at most timeout seconds. Returns early once
+ * client_fd becomes readable, if given, or once the relay has nothing left to
+ * read.
+ */
+static int run_relay(upnprd_t *ctx, int client_fd, double timeout) {
+	fd_set readfds;
+	fd_set writefds;
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	int highest_fd = upnprd_prep_fd_set(ctx, &readfds, &writefds);
+	if(client_fd >= 0) {
+		FD_SET(client_fd, &readfds);
+		if(client_fd > highest_fd) {
+			highest_fd = client_fd;
+		}
+	}
+	struct timeval tv = { (int)timeout, (int)((timeout - (int)timeout) * 1e6) };
+	int ready = select(highest_fd + 1, &readfds, &writefds, NULL, &tv);
+	if(ready <= 0) {
+		return ready;
+	}
+	if(upnprd_poll(ctx, &readfds, &writefds)) {
+		fprintf(stderr, "Relay failed\n");
+		exit(1);
+	}
+	return client_fd >= 0 && FD_ISSET(client_fd, &readfds) ? 2 : 1;
+}
+
+/*
+ * Let the relay process its start-up discovery traffic, which would otherwise
+ * interfere with the measurements
+ */
+static void settle(upnprd_t *ctx) {
+	while(run_relay(ctx, -1, 0.05) > 0);
+}
+
+static double bench_e2e_notify() {
+	upnprd_t *ctx = create_instance();
+	settle(ctx);
+	struct sockaddr_in relay;
+	int client = create_client("127.0.0.2", &relay);
+
+	char messages[E2E_DEVICES][1024];
+	int lengths[E2E_DEVICES];
+	int i;
+	for(i=0; i<E2E_DEVICES; i++) {
+		lengths[i] = format_notify(messages[i], sizeof(messages[i]), i);
+	}
+
+	// Send in batches small enough to never overflow the socket buffer
+	const int batches = 200;
+	const int batch_size = 50;
+	double start = now();
+	int batch;
+	for(batch=0; batch<batches; batch++) {
+		for(i=0; i<batch_size; i++) {
+			int n = (batch * batch_size + i) % E2E_DEVICES;
+			sendto(client, messages[n], lengths[n], 0, (struct sockaddr *)&relay, sizeof(relay));
+		}
+		while(run_relay(ctx, -1, 0) > 0);
+	}
+	double result = batches * batch_size / (now() - start);
+
+	close(client);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Median latency of a search answered with E2E_DEVICES devices */
+static double search_latency(struct upnprd_config *config) {
+	upnprd_t *ctx = create_instance_with(config);
+	struct sockaddr_in relay;
+	// The relay does not reply with devices on the requestee's host, so
+	// announce them from a different address than the one searching
+	int announcer = create_client("127.0.0.2", &relay);
+	int client = create_client("127.0.0.3", &relay);
+
+	int i;
+	for(i=0; i<E2E_DEVICES; i++) {
+		char buffer[1024];
+		int length = format_notify(buffer, sizeof(buffer), i);
+		sendto(announcer, buffer, length, 0, (struct sockaddr *)&relay, sizeof(relay));
+		while(run_relay(ctx, -1, 0) > 0);
+	}
+	settle(ctx);
+
+	const int iterations = 200;
+	double latencies[200];
+	for(i=0; i<iterations; i++) {
+		double start = now();
+		sendto(client, search_message, strlen(search_message), 0, (struct sockaddr *)&relay, sizeof(relay));
+
+		int replies = 0;
+		while(replies < E2E_DEVICES) {
+			if(run_relay(ctx, client, 1.) == 0) {
+				fprintf(stderr, "Search timed out after %d replies\n", replies);
+				exit(1);
+			}
+			char buffer[2048];
+			while(recv(client, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+				replies++;
+			}
+		}
+		latencies[i] = (now() - start) * 1e6;
+	}
+	qsort(latencies, iterations, sizeof(double), compare_doubles);
+
+	close(announcer);
+	close(client);
+	upnprd_shutdown(ctx);
+	return latencies[iterations / 2];
+}
+
+static double bench_e2e_search() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	return search_latency(&config);
+}
+
+/* The same with loopback isolated, such that each device's bit is tested */
+static double bench_e2e_search_isolated() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	config.visibility_interfaces = 1024;
+	strcpy(config.visibility_isolate, "lo");
+	return search_latency(&config);
+}
+
+/*
+ * Two relays connected over loopback, either as synchronization peers or
+ * through a tunnel: Announce devices to the first one, and measure the time
+ * until the second one knows about all of them
+ */
+static unsigned long tunnel_bytes;
+
+static double converge(int tunnel) {
+	struct upnprd_config config;
+	upnprd_t *relays[2];
+	int i;
+	for(i=0; i<2; i++) {
+		char peer[64];
+		snprintf(peer, sizeof(peer), "127.0.0.1:%d", port + 11 - i);
+		upnprd_config_init(&config);
+		config.port = port + i;
+		if(tunnel) {
+			config.tunnel_port = port + 10 + i;
+			strcpy(config.tunnel_peer, peer);
+		}
+		else {
+			config.sync_port = port + 10 + i;
+			strcpy(config.sync_peers, peer);
+		}
+		if(upnprd_init(&relays[i], &config)) {
+			fprintf(stderr, "Failed to create relay instance on port %d\n", config.port);
+			exit(1);
+		}
+	}
+	for(i=0; i<2; i++) {
+		settle(relays[i]);
+	}
+
+	struct sockaddr_in relay;
+	int announcer = create_client("127.0.0.2", &relay);
+	double start = now();
+	for(i=0; i<E2E_DEVICES; i++) {
+		char buffer[1024];
+		int length = format_notify(buffer, sizeof(buffer), i);
+		sendto(announcer, buffer, length, 0, (struct sockaddr *)&relay, sizeof(relay));
+	}
+
+	struct upnprd_stats stats;
+	do {
+		if(now() - start > 5) {
+			fprintf(stderr, "Relays did not converge\n");
+			exit(1);
+		}
+		run_relay(relays[0], -1, 0.001);
+		run_relay(relays[1], -1, 0.001);
+		upnprd_stats(relays[1], &stats);
+	} while(stats.devices < E2E_DEVICES);
+	double result = (now() - start) * 1e3;
+
+	upnprd_stats(relays[0], &stats);
+	tunnel_bytes = stats.tunnel_bytes_sent;
+
+	close(announcer);
+	for(i=0; i<2; i++) {
+		upnprd_shutdown(relays[i]);
+	}
+	return result;
+}
+
+static double bench_sync_converge() {
+	return converge(0);
+}
+
+static double bench_tunnel_converge() {
+	return converge(1);
+}
+
+/*
+ * The description proxy, against a stand-in HTTP server for the device:
+ * Announce a device, let the relay fetch its description, and measure
+ * requests for it through the proxy. The stand-in must be asked only once.
+ * Before, check that the relative URLs in the description are served
+ * resolved against the device, and that a description due for revalidation
+ * is kept when the device answers 304.
+ */
+static const char *description = "<?xml version=\"1.0\"?>\n"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+	"<specVersion><major>1</major><minor>0</minor></specVersion>\n"
+	"<device><deviceType>urn:schemas-upnp-org:device:MediaRenderer:1</deviceType>"
+	"<friendlyName>Bench</friendlyName><presentationURL>http://192.0.2.1/</presentationURL>\n"
+	"<serviceList><service><SCPDURL>scpd.xml</SCPDURL><controlURL>/abs</controlURL>"
+	"<eventSubURL>//192.0.2.1:1900/event</eventSubURL></service></serviceList></device>\n"
+	"</root>\n";
+
+// How the URLs in the description must be served, for a LOCATION of
+// http://127.0.0.1:<port>/device/description.xml
+static const char *resolved_urls[] = {
+	"<presentationURL>http://192.0.2.1/</presentationURL>",
+	"<SCPDURL>http://127.0.0.1:%d/device/scpd.xml</SCPDURL>",
+	"<controlURL>http://127.0.0.1:%d/abs</controlURL>",
+	"<eventSubURL>http://192.0.2.1:1900/event</eventSubURL>",
+};
+
+/* A TCP socket on loopback, listening on or connected to tcp_port */
+static int create_tcp_socket(unsigned short tcp_port, int listening) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(tcp_port);
+	if(listening) {
+		int yes = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+			perror("bind");
+			exit(1);
+		}
+	}
+	else if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Read from fd until the peer closes the connection, running the relay meanwhile */
+static size_t read_response(upnprd_t *ctx, int fd, char *buffer, size_t size) {
+	size_t length = 0;
+	while(1) {
+		if(run_relay(ctx, fd, 1.) == 0) {
+			fprintf(stderr, "Proxy request timed out\n");
+			exit(1);
+		}
+		ssize_t nbytes;
+		while((nbytes = recv(fd, buffer + length, size - 1 - length, MSG_DONTWAIT)) > 0) {
+			length += nbytes;
+		}
+		if(nbytes == 0) {
+			buffer[length] = 0;
+			return length;
+		}
+	}
+}
+
+/*
+ * Accept the relay's next fetch on origin, as the stand-in for the device,
+ * and answer it with response. The request is left in buffer.
+ */
+static void serve_description(upnprd_t *ctx, int origin, const char *response, char *buffer, size_t size) {
+	while(run_relay(ctx, origin, 1.) != 2);
+	int connection = accept(origin, NULL, NULL);
+	size_t length = 0;
+	buffer[0] = 0;
+	while(!strstr(buffer, "\r\n\r\n")) {
+		run_relay(ctx, connection, 1.);
+		ssize_t nbytes = recv(connection, buffer + length, size - 1 - length, MSG_DONTWAIT);
+		if(nbytes > 0) {
+			length += nbytes;
+			buffer[length] = 0;
+		}
+	}
+	send(connection, response, strlen(response), 0);
+	close(connection);
+}
+
+/*
+ * Start a relay proxying with config, announce a device to it, and serve the
+ * device's description once. The request for the proxied copy is left in
+ * request.
+ */
+static upnprd_t *start_proxy(struct upnprd_config *config, int origin, char *request, size_t request_size) {
+	config->proxy_port = port + 20;
+	upnprd_t *ctx = create_instance_with(config);
+	settle(ctx);
+
+	struct sockaddr_in relay;
+	int announcer = create_client("127.0.0.2", &relay);
+	char buffer[4096];
+	int length = snprintf(buffer, sizeof(buffer), "NOTIFY * HTTP/1.1\r\nLOCATION: http://127.0.0.1:%d/device/description.xml\r\n"
+		"NT: upnp:rootdevice\r\nNTS: ssdp:alive\r\nUSN: uuid:bench::upnp:rootdevice\r\n\r\n", port + 21);
+	sendto(announcer, buffer, length, 0, (struct sockaddr *)&relay, sizeof(relay));
+	close(announcer);
+
+	char response[2048];
+	snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nETAG: \"bench\"\r\nCONTENT-LENGTH: %zu\r\n\r\n%s", strlen(description), description);
+	serve_description(ctx, origin, response, buffer, sizeof(buffer));
+
+	// Find the rewritten LOCATION through a search
+	int searcher = create_client("127.0.0.3", &relay);
+	sendto(searcher, search_message, strlen(search_message), 0, (struct sockaddr *)&relay, sizeof(relay));
+	char *path = NULL;
+	while(!path) {
+		if(run_relay(ctx, searcher, 1.) == 0) {
+			fprintf(stderr, "Search timed out\n");
+			exit(1);
+		}
+		ssize_t nbytes = recv(searcher, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+		if(nbytes > 0) {
+			buffer[nbytes] = 0;
+			path = strstr(buffer, "LOCATION: http://127.0.0.1:");
+		}
+	}
+	close(searcher);
+	path = strchr(path + 17, '/');
+	snprintf(request, request_size, "GET %.*s HTTP/1.1\r\n\r\n", (int)strcspn(path, "\r"), path);
+	return ctx;
+}
+
+/* Request the proxied description, leaving the response in buffer */
+static void proxy_get(upnprd_t *ctx, const char *request, char *buffer, size_t size) {
+	int client = create_tcp_socket(port + 20, 0);
+	send(client, request, strlen(request), 0);
+	read_response(ctx, client, buffer, size);
+	close(client);
+}
+
+static void check_proxy(int origin) {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	config.proxy_max_age = 0;
+	char request[64];
+	upnprd_t *ctx = start_proxy(&config, origin, request, sizeof(request));
+
+	char buffer[4096];
+	proxy_get(ctx, request, buffer, sizeof(buffer));
+	int i;
+	for(i=0; i<sizeof(resolved_urls)/sizeof(resolved_urls[0]); i++) {
+		char expected[128];
+		snprintf(expected, sizeof(expected), resolved_urls[i], port + 21);
+		if(!strstr(buffer, expected)) {
+			fprintf(stderr, "Proxied description lacks %s:\n%s\n", expected, buffer);
+			exit(1);
+		}
+	}
+
+	// With a proxy_max_age of 0, the request made the description due for
+	// revalidation
+	serve_description(ctx, origin, "HTTP/1.1 304 Not Modified\r\n\r\n", buffer, sizeof(buffer));
+	if(!strstr(buffer, "IF-NONE-MATCH: \"bench\"\r\n")) {
+		fprintf(stderr, "Proxy did not revalidate with the ETag:\n%s\n", buffer);
+		exit(1);
+	}
+	struct upnprd_stats stats;
+	upnprd_stats(ctx, &stats);
+	for(i=0; i<20 && !stats.proxy_not_modified && !stats.proxy_failures; i++) {
+		run_relay(ctx, -1, .05);
+		upnprd_stats(ctx, &stats);
+	}
+	proxy_get(ctx, request, buffer, sizeof(buffer));
+	if(stats.proxy_not_modified != 1 || stats.proxy_failures || !strstr(buffer, "<SCPDURL>")) {
+		fprintf(stderr, "Proxy did not keep the description the device still had\n");
+		exit(1);
+	}
+
+	// Answer the revalidation this request triggered, too, such that
+	// nothing is left for the benchmark
+	serve_description(ctx, origin, "HTTP/1.1 304 Not Modified\r\n\r\n", buffer, sizeof(buffer));
+	upnprd_shutdown(ctx);
+}
+
+static double bench_proxy_hit() {
+	int origin = create_tcp_socket(port + 21, 1);
+	check_proxy(origin);
+
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	char request[64];
+	upnprd_t *ctx = start_proxy(&config, origin, request, sizeof(request));
+
+	const int iterations = 200;
+	double latencies[200];
+	char buffer[4096];
+	int i;
+	for(i=0; i<iterations; i++) {
+		double start = now();
+		proxy_get(ctx, request, buffer, sizeof(buffer));
+		latencies[i] = (now() - start) * 1e6;
+	}
+	qsort(latencies, iterations, sizeof(double), compare_doubles);
+
+	struct upnprd_stats stats;
+	upnprd_stats(ctx, &stats);
+	if(stats.proxy_fetches != 1 || stats.proxy_hits < iterations) {
+		fprintf(stderr, "Proxy did not serve the description from its cache\n");
+		exit(1);
+	}
+
+	close(origin);
+	upnprd_shutdown(ctx);
+	return latencies[iterations / 2];
+}
+
+static int connect_query_socket(const char *path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	return fd;
+}
+
+/*
+ * Local query API: Ask for the E2E_DEVICES cached devices by type over the
+ * query socket, as the equivalent of the search above without the network
+ */
+static double bench_query_st() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	snprintf(config.query_socket, sizeof(config.query_socket), "/tmp/upnprd_bench.%d.sock", (int)getpid());
+	upnprd_t *ctx = create_instance_with(&config);
+	store_fill(ctx, E2E_DEVICES);
+	settle(ctx);
+
+	int client = connect_query_socket(config.query_socket);
+	const char *request = "st urn:schemas-upnp-org:device:MediaRenderer:1\n";
+	char expected[32];
+	snprintf(expected, sizeof(expected), "end\t%d\n", E2E_DEVICES);
+
+	const int iterations = 200;
+	double latencies[200];
+	int i;
+	for(i=0; i<iterations; i++) {
+		double start = now();
+		send(client, request, strlen(request), 0);
+
+		char buffer[32768];
+		size_t length = 0;
+		buffer[0] = 0;
+		while(length < strlen(expected) || strcmp(buffer + length - strlen(expected), expected) != 0) {
+			if(run_relay(ctx, client, 1.) == 0) {
+				fprintf(stderr, "Query timed out\n");
+				exit(1);
+			}
+			ssize_t nbytes;
+			while((nbytes = recv(client, buffer + length, sizeof(buffer) - 1 - length, MSG_DONTWAIT)) > 0) {
+				length += nbytes;
+				buffer[length] = 0;
+			}
+		}
+		latencies[i] = (now() - start) * 1e6;
+	}
+	qsort(latencies, iterations, sizeof(double), compare_doubles);
+
+	close(client);
+	upnprd_shutdown(ctx);
+	return latencies[iterations / 2];
+}
+
+/* Subscriptions: Announce new devices, and wait for the event on each */
+static double bench_subscribe_event() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	snprintf(config.query_socket, sizeof(config.query_socket), "/tmp/upnprd_bench.%d.sock", (int)getpid());
+	upnprd_t *ctx = create_instance_with(&config);
+	settle(ctx);
+
+	struct sockaddr_in relay;
+	int announcer = create_client("127.0.0.2", &relay);
+	int subscriber = connect_query_socket(config.query_socket);
+	const char *request = "subscribe\n";
+	send(subscriber, request, strlen(request), 0);
+
+	char buffer[4096];
+	size_t length = 0;
+	buffer[0] = 0;
+	while(!strstr(buffer, "synced\t0\n")) {
+		run_relay(ctx, subscriber, 1.);
+		ssize_t nbytes = recv(subscriber, buffer + length, sizeof(buffer) - 1 - length, MSG_DONTWAIT);
+		if(nbytes > 0) {
+			length += nbytes;
+			buffer[length] = 0;
+		}
+	}
+
+	const int iterations = 200;
+	double latencies[200];
+	int i;
+	for(i=0; i<iterations; i++) {
+		int message_length = format_notify(buffer, sizeof(buffer), i);
+		double start = now();
+		sendto(announcer, buffer, message_length, 0, (struct sockaddr *)&relay, sizeof(relay));
+
+		length = 0;
+		while(length == 0 || buffer[length - 1] != '\n') {
+			if(run_relay(ctx, subscriber, 1.) == 0) {
+				fprintf(stderr, "Event timed out\n");
+				exit(1);
+			}
+			ssize_t nbytes = recv(subscriber, buffer + length, sizeof(buffer) - 1 - length, MSG_DONTWAIT);
+			if(nbytes > 0) {
+				length += nbytes;
+			}
+		}
+		latencies[i] = (now() - start) * 1e6;
+		if(strncmp(buffer, "added\t", 6) != 0) {
+			fprintf(stderr, "Unexpected event\n");
+			exit(1);
+		}
+	}
+	qsort(latencies, iterations, sizeof(double), compare_doubles);
+
+	close(announcer);
+	close(subscriber);
+	upnprd_shutdown(ctx);
+	return latencies[iterations / 2];
+}
+
+/*
+ * Liveness checks: Announce two devices on each of LIVENESS_ENDPOINTS
+ * endpoints, half of which listen, and measure one round of checks. Each
+ * endpoint must be checked once, and exactly the devices on the closed ones
+ * must be removed. A round only starts a second after the announcements, so
+ * this runs once rather than best of several.
+ */
+#define LIVENESS_BENCH_ENDPOINTS 50
+
+static double bench_liveness_round() {
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	config.liveness_interval = 1;
+	config.liveness_failures = 1;
+	upnprd_t *ctx = create_instance_with(&config);
+	settle(ctx);
+
+	struct upnprd_stats stats;
+	upnprd_stats(ctx, &stats);
+	unsigned long devices = stats.devices;
+
+	struct sockaddr_in relay;
+	int announcer = create_client("127.0.0.2", &relay);
+	int listeners[LIVENESS_BENCH_ENDPOINTS / 2];
+	char buffer[1024];
+	int i;
+	for(i=0; i<LIVENESS_BENCH_ENDPOINTS * 2; i++) {
+		int endpoint = i % LIVENESS_BENCH_ENDPOINTS;
+		if(i < LIVENESS_BENCH_ENDPOINTS / 2) {
+			listeners[i] = create_tcp_socket(port + 30 + i, 1);
+		}
+		int length = snprintf(buffer, sizeof(buffer), "NOTIFY * HTTP/1.1\r\nLOCATION: http://127.0.0.1:%d/device%d.xml\r\n"
+			"NT: upnp:rootdevice\r\nNTS: ssdp:alive\r\nUSN: uuid:liveness-%d::upnp:rootdevice\r\n\r\n", port + 30 + endpoint, i, i);
+		sendto(announcer, buffer, length, 0, (struct sockaddr *)&relay, sizeof(relay));
+		if(i % 20 == 19) {
+			while(run_relay(ctx, -1, 0) > 0);
+		}
+	}
+	while(run_relay(ctx, -1, 0) > 0);
+
+	// Wait for the round to start, then for all endpoints to be checked. The
+	// relay only looks at the clock when polled, so keep announcing the last
+	// device until then.
+	double start = 0, deadline = now() + 5;
+	do {
+		if(now() > deadline) {
+			fprintf(stderr, "Liveness checks timed out\n");
+			exit(1);
+		}
+		if(!start) {
+			sendto(announcer, buffer, strlen(buffer), 0, (struct sockaddr *)&relay, sizeof(relay));
+		}
+		run_relay(ctx, -1, start ? 0.01 : 0.001);
+		upnprd_stats(ctx, &stats);
+		if(!start && stats.liveness_probes) {
+			start = now();
+		}
+	} while(stats.liveness_probes < LIVENESS_BENCH_ENDPOINTS || stats.devices_unreachable < LIVENESS_BENCH_ENDPOINTS);
+	double result = (now() - start) * 1e3;
+
+	// Let the last checks of listening endpoints complete
+	settle(ctx);
+	upnprd_stats(ctx, &stats);
+	if(stats.liveness_probes != LIVENESS_BENCH_ENDPOINTS || stats.liveness_failures != LIVENESS_BENCH_ENDPOINTS / 2 ||
+			stats.devices_unreachable != LIVENESS_BENCH_ENDPOINTS || stats.devices != devices + LIVENESS_BENCH_ENDPOINTS) {
+		fprintf(stderr, "Liveness checks removed the wrong devices\n");
+		exit(1);
+	}
+
+	for(i=0; i<LIVENESS_BENCH_ENDPOINTS / 2; i++) {
+		close(listeners[i]);
+	}
+	close(announcer);
+	upnprd_shutdown(ctx);
+	return result;
+}
+
+/** ALLOCATION CHECK ************************************/
+#ifdef ALLOC_STATS
+/*
+ * upnprd_alloc_stats() only counts the relay's own xmalloc(). To catch what
+ * libc allocates on its behalf, e.g. in getifaddrs(), the heap functions are
+ * wrapped and count every allocation as well.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long heap_allocs;
+
+void *malloc(size_t size) {
+	__sync_fetch_and_add(&heap_allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	__sync_fetch_and_add(&heap_allocs, 1);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__sync_fetch_and_add(&heap_allocs, 1);
+	return __libc_realloc(ptr, size);
+}
+
+static unsigned long count_allocs(struct upnprd_alloc_stats *stats, int msg_type) {
+	unsigned long allocs = 0;
+	int stage;
+	for(stage=0; stage<UPNPRD_ALLOC_STAGES; stage++) {
+		allocs += stats->counters[stage][msg_type].allocs;
+	}
+	return allocs;
+}
+
+/* Announce devices [first, first + count) and search for them a few times */
+static void run_workload(upnprd_t *ctx, int first, int count) {
+	struct sockaddr_in relay;
+	int announcer = create_client("127.0.0.2", &relay);
+	int client = create_client("127.0.0.3", &relay);
+
+	int i;
+	for(i=first; i<first + count; i++) {
+		char buffer[1024];
+		int length = format_notify(buffer, sizeof(buffer), i);
+		sendto(announcer, buffer, length, 0, (struct sockaddr *)&relay, sizeof(relay));
+		while(run_relay(ctx, -1, 0) > 0);
+	}
+	settle(ctx);
+
+	int search;
+	for(search=0; search<10; search++) {
+		sendto(client, search_message, strlen(search_message), 0, (struct sockaddr *)&relay, sizeof(relay));
+		int replies = 0;
+		while(replies < count && run_relay(ctx, client, .2) > 0) {
+			char buffer[2048];
+			while(recv(client, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+				replies++;
+			}
+		}
+
+		#ifdef THREADS
+			// Sender threads recycle their arguments, so let this one
+			// finish before the next search. Otherwise, both rounds could
+			// see a different number of threads at once, and the second
+			// allocate for one more.
+			LOCK(ctx);
+			while(ctx->active_threads > 0) {
+				pthread_cond_wait(&ctx->threads_done, &ctx->device_list_update_mutex);
+			}
+			UNLOCK(ctx);
+		#endif
+	}
+	settle(ctx);
+
+	close(announcer);
+	close(client);
+}
+
+static int check_allocations() {
+	struct upnprd_alloc_stats before, after;
+	int failed = 0;
+
+	// Announce all devices and warm up, then measure a second round of
+	// keep-alives and searches
+	upnprd_t *ctx = create_instance();
+	run_workload(ctx, 0, E2E_DEVICES);
+	upnprd_alloc_stats(ctx, &before);
+	run_workload(ctx, 0, E2E_DEVICES);
+	upnprd_alloc_stats(ctx, &after);
+
+	upnprd_alloc_report(ctx, stdout);
+
+	unsigned long keepalive_allocs = count_allocs(&after, UPNPRD_MSG_NOTIFY) - count_allocs(&before, UPNPRD_MSG_NOTIFY);
+	unsigned long search_allocs = count_allocs(&after, UPNPRD_MSG_SEARCH) - count_allocs(&before, UPNPRD_MSG_SEARCH);
+	printf("\nsteady state: %lu allocations for keep-alives, %lu for searches\n\n", keepalive_allocs, search_allocs);
+	failed |= keepalive_allocs || search_allocs;
+	upnprd_shutdown(ctx);
+
+	// In fixed-footprint mode, there must not be any allocations after
+	// startup, even if the pools overflow
+	struct upnprd_config config;
+	upnprd_config_init(&config);
+	config.pool_devices = E2E_DEVICES / 2;
+	config.pool_send_entries = E2E_DEVICES / 4;
+	config.pool_threads = 2;
+	config.visibility_interfaces = 64;
+	strcpy(config.visibility_isolate, "lo");
+	ctx = create_instance_with(&config);
+	upnprd_alloc_stats(ctx, &before);
+	unsigned long heap_before = heap_allocs;
+	run_workload(ctx, 0, E2E_DEVICES);
+
+	// Have our addresses listed again, see self.c
+	ctx->self_refreshed = 0;
+	run_workload(ctx, E2E_DEVICES, E2E_DEVICES);
+	unsigned long heap_after = heap_allocs;
+	upnprd_alloc_stats(ctx, &after);
+
+	upnprd_alloc_report(ctx, stdout);
+	upnprd_stats_report(ctx, stdout);
+
+	unsigned long pool_allocs = count_allocs(&after, UPNPRD_MSG_NONE) + count_allocs(&after, UPNPRD_MSG_NOTIFY) + count_allocs(&after, UPNPRD_MSG_SEARCH)
+		- count_allocs(&before, UPNPRD_MSG_NONE) - count_allocs(&before, UPNPRD_MSG_NOTIFY) - count_allocs(&before, UPNPRD_MSG_SEARCH);
+	printf("\nfixed footprint: %lu allocations after startup, %lu heap allocations in all\n", pool_allocs, heap_after - heap_before);
+	failed |= pool_allocs != 0 || heap_after != heap_before;
+	upnprd_shutdown(ctx);
+
+	return failed;
+}
+#endif
+
+/** MAIN ************************************************/
+static double best_of(double (*benchmark)(), int higher_is_better) {
+	double best = benchmark();
+	int i;
+	for(i=1; i<repetitions; i++) {
+		double value = benchmark();
+		if(higher_is_better ? value > best : value < best) {
+			best = value;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while((opt = getopt(argc, argv, "p:r:")) != -1) {
+		switch(opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'r':
+				repetitions = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p port] [-r repetitions]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	#ifdef ALLOC_STATS
+		return check_allocations();
+	#endif
+
+	report("parser_notify", best_of(bench_parser, 1), "msg/s", "higher");
+	report("store_insert_1k", best_of(bench_store_insert, 1), "op/s", "higher");
+	report("store_insert_filtered_1k", best_of(bench_store_insert_filtered, 1), "op/s", "higher");
+	report("store_keepalive_1k", best_of(bench_store_keepalive, 1), "op/s", "higher");
+	report("store_sweep_1k", best_of(bench_store_sweep, 1), "dev/s", "higher");
+	report("shm_publish_1k", best_of(bench_shm_publish, 1), "op/s", "higher");
+	report("shm_lookup_1k", best_of(bench_shm_lookup, 1), "op/s", "higher");
+	report("e2e_notify", best_of(bench_e2e_notify, 1), "msg/s", "higher");
+	report("e2e_search_100_p50", best_of(bench_e2e_search, 0), "us", "lower");
+	report("e2e_search_isolated_p50", best_of(bench_e2e_search_isolated, 0), "us", "lower");
+	report("sync_converge_100", best_of(bench_sync_converge, 0), "ms", "lower");
+	report("tunnel_converge_100", best_of(bench_tunnel_converge, 0), "ms", "lower");
+	report("tunnel_bytes_100", tunnel_bytes, "bytes", "lower");
+	report("proxy_hit_p50", best_of(bench_proxy_hit, 0), "us", "lower");
+	report("query_st_100_p50", best_of(bench_query_st, 0), "us", "lower");
+	report("subscribe_event_p50", best_of(bench_subscribe_event, 0), "us", "lower");
+	report("liveness_round_50", bench_liveness_round(), "ms", "lower");
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * UPnP relay daemon - reply budgets
+ *
+ * A single M-SEARCH of about a hundred bytes makes the relay reply with its
+ * whole cache, which can be hundreds of kilobytes. Since the sender address of
+ * a UDP datagram is easily spoofed, an unlimited relay could be used to
+ * reflect and amplify traffic towards any host.
+ *
+ * Each destination therefore has a byte budget: It may receive reply_burst
+ * bytes, plus reply_amplification times the bytes of the searches it sent.
+ * Both the bytes sent to it and those received from it are kept in counters
+ * that halve every BUDGET_HALF_LIFE_MS, so a destination regains its budget
+ * over time. A search from a destination with an exhausted budget is dropped
+ * before any work is done for it; otherwise, replies stop once the budget is
+ * used up. Interfaces not matching reply_limit_interfaces are exempt.
+ * Budgets are off unless reply_burst is set.
+ *
+ * As with the admission limits, the counters live in a fixed-size hash table,
+ * reusing the entry used least recently once it is full.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <fnmatch.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+#define BUDGET_HALF_LIFE_MS 2000
+
+// Slots probed for a destination before an entry is reused
+#define BUDGET_PROBES 8
+
+static struct reply_budget *find_budget(upnprd_t *ctx, uint32_t key) {
+	unsigned int slot = (key * 2654435769u) >> 16;
+	struct reply_budget *victim = NULL;
+	int i;
+	for(i=0; i<BUDGET_PROBES; i++) {
+		struct reply_budget *budget = &ctx->reply_budgets[(slot + i) & (REPLY_BUDGETS - 1)];
+		if(!budget->used) {
+			victim = budget;
+			break;
+		}
+		if(budget->key == key) {
+			return budget;
+		}
+		if(!victim || ctx->now_ms - budget->updated_ms > ctx->now_ms - victim->updated_ms) {
+			victim = budget;
+		}
+	}
+
+	memset(victim, 0, sizeof(*victim));
+	victim->used = 1;
+	victim->key = key;
+	victim->updated_ms = ctx->now_ms;
+	return victim;
+}
+
+static uint32_t decay(uint32_t value, uint32_t elapsed) {
+	uint32_t halvings = elapsed / BUDGET_HALF_LIFE_MS;
+	if(halvings >= 32) {
+		return 0;
+	}
+	value >>= halvings;
+
+	// Between two halvings, interpolate linearly
+	return value - (uint64_t)value * (elapsed % BUDGET_HALF_LIFE_MS) / (2 * BUDGET_HALF_LIFE_MS);
+}
+
+/* Whether replies on the given interface are limited, cached per interface index */
+static int interface_limited(upnprd_t *ctx, int ifindex) {
+	const char *patterns = ctx->config.reply_limit_interfaces;
+	if(!patterns[0] || ifindex <= 0) {
+		return 1;
+	}
+
+	struct budget_interface *cached = &ctx->budget_interfaces[ifindex & (BUDGET_INTERFACES - 1)];
+	if(cached->ifindex != ifindex) {
+		char name[IF_NAMESIZE];
+		cached->ifindex = ifindex;
+		cached->limited = 1;
+		if(if_indextoname(ifindex, name)) {
+			cached->limited = 0;
+			char pattern[sizeof(ctx->config.reply_limit_interfaces)];
+			while(*patterns) {
+				size_t length = strcspn(patterns, " \t");
+				if(length) {
+					memcpy(pattern, patterns, length);
+					pattern[length] = 0;
+					if(fnmatch(pattern, name, 0) == 0) {
+						cached->limited = 1;
+						break;
+					}
+				}
+				patterns += length;
+				patterns += strspn(patterns, " \t");
+			}
+		}
+	}
+	return cached->limited;
+}
+
+size_t budget_reserve(upnprd_t *ctx, struct sockaddr_in *dest, int ifindex, size_t request_length) {
+	struct upnprd_config *config = &ctx->config;
+	if(!config->reply_burst || !interface_limited(ctx, ifindex)) {
+		return SIZE_MAX;
+	}
+
+	LOCK(ctx);
+	struct reply_budget *budget = find_budget(ctx, dest->sin_addr.s_addr);
+	uint32_t elapsed = ctx->now_ms - budget->updated_ms;
+	budget->updated_ms = ctx->now_ms;
+	budget->sent = decay(budget->sent, elapsed);
+	budget->received = decay(budget->received, elapsed);
+	if(budget->received < UINT32_MAX - request_length) {
+		budget->received += request_length;
+	}
+
+	uint64_t allowance = config->reply_burst + (uint64_t)config->reply_amplification * budget->received;
+	size_t available = 0;
+	if(allowance > budget->sent) {
+		available = allowance - budget->sent;
+		if(available > UINT32_MAX - budget->sent) {
+			available = UINT32_MAX - budget->sent;
+		}
+		// Reserve everything, the sender refunds what it did not use
+		budget->sent += available;
+	}
+	else {
+		ctx->stats.searches_limited++;
+	}
+	UNLOCK(ctx);
+	return available;
+}
+
+void budget_refund(upnprd_t *ctx, struct sockaddr_in *dest, size_t unused) {
+	if(!unused || unused == SIZE_MAX) {
+		return;
+	}
+	// The caller holds the lock
+	struct reply_budget *budget = find_budget(ctx, dest->sin_addr.s_addr);
+	budget->sent = budget->sent > unused ? budget->sent - unused : 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * UPnP relay daemon - configuration
+ *
+ * Defaults and the configuration file parser. The file consists of lines of
+ * the form
+ *
+ *   <option> <value>
+ *
+ * Empty lines and everything following a # are ignored. See the options[]
+ * table below for the known options.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+void upnprd_config_init(struct upnprd_config *config) {
+	memset(config, 0, sizeof(*config));
+	config->port = 1900;
+	config->device_timeout = 12*3600;
+	config->sweep_interval = 1800;
+	config->max_age = 1800;
+	config->max_age_min = 60;
+	config->max_age_max = 7200;
+	config->search_mx = 5;
+	config->pool_string_bytes = 512;
+	config->pool_send_entries = 256;
+	config->pool_threads = 16;
+	config->shm_size = 65536;
+	config->admit_rate = 60;
+	config->admit_burst = 200;
+	config->admit_quarantine = 600;
+	config->admit_interface_rate = 600;
+	config->admit_interface_burst = 2000;
+	config->reply_burst = 0;
+	config->reply_amplification = 10;
+	config->send_weight_interactive = 8;
+	config->send_weight_background = 1;
+	#ifdef THREADS
+		config->overload_depth = 64;
+	#else
+		config->overload_depth = 8192;
+	#endif
+	config->overload_lag_ms = 250;
+	config->overload_memory = 8192;
+	config->multicast_loop = 1;
+	config->flap_half_life = 900;
+	config->flap_reuse = 750;
+	config->proxy_max_age = 300;
+	config->liveness_failures = 3;
+	config->liveness_concurrency = 4;
+	config->standby_interval = 1;
+	#ifdef IGNORE_DOWN_MESSAGES
+		config->ignore_down_messages = 1;
+	#endif
+}
+
+/** OPTION PARSERS **************************************/
+struct config_option;
+typedef int (*option_parser_t)(const struct config_option *option, struct upnprd_config *config, char *value);
+
+struct config_option {
+	const char *name;
+	option_parser_t parse;
+
+	// Location of the value inside struct upnprd_config
+	size_t offset;
+
+	// Limits for numeric options, the maximum length for strings
+	unsigned long min;
+	unsigned long max;
+};
+
+#define OPTION_VALUE(config, option, type) ((type *)((char *)(config) + (option)->offset))
+
+static int parse_unsigned(const struct config_option *option, char *value, unsigned long *result) {
+	char *end;
+	errno = 0;
+	*result = strtoul(value, &end, 10);
+	if(errno || end == value || *end || *value == '-' || *result < option->min || *result > option->max) {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_uint(const struct config_option *option, struct upnprd_config *config, char *value) {
+	unsigned long result;
+	if(parse_unsigned(option, value, &result) < 0) {
+		return -1;
+	}
+	*OPTION_VALUE(config, option, unsigned int) = result;
+	return 0;
+}
+
+static int parse_ushort(const struct config_option *option, struct upnprd_config *config, char *value) {
+	unsigned long result;
+	if(parse_unsigned(option, value, &result) < 0) {
+		return -1;
+	}
+	*OPTION_VALUE(config, option, unsigned short) = result;
+	return 0;
+}
+
+static int parse_bool(const struct config_option *option, struct upnprd_config *config, char *value) {
+	if(strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0) {
+		*OPTION_VALUE(config, option, unsigned char) = 1;
+	}
+	else if(strcasecmp(value, "no") == 0 || strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+		*OPTION_VALUE(config, option, unsigned char) = 0;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_string(const struct config_option *option, struct upnprd_config *config, char *value) {
+	if(strlen(value) > option->max) {
+		return -1;
+	}
+	strcpy(OPTION_VALUE(config, option, char), value);
+	return 0;
+}
+
+static int parse_peers(const struct config_option *option, struct upnprd_config *config, char *value) {
+	struct sockaddr_in peers[SYNC_MAX_PEERS];
+	if(sync_parse_peers(value, peers, SYNC_MAX_PEERS) < 0) {
+		return -1;
+	}
+	return parse_string(option, config, value);
+}
+
+static int parse_peer(const struct config_option *option, struct upnprd_config *config, char *value) {
+	struct sockaddr_in peer;
+	if(sync_parse_peers(value, &peer, 1) < 0) {
+		return -1;
+	}
+	return parse_string(option, config, value);
+}
+
+/* Filter rules are compiled, together with those of the other filter options read so far */
+static int parse_filter(const struct config_option *option, struct upnprd_config *config, char *value) {
+	char old[sizeof(config->filter_deny)];
+	strcpy(old, OPTION_VALUE(config, option, char));
+	if(parse_string(option, config, value) < 0) {
+		return -1;
+	}
+	struct filter filter;
+	if(filter_compile(NULL, config, &filter, NULL, 0) < 0) {
+		strcpy(OPTION_VALUE(config, option, char), old);
+		return -1;
+	}
+	filter_free(NULL, &filter);
+	return 0;
+}
+
+#define OPTION(name, parser, min, max) { #name, parser, offsetof(struct upnprd_config, name), min, max }
+
+static const struct config_option options[] = {
+	OPTION(port, parse_ushort, 1, 65535),
+	OPTION(device_timeout, parse_uint, 1, 7*24*3600),
+	OPTION(sweep_interval, parse_uint, 1, 7*24*3600),
+	OPTION(max_age, parse_uint, 1, 7*24*3600),
+	OPTION(max_age_adaptive, parse_bool, 0, 1),
+	OPTION(max_age_min, parse_uint, 1, 7*24*3600),
+	OPTION(max_age_max, parse_uint, 1, 7*24*3600),
+	OPTION(search_mx, parse_uint, 1, 120),
+	OPTION(ignore_down_messages, parse_bool, 0, 1),
+	OPTION(multicast_loop, parse_bool, 0, 1),
+	OPTION(byebye_grace, parse_uint, 0, 24*3600),
+	OPTION(flap_half_life, parse_uint, 1, 7*24*3600),
+	OPTION(flap_suppress, parse_uint, 0, 1000000),
+	OPTION(flap_reuse, parse_uint, 0, 1000000),
+	OPTION(pool_devices, parse_uint, 0, 1000000),
+	OPTION(pool_string_bytes, parse_uint, 64, 2048),
+	OPTION(pool_send_entries, parse_uint, 1, 1000000),
+	OPTION(pool_threads, parse_uint, 1, 1024),
+	OPTION(stats_file, parse_string, 0, sizeof(((struct upnprd_config *)0)->stats_file) - 1),
+	OPTION(sync_port, parse_ushort, 0, 65535),
+	OPTION(sync_peers, parse_peers, 0, sizeof(((struct upnprd_config *)0)->sync_peers) - 1),
+	OPTION(standby_priority, parse_uint, 0, 255),
+	OPTION(standby_interval, parse_uint, 1, 60),
+	OPTION(tunnel_port, parse_ushort, 0, 65535),
+	OPTION(tunnel_peer, parse_peer, 0, sizeof(((struct upnprd_config *)0)->tunnel_peer) - 1),
+	OPTION(tunnel_export, parse_string, 0, sizeof(((struct upnprd_config *)0)->tunnel_export) - 1),
+	OPTION(tunnel_import, parse_string, 0, sizeof(((struct upnprd_config *)0)->tunnel_import) - 1),
+	OPTION(shm_name, parse_string, 0, sizeof(((struct upnprd_config *)0)->shm_name) - 1),
+	OPTION(shm_size, parse_uint, 4096, 64*1024*1024),
+	OPTION(admit_rate, parse_uint, 0, 1000000),
+	OPTION(admit_burst, parse_uint, 1, 1000000),
+	OPTION(admit_quarantine, parse_uint, 0, 7*24*3600),
+	OPTION(admit_interface_rate, parse_uint, 0, 1000000),
+	OPTION(admit_interface_burst, parse_uint, 1, 1000000),
+	OPTION(reply_burst, parse_uint, 0, 64*1024*1024),
+	OPTION(reply_amplification, parse_uint, 0, 1000),
+	OPTION(reply_limit_interfaces, parse_string, 0, sizeof(((struct upnprd_config *)0)->reply_limit_interfaces) - 1),
+	OPTION(send_weight_interactive, parse_uint, 1, 1000),
+	OPTION(send_weight_background, parse_uint, 1, 1000),
+	OPTION(overload_depth, parse_uint, 0, 1000000),
+	OPTION(overload_lag_ms, parse_uint, 0, 60000),
+	OPTION(overload_memory, parse_uint, 0, 4*1024*1024),
+	OPTION(proxy_port, parse_ushort, 0, 65535),
+	OPTION(proxy_max_age, parse_uint, 0, 7*24*3600),
+	OPTION(liveness_interval, parse_uint, 0, 7*24*3600),
+	OPTION(liveness_failures, parse_uint, 1, 1000),
+	OPTION(liveness_concurrency, parse_uint, 1, LIVENESS_PROBES),
+	OPTION(liveness_http, parse_bool, 0, 1),
+	OPTION(filter_deny, parse_filter, 0, sizeof(((struct upnprd_config *)0)->filter_deny) - 1),
+	OPTION(filter_allow, parse_filter, 0, sizeof(((struct upnprd_config *)0)->filter_allow) - 1),
+	OPTION(filter_zones, parse_filter, 0, sizeof(((struct upnprd_config *)0)->filter_zones) - 1),
+	OPTION(visibility_interfaces, parse_uint, 0, 65536),
+	OPTION(visibility_isolate, parse_string, 0, sizeof(((struct upnprd_config *)0)->visibility_isolate) - 1),
+	OPTION(query_socket, parse_string, 0, sizeof(((struct upnprd_config *)0)->query_socket) - 1),
+};
+
+/** FILE PARSER *****************************************/
+int upnprd_config_load(struct upnprd_config *config, const char *path, char *error, size_t error_size) {
+	FILE *file = fopen(path, "r");
+	if(!file) {
+		snprintf(error, error_size, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	// Parse into a copy, such that config stays untouched on errors
+	struct upnprd_config result;
+	upnprd_config_init(&result);
+
+	char line[1024];
+	int line_number = 0;
+	while(fgets(line, sizeof(line), file)) {
+		line_number++;
+
+		char *comment = strchr(line, '#');
+		if(comment) {
+			*comment = 0;
+		}
+
+		char *name = line;
+		while(isspace((unsigned char)*name)) {
+			name++;
+		}
+		if(!*name) {
+			continue;
+		}
+		char *value = name;
+		while(*value && !isspace((unsigned char)*value)) {
+			value++;
+		}
+		if(*value) {
+			*value++ = 0;
+		}
+		while(isspace((unsigned char)*value)) {
+			value++;
+		}
+		char *end = value + strlen(value);
+		while(end > value && isspace((unsigned char)end[-1])) {
+			*--end = 0;
+		}
+
+		int i;
+		for(i=0; i<sizeof(options)/sizeof(options[0]); i++) {
+			if(strcmp(options[i].name, name) == 0) {
+				break;
+			}
+		}
+		if(i == sizeof(options)/sizeof(options[0])) {
+			snprintf(error, error_size, "%s:%d: Unknown option `%s'", path, line_number, name);
+			fclose(file);
+			return -1;
+		}
+		if(options[i].parse(&options[i], &result, value) < 0) {
+			snprintf(error, error_size, "%s:%d: Invalid value `%s' for option `%s'", path, line_number, value, name);
+			fclose(file);
+			return -1;
+		}
+	}
+	fclose(file);
+
+	// Options that are only valid together
+	if(result.max_age_min > result.max_age_max) {
+		snprintf(error, error_size, "%s: max_age_min %u exceeds max_age_max %u", path, result.max_age_min, result.max_age_max);
+		return -1;
+	}
+
+	*config = result;
+	return 0;
+}
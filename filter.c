@@ -0,0 +1,822 @@
+/*
+ * UPnP relay daemon - device filters
+ *
+ * filter_deny and filter_allow keep devices out of the cache by their USN, ST
+ * or LOCATION, and filter_zones restricts which devices are served to searches
+ * arriving on certain interfaces. Rules are of the form
+ *
+ *   <field>:<pattern>
+ *
+ * with field one of usn, st and location. A pattern is either a shell glob,
+ * which must match the whole value (so a prefix is written as "prefix*"), or
+ * a regular expression in slashes, which may match anywhere unless anchored
+ * with ^ or $. Regular expressions support alternation, grouping, the *, +
+ * and ? operators, bracket expressions, . and the escapes \d, \w and \s.
+ *
+ * All rules are compiled into a single deterministic automaton when the
+ * configuration is applied: Each rule becomes a nondeterministic automaton for
+ * a tag byte identifying its field followed by its pattern, their union is
+ * made deterministic by subset construction, and bytes that no rule tells
+ * apart share a column of the transition table. Each state knows the set of
+ * rules accepting there. A new device is run through the automaton once per
+ * field, the verdict is kept in the device record, and replies only test a
+ * bit of it.
+ *
+ * The automaton and the compiler's scratch space are allocated when the rules
+ * are compiled, at startup and on each reload, and are tracked as setup
+ * allocations of the instance.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <fnmatch.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Limits of the compiler. The automaton may have up to FILTER_STATES states.
+#define FILTER_NFA_STATES 8192
+
+/*
+ * Rules are compiled for an instance, or without one to validate a
+ * configuration while it is loaded
+ */
+static void *filter_malloc(upnprd_t *ctx, size_t size) {
+	return ctx ? xmalloc(ctx, UPNPRD_ALLOC_SETUP, size) : malloc(size);
+}
+
+static void filter_release(upnprd_t *ctx, void *ptr) {
+	if(ctx) {
+		xfree(ctx, ptr);
+	}
+	else {
+		free(ptr);
+	}
+}
+
+/** NONDETERMINISTIC AUTOMATON **************************/
+#define NFA_EPSILON 0       // Moves on to out and out1 without input
+#define NFA_SET 1           // Moves on to out on a byte in set
+#define NFA_ACCEPT 2        // The rule is matched
+
+struct nfa_state {
+	unsigned char type;
+	int out;
+	int out1;
+	int rule;
+	uint32_t set[8];
+};
+
+struct nfa {
+	struct nfa_state *states;
+	int count;
+	const char *error;
+};
+
+/* A piece of automaton under construction. end is an epsilon state without successors. */
+struct fragment {
+	int start;
+	int end;
+};
+
+static int nfa_add(struct nfa *nfa, unsigned char type) {
+	if(nfa->count == FILTER_NFA_STATES) {
+		nfa->error = "too many rules";
+		return -1;
+	}
+	struct nfa_state *state = &nfa->states[nfa->count];
+	memset(state, 0, sizeof(*state));
+	state->type = type;
+	state->out = state->out1 = -1;
+	return nfa->count++;
+}
+
+#define SET_ADD(set, byte) ((set)[(unsigned char)(byte) >> 5] |= 1u << ((unsigned char)(byte) & 31))
+#define SET_HAS(set, byte) ((set)[(unsigned char)(byte) >> 5] & (1u << ((unsigned char)(byte) & 31)))
+
+static struct fragment fragment_empty(struct nfa *nfa) {
+	int state = nfa_add(nfa, NFA_EPSILON);
+	struct fragment result = { state, state };
+	return result;
+}
+
+static struct fragment fragment_set(struct nfa *nfa, const uint32_t set[8]) {
+	struct fragment result = { -1, -1 };
+	int start = nfa_add(nfa, NFA_SET);
+	int end = nfa_add(nfa, NFA_EPSILON);
+	if(end >= 0) {
+		memcpy(nfa->states[start].set, set, sizeof(nfa->states[start].set));
+		nfa->states[start].out = end;
+		result.start = start;
+		result.end = end;
+	}
+	return result;
+}
+
+static struct fragment fragment_byte(struct nfa *nfa, unsigned char byte) {
+	uint32_t set[8] = { 0 };
+	SET_ADD(set, byte);
+	return fragment_set(nfa, set);
+}
+
+static struct fragment fragment_any(struct nfa *nfa) {
+	uint32_t set[8];
+	memset(set, 0xff, sizeof(set));
+	return fragment_set(nfa, set);
+}
+
+static struct fragment fragment_concat(struct nfa *nfa, struct fragment a, struct fragment b) {
+	nfa->states[a.end].out = b.start;
+	struct fragment result = { a.start, b.end };
+	return result;
+}
+
+static struct fragment fragment_alternate(struct nfa *nfa, struct fragment a, struct fragment b) {
+	struct fragment result = { nfa_add(nfa, NFA_EPSILON), nfa_add(nfa, NFA_EPSILON) };
+	if(result.end >= 0) {
+		nfa->states[result.start].out = a.start;
+		nfa->states[result.start].out1 = b.start;
+		nfa->states[a.end].out = result.end;
+		nfa->states[b.end].out = result.end;
+	}
+	return result;
+}
+
+/* a*, a+ or a? */
+static struct fragment fragment_repeat(struct nfa *nfa, struct fragment a, char op) {
+	struct fragment result = { a.start, nfa_add(nfa, NFA_EPSILON) };
+	if(result.end < 0) {
+		return result;
+	}
+	if(op != '+') {
+		result.start = nfa_add(nfa, NFA_EPSILON);
+		if(result.start < 0) {
+			return result;
+		}
+		nfa->states[result.start].out = a.start;
+		nfa->states[result.start].out1 = result.end;
+	}
+	nfa->states[a.end].out = result.end;
+	if(op != '?') {
+		nfa->states[a.end].out1 = a.start;
+	}
+	return result;
+}
+
+#define FAILED(fragment) ((fragment).start < 0 || (fragment).end < 0)
+
+/** PATTERN PARSERS *************************************/
+/*
+ * Parse a bracket expression, starting after the [, into set. Globs negate
+ * with ! as well as ^.
+ */
+static int parse_bracket(struct nfa *nfa, const char **p, const char *end, uint32_t set[8], int glob) {
+	int negate = 0;
+	if(*p < end && (**p == '^' || (glob && **p == '!'))) {
+		negate = 1;
+		(*p)++;
+	}
+	memset(set, 0, 8 * sizeof(uint32_t));
+	int first = 1;
+	while(*p < end && (**p != ']' || first)) {
+		unsigned char low = *(*p)++;
+		if(low == '\\' && *p < end) {
+			low = *(*p)++;
+		}
+		unsigned char high = low;
+		if(*p + 1 < end && **p == '-' && (*p)[1] != ']') {
+			high = (*p)[1];
+			*p += 2;
+			if(high == '\\' && *p < end) {
+				high = *(*p)++;
+			}
+		}
+		if(high < low) {
+			nfa->error = "invalid range";
+			return -1;
+		}
+		int byte;
+		for(byte=low; byte<=high; byte++) {
+			SET_ADD(set, byte);
+		}
+		first = 0;
+	}
+	if(*p == end) {
+		nfa->error = "unterminated [";
+		return -1;
+	}
+	(*p)++;
+	if(negate) {
+		int i;
+		for(i=0; i<8; i++) {
+			set[i] = ~set[i];
+		}
+	}
+	return 0;
+}
+
+static struct fragment parse_glob(struct nfa *nfa, const char *p, const char *end) {
+	struct fragment result = fragment_empty(nfa);
+	while(p < end && !FAILED(result)) {
+		struct fragment atom;
+		uint32_t set[8];
+		char c = *p++;
+		if(c == '*') {
+			atom = fragment_any(nfa);
+			if(!FAILED(atom)) {
+				atom = fragment_repeat(nfa, atom, '*');
+			}
+		}
+		else if(c == '?') {
+			atom = fragment_any(nfa);
+		}
+		else if(c == '[') {
+			if(parse_bracket(nfa, &p, end, set, 1) < 0) {
+				break;
+			}
+			atom = fragment_set(nfa, set);
+		}
+		else {
+			if(c == '\\' && p < end) {
+				c = *p++;
+			}
+			atom = fragment_byte(nfa, c);
+		}
+		if(FAILED(atom)) {
+			result = atom;
+			break;
+		}
+		result = fragment_concat(nfa, result, atom);
+	}
+	if(nfa->error) {
+		result.start = -1;
+	}
+	return result;
+}
+
+static struct fragment parse_regex_alternation(struct nfa *nfa, const char **p, const char *end);
+
+static struct fragment parse_regex_atom(struct nfa *nfa, const char **p, const char *end) {
+	struct fragment failed = { -1, -1 };
+	uint32_t set[8];
+	char c = *(*p)++;
+	switch(c) {
+		case '(': {
+			struct fragment group = parse_regex_alternation(nfa, p, end);
+			if(FAILED(group)) {
+				return group;
+			}
+			if(*p == end || **p != ')') {
+				nfa->error = "unterminated (";
+				return failed;
+			}
+			(*p)++;
+			return group;
+		}
+		case '.':
+			return fragment_any(nfa);
+		case '[':
+			if(parse_bracket(nfa, p, end, set, 0) < 0) {
+				return failed;
+			}
+			return fragment_set(nfa, set);
+		case '*':
+		case '+':
+		case '?':
+			nfa->error = "nothing to repeat";
+			return failed;
+		case '\\':
+			if(*p == end) {
+				nfa->error = "trailing \\";
+				return failed;
+			}
+			c = *(*p)++;
+			memset(set, 0, sizeof(set));
+			int byte;
+			for(byte=1; byte<256; byte++) {
+				if((c == 'd' && byte >= '0' && byte <= '9') ||
+						(c == 'w' && (byte == '_' || (byte >= '0' && byte <= '9') || ((byte | 0x20) >= 'a' && (byte | 0x20) <= 'z'))) ||
+						(c == 's' && (byte == ' ' || (byte >= '\t' && byte <= '\r')))) {
+					SET_ADD(set, byte);
+				}
+			}
+			if(c == 'd' || c == 'w' || c == 's') {
+				return fragment_set(nfa, set);
+			}
+			return fragment_byte(nfa, c);
+		default:
+			return fragment_byte(nfa, c);
+	}
+}
+
+static struct fragment parse_regex_concatenation(struct nfa *nfa, const char **p, const char *end) {
+	struct fragment result = fragment_empty(nfa);
+	while(*p < end && **p != '|' && **p != ')' && !FAILED(result)) {
+		struct fragment atom = parse_regex_atom(nfa, p, end);
+		while(!FAILED(atom) && *p < end && (**p == '*' || **p == '+' || **p == '?')) {
+			atom = fragment_repeat(nfa, atom, *(*p)++);
+		}
+		if(FAILED(atom)) {
+			return atom;
+		}
+		result = fragment_concat(nfa, result, atom);
+	}
+	return result;
+}
+
+static struct fragment parse_regex_alternation(struct nfa *nfa, const char **p, const char *end) {
+	struct fragment result = parse_regex_concatenation(nfa, p, end);
+	while(!FAILED(result) && *p < end && **p == '|') {
+		(*p)++;
+		struct fragment alternative = parse_regex_concatenation(nfa, p, end);
+		if(FAILED(alternative)) {
+			return alternative;
+		}
+		result = fragment_alternate(nfa, result, alternative);
+	}
+	return result;
+}
+
+static struct fragment parse_regex(struct nfa *nfa, const char *p, const char *end) {
+	// Unless anchored, a regular expression may match anywhere
+	struct fragment failed = { -1, -1 };
+	int anchored_start = p < end && *p == '^';
+	int anchored_end = end > p + anchored_start && end[-1] == '$' && (end - 1 == p || end[-2] != '\\');
+	p += anchored_start;
+	end -= anchored_end;
+
+	struct fragment result = anchored_start ? fragment_empty(nfa) : fragment_any(nfa);
+	if(FAILED(result)) {
+		return result;
+	}
+	if(!anchored_start) {
+		result = fragment_repeat(nfa, result, '*');
+	}
+	struct fragment body = parse_regex_alternation(nfa, &p, end);
+	if(FAILED(body)) {
+		return body;
+	}
+	if(p != end) {
+		nfa->error = "unmatched )";
+		return failed;
+	}
+	result = fragment_concat(nfa, result, body);
+	if(!anchored_end) {
+		struct fragment tail = fragment_any(nfa);
+		if(FAILED(tail)) {
+			return tail;
+		}
+		result = fragment_concat(nfa, result, fragment_repeat(nfa, tail, '*'));
+	}
+	return result;
+}
+
+/*
+ * Parse the rule at *p, ending at one of terminators, into an automaton
+ * accepting the field's tag byte followed by a matching value. Returns the
+ * start state, or -1 on errors.
+ */
+static int parse_rule(struct nfa *nfa, const char **p, const char *terminators, int rule) {
+	static const char *fields[] = { "usn:", "st:", "location:" };
+	int field;
+	for(field=0; field<3; field++) {
+		if(strncmp(*p, fields[field], strlen(fields[field])) == 0) {
+			break;
+		}
+	}
+	if(field == 3) {
+		nfa->error = "rules must start with usn:, st: or location:";
+		return -1;
+	}
+	const char *pattern = *p + strlen(fields[field]);
+	const char *end;
+	struct fragment body;
+	if(*pattern == '/') {
+		// Up to the next unescaped slash
+		end = ++pattern;
+		while(*end && *end != '/') {
+			end += end[0] == '\\' && end[1] ? 2 : 1;
+		}
+		if(!*end) {
+			nfa->error = "unterminated regular expression";
+			return -1;
+		}
+		body = parse_regex(nfa, pattern, end);
+		end++;
+		if(*end && !strchr(terminators, *end)) {
+			nfa->error = "garbage after regular expression";
+			return -1;
+		}
+	}
+	else {
+		end = pattern + strcspn(pattern, terminators);
+		body = parse_glob(nfa, pattern, end);
+	}
+	struct fragment tag = fragment_byte(nfa, FILTER_TAG_USN + field);
+	int accept = nfa_add(nfa, NFA_ACCEPT);
+	if(FAILED(body) || FAILED(tag) || accept < 0) {
+		return -1;
+	}
+	nfa->states[accept].rule = rule;
+	nfa->states[body.end].out = accept;
+	fragment_concat(nfa, tag, body);
+	*p = end;
+	return tag.start;
+}
+
+/** SUBSET CONSTRUCTION *********************************/
+struct subsets {
+	int words;          // Per set of NFA states
+	uint64_t *sets;     // One per DFA state
+	int count;
+	int *table;         // Hash table of DFA state indices, -1 if empty
+	int table_size;
+};
+
+static uint32_t hash_set(const uint64_t *set, int words) {
+	uint32_t hash = 2166136261u;
+	int i;
+	for(i=0; i<words; i++) {
+		hash = (hash ^ (uint32_t)set[i] ^ (uint32_t)(set[i] >> 32)) * 16777619u;
+	}
+	return hash;
+}
+
+/* Add the states reachable without input from set to it */
+static void closure(struct nfa *nfa, uint64_t *set, int words, int *stack) {
+	int depth = 0;
+	int i;
+	for(i=0; i<nfa->count; i++) {
+		if(set[i >> 6] & (1ull << (i & 63))) {
+			stack[depth++] = i;
+		}
+	}
+	while(depth > 0) {
+		struct nfa_state *state = &nfa->states[stack[--depth]];
+		if(state->type != NFA_EPSILON) {
+			continue;
+		}
+		int outs[2] = { state->out, state->out1 };
+		for(i=0; i<2; i++) {
+			if(outs[i] >= 0 && !(set[outs[i] >> 6] & (1ull << (outs[i] & 63)))) {
+				set[outs[i] >> 6] |= 1ull << (outs[i] & 63);
+				stack[depth++] = outs[i];
+			}
+		}
+	}
+}
+
+/* The DFA state for a set of NFA states, added if new. -1 if there are too many. */
+static int find_subset(struct subsets *subsets, const uint64_t *set) {
+	size_t bytes = subsets->words * sizeof(uint64_t);
+	uint32_t slot = hash_set(set, subsets->words) & (subsets->table_size - 1);
+	while(subsets->table[slot] >= 0) {
+		if(memcmp(&subsets->sets[(size_t)subsets->table[slot] * subsets->words], set, bytes) == 0) {
+			return subsets->table[slot];
+		}
+		slot = (slot + 1) & (subsets->table_size - 1);
+	}
+	if(subsets->count == FILTER_STATES) {
+		return -1;
+	}
+	memcpy(&subsets->sets[(size_t)subsets->count * subsets->words], set, bytes);
+	subsets->table[slot] = subsets->count;
+	return subsets->count++;
+}
+
+/* Assign each byte a class, such that no NFA state tells bytes of one class apart */
+static int byte_classes(struct nfa *nfa, unsigned char classes[256], unsigned char representatives[256]) {
+	int count = 1;
+	memset(classes, 0, 256);
+	int i;
+	for(i=0; i<nfa->count; i++) {
+		if(nfa->states[i].type != NFA_SET) {
+			continue;
+		}
+		// Split each class into the bytes in the set and those not in it
+		int split[256][2];
+		memset(split, 0xff, sizeof(split));
+		int new_count = 0;
+		int byte;
+		for(byte=0; byte<256; byte++) {
+			int *target = &split[classes[byte]][SET_HAS(nfa->states[i].set, byte) ? 1 : 0];
+			if(*target < 0) {
+				*target = new_count++;
+			}
+			classes[byte] = *target;
+		}
+		count = new_count;
+	}
+	int byte;
+	for(byte=255; byte>=0; byte--) {
+		representatives[classes[byte]] = byte;
+	}
+	return count;
+}
+
+static int build_dfa(upnprd_t *ctx, struct nfa *nfa, int *starts, int start_count, struct filter *filter) {
+	int result = -1;
+	struct subsets subsets;
+	memset(&subsets, 0, sizeof(subsets));
+	subsets.words = (nfa->count + 63) / 64;
+	subsets.table_size = 2 * FILTER_STATES;
+	subsets.sets = (uint64_t *)filter_malloc(ctx, (size_t)FILTER_STATES * subsets.words * sizeof(uint64_t));
+	subsets.table = (int *)filter_malloc(ctx, subsets.table_size * sizeof(int));
+	uint64_t *set = (uint64_t *)filter_malloc(ctx, subsets.words * sizeof(uint64_t));
+	int *stack = (int *)filter_malloc(ctx, nfa->count * sizeof(int));
+	int *members = (int *)filter_malloc(ctx, nfa->count * sizeof(int));
+	unsigned char representatives[256];
+	filter->class_count = byte_classes(nfa, filter->classes, representatives);
+	filter->transitions = (uint16_t *)filter_malloc(ctx, (size_t)FILTER_STATES * filter->class_count * sizeof(uint16_t));
+	if(!subsets.sets || !subsets.table || !set || !stack || !members || !filter->transitions) {
+		nfa->error = "out of memory";
+		goto out;
+	}
+	memset(subsets.sets, 0, (size_t)FILTER_STATES * subsets.words * sizeof(uint64_t));
+	memset(subsets.table, 0xff, subsets.table_size * sizeof(int));
+
+	// State 0 is the dead one, where no rule can match anymore. State 1 is
+	// the start.
+	memset(set, 0, subsets.words * sizeof(uint64_t));
+	find_subset(&subsets, set);
+	int i;
+	for(i=0; i<start_count; i++) {
+		set[starts[i] >> 6] |= 1ull << (starts[i] & 63);
+	}
+	closure(nfa, set, subsets.words, stack);
+	find_subset(&subsets, set);
+
+	int state;
+	for(state=0; state<subsets.count; state++) {
+		// Only the states consuming input matter for the transitions
+		const uint64_t *from = &subsets.sets[(size_t)state * subsets.words];
+		int member_count = 0;
+		for(i=0; i<nfa->count; i++) {
+			if((from[i >> 6] & (1ull << (i & 63))) && nfa->states[i].type == NFA_SET) {
+				members[member_count++] = i;
+			}
+		}
+
+		int class;
+		for(class=0; class<filter->class_count; class++) {
+			memset(set, 0, subsets.words * sizeof(uint64_t));
+			for(i=0; i<member_count; i++) {
+				struct nfa_state *nfa_state = &nfa->states[members[i]];
+				if(SET_HAS(nfa_state->set, representatives[class])) {
+					set[nfa_state->out >> 6] |= 1ull << (nfa_state->out & 63);
+				}
+			}
+			closure(nfa, set, subsets.words, stack);
+			int next = find_subset(&subsets, set);
+			if(next < 0) {
+				nfa->error = "rules too complex";
+				goto out;
+			}
+			filter->transitions[state * filter->class_count + class] = next;
+		}
+	}
+
+	// Give back the room for states that were not needed
+	size_t state_count = subsets.count;
+	uint16_t *transitions = (uint16_t *)filter_malloc(ctx, state_count * filter->class_count * sizeof(uint16_t));
+	if(transitions) {
+		memcpy(transitions, filter->transitions, state_count * filter->class_count * sizeof(uint16_t));
+		filter_release(ctx, filter->transitions);
+		filter->transitions = transitions;
+	}
+	filter->state_count = state_count;
+	filter->accepts = (uint64_t *)filter_malloc(ctx, state_count * sizeof(uint64_t));
+	if(!filter->accepts) {
+		nfa->error = "out of memory";
+		goto out;
+	}
+	memset(filter->accepts, 0, state_count * sizeof(uint64_t));
+	for(state=0; state<subsets.count; state++) {
+		const uint64_t *members = &subsets.sets[(size_t)state * subsets.words];
+		for(i=0; i<nfa->count; i++) {
+			if((members[i >> 6] & (1ull << (i & 63))) && nfa->states[i].type == NFA_ACCEPT) {
+				filter->accepts[state] |= 1ull << nfa->states[i].rule;
+			}
+		}
+	}
+	result = 0;
+
+out:
+	filter_release(ctx, subsets.sets);
+	filter_release(ctx, subsets.table);
+	filter_release(ctx, set);
+	filter_release(ctx, stack);
+	filter_release(ctx, members);
+	return result;
+}
+
+/** COMPILER ********************************************/
+/* Parse a list of rules separated by any of separators, stopping at stop */
+static int parse_rules(struct nfa *nfa, const char **p, const char *separators, const char *stop, int *starts, int *count, uint64_t *mask) {
+	char terminators[8];
+	snprintf(terminators, sizeof(terminators), "%s%s", separators, stop);
+	while(**p && !strchr(stop, **p)) {
+		if(strchr(separators, **p)) {
+			(*p)++;
+			continue;
+		}
+		if(*count == FILTER_RULES) {
+			nfa->error = "too many rules";
+			return -1;
+		}
+		int start = parse_rule(nfa, p, terminators, *count);
+		if(start < 0) {
+			return -1;
+		}
+		*mask |= 1ull << *count;
+		starts[(*count)++] = start;
+	}
+	return 0;
+}
+
+/*
+ * Compile the rules of config into filter, tracking the allocations on ctx if
+ * set. Returns 0, or -1 with a description of the problem in error.
+ */
+int filter_compile(upnprd_t *ctx, const struct upnprd_config *config, struct filter *filter, char *error, size_t error_size) {
+	memset(filter, 0, sizeof(*filter));
+	struct nfa nfa;
+	memset(&nfa, 0, sizeof(nfa));
+	int starts[FILTER_RULES];
+	int count = 0;
+	const char *p;
+
+	nfa.states = (struct nfa_state *)filter_malloc(ctx, FILTER_NFA_STATES * sizeof(struct nfa_state));
+	if(!nfa.states) {
+		nfa.error = "out of memory";
+		goto failed;
+	}
+
+	p = config->filter_deny;
+	if(parse_rules(&nfa, &p, " \t", "", starts, &count, &filter->deny) < 0) {
+		goto failed;
+	}
+	p = config->filter_allow;
+	if(parse_rules(&nfa, &p, " \t", "", starts, &count, &filter->allow) < 0) {
+		goto failed;
+	}
+
+	// Zones are <interface glob>=<rule>,<rule>...
+	p = config->filter_zones;
+	while(*p) {
+		p += strspn(p, " \t");
+		if(!*p) {
+			break;
+		}
+		size_t length = strcspn(p, "= \t");
+		if(p[length] != '=' || length == 0 || length >= sizeof(filter->zone_interfaces[0])) {
+			nfa.error = "zones must be <interface>=<rule>,...";
+			goto failed;
+		}
+		if(filter->zone_count == FILTER_ZONES) {
+			nfa.error = "too many zones";
+			goto failed;
+		}
+		memcpy(filter->zone_interfaces[filter->zone_count], p, length);
+		p += length + 1;
+		if(parse_rules(&nfa, &p, ",", " \t", starts, &count, &filter->zone_rules[filter->zone_count]) < 0) {
+			goto failed;
+		}
+		filter->zone_count++;
+	}
+
+	if(!count) {
+		// Nothing to match, filter_match() is never asked
+		filter_release(ctx, nfa.states);
+		return 0;
+	}
+	if(build_dfa(ctx, &nfa, starts, count, filter) < 0) {
+		goto failed;
+	}
+	filter_release(ctx, nfa.states);
+	return 0;
+
+failed:
+	if(error) {
+		snprintf(error, error_size, "%s", nfa.error);
+	}
+	filter_release(ctx, nfa.states);
+	filter_free(ctx, filter);
+	return -1;
+}
+
+/* Free what filter_compile() allocated, with the same ctx */
+void filter_free(upnprd_t *ctx, struct filter *filter) {
+	filter_release(ctx, filter->transitions);
+	filter_release(ctx, filter->accepts);
+	memset(filter, 0, sizeof(*filter));
+}
+
+/** MATCHING ********************************************/
+/* The rules matching a value of a field */
+static uint64_t run(struct filter *filter, int tag, const char *value) {
+	unsigned int class_count = filter->class_count;
+	unsigned int state = filter->transitions[class_count + filter->classes[tag]];
+	while(*value && state) {
+		state = filter->transitions[state * class_count + filter->classes[(unsigned char)*value++]];
+	}
+	return filter->accepts[state];
+}
+
+int filter_match(upnprd_t *ctx, const char *usn, const char *st, const char *location, unsigned char *zones) {
+	struct filter *filter = &ctx->filter;
+	*zones = 0;
+	if(!filter->state_count) {
+		return 1;
+	}
+	uint64_t matched = run(filter, FILTER_TAG_USN, usn) | run(filter, FILTER_TAG_ST, st) | run(filter, FILTER_TAG_LOCATION, location);
+	if((matched & filter->deny) || (filter->allow && !(matched & filter->allow))) {
+		return 0;
+	}
+	int zone;
+	for(zone=0; zone<filter->zone_count; zone++) {
+		if(matched & filter->zone_rules[zone]) {
+			*zones |= 1 << zone;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Judge a device about to be created from headers, counting it if the rules
+ * reject it. Returns whether it may be stored, and its zones then.
+ */
+int filter_device(upnprd_t *ctx, char **headers, unsigned char *zones) {
+	if(!filter_match(ctx, headers[USN], headers[ST], headers[LOCATION], zones)) {
+		debugf("[%s] Filtered\n", headers[USN]);
+		ctx->stats.devices_filtered++;
+		return 0;
+	}
+	return 1;
+}
+
+unsigned char filter_zone(upnprd_t *ctx, int ifindex) {
+	if(!ctx->filter.zone_count || ifindex <= 0) {
+		return 0;
+	}
+	struct filter_interface *cached = &ctx->filter_interfaces[ifindex & (FILTER_INTERFACES - 1)];
+	if(cached->ifindex != ifindex) {
+		char name[IF_NAMESIZE];
+		cached->ifindex = ifindex;
+		cached->zone = 0;
+		if(if_indextoname(ifindex, name)) {
+			int zone;
+			for(zone=0; zone<ctx->filter.zone_count; zone++) {
+				if(fnmatch(ctx->filter.zone_interfaces[zone], name, 0) == 0) {
+					cached->zone = 1 << zone;
+					break;
+				}
+			}
+		}
+	}
+	return cached->zone;
+}
+
+/*
+ * Compile the rules of a new configuration and apply them to the cached
+ * devices. Keeps the old rules if the new ones are invalid.
+ */
+int filter_apply(upnprd_t *ctx) {
+	struct filter filter;
+	if(filter_compile(ctx, &ctx->config, &filter, NULL, 0) < 0) {
+		return -1;
+	}
+	filter_free(ctx, &ctx->filter);
+	ctx->filter = filter;
+	memset(ctx->filter_interfaces, 0, sizeof(ctx->filter_interfaces));
+
+	// Judge the cached devices by the new rules
+	LOCK(ctx);
+	device_t *device = ctx->root_device;
+	while(device) {
+		device_t *next = device->next;
+		if(!filter_match(ctx, device->usn, device->st, device->location, &device->zones)) {
+			// Only our own policy changed, and the device is still
+			// alive. Peers keep it, and their updates on it are
+			// filtered like new devices.
+			debugf("[%s] Filtered, removing\n", device->usn);
+			delete_device(ctx, device);
+			ctx->stats.devices_filtered++;
+		}
+		device = next;
+	}
+	// The zones of the remaining devices may have changed, too
+	ctx->store_generation++;
+	UNLOCK(ctx);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * UPnP relay daemon - byebye dampening
+ *
+ * Some devices send byebyes while they stay online, e.g. TVs going to
+ * standby, and announce themselves again shortly after. Removing them on
+ * every byebye makes them vanish from controllers for no reason, while
+ * ignoring all byebyes (ignore_down_messages) keeps devices that really went
+ * away.
+ *
+ * With byebye_grace set, a byebye only marks the device suspect. It is still
+ * served, and removed once byebye_grace seconds pass without an alive; an
+ * alive within that time simply clears the mark. Each byebye also adds
+ * FLAP_PENALTY to the device's penalty, which halves every flap_half_life
+ * seconds. A device whose penalty exceeds flap_suppress is a chronic flapper:
+ * its byebyes are ignored until the penalty decayed below flap_reuse.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Penalty added per byebye
+#define FLAP_PENALTY 1000
+
+/* The penalty after elapsed seconds of decay */
+static unsigned int decay(unsigned int penalty, time_t elapsed, unsigned int half_life) {
+	if(!half_life || elapsed <= 0) {
+		return penalty;
+	}
+	time_t halvings = elapsed / half_life;
+	if(halvings >= 32) {
+		return 0;
+	}
+	penalty >>= halvings;
+
+	// Between two halvings, interpolate linearly
+	return penalty - (unsigned long long)penalty * (elapsed % half_life) / (2 * half_life);
+}
+
+int flap_byebye(upnprd_t *ctx, device_t *device) {
+	struct upnprd_config *config = &ctx->config;
+	device->flap_penalty = decay(device->flap_penalty, ctx->now - device->flap_updated, config->flap_half_life) + FLAP_PENALTY;
+	device->flap_updated = ctx->now;
+
+	if(config->flap_suppress && device->flap_penalty > config->flap_suppress) {
+		device->flap_suppressed = 1;
+	}
+	if(device->flap_suppressed) {
+		debugf("[%s] Flapping, byebye suppressed\n", device->usn);
+		ctx->stats.byebyes_suppressed++;
+		return FLAP_IGNORE;
+	}
+	if(!config->byebye_grace) {
+		return FLAP_REMOVE;
+	}
+	if(!device->suspect_since) {
+		device->suspect_since = ctx->now;
+		ctx->flap_suspects++;
+		ctx->stats.byebyes_deferred++;
+	}
+	return FLAP_IGNORE;
+}
+
+void flap_alive(upnprd_t *ctx, device_t *device) {
+	if(device->suspect_since) {
+		debugf("[%s] Alive again within the grace period\n", device->usn);
+		device->suspect_since = 0;
+		ctx->flap_suspects--;
+		ctx->stats.byebyes_reverted++;
+	}
+	if(device->flap_suppressed && decay(device->flap_penalty, ctx->now - device->flap_updated, ctx->config.flap_half_life) < ctx->config.flap_reuse) {
+		device->flap_suppressed = 0;
+	}
+}
+
+void flap_device_freed(upnprd_t *ctx, device_t *device) {
+	if(device->suspect_since) {
+		device->suspect_since = 0;
+		ctx->flap_suspects--;
+	}
+}
+
+void flap_expire(upnprd_t *ctx) {
+	if(!ctx->flap_suspects || ctx->flap_checked == ctx->now) {
+		return;
+	}
+	ctx->flap_checked = ctx->now;
+
+	LOCK(ctx);
+	device_t *device = ctx->root_device;
+	while(device) {
+		device_t *next = device->next;
+		if(device->suspect_since && device->suspect_since + ctx->config.byebye_grace <= ctx->now) {
+			debugf("[%s] Grace period over, removing\n", device->usn);
+			sync_device_gone(ctx, device);
+			tunnel_device_gone(ctx, device);
+			delete_device(ctx, device);
+		}
+		device = next;
+	}
+	UNLOCK(ctx);
+}
+
+/* When flap_expire() next looks for grace periods that ran out, 0 if never */
+time_t flap_deadline(upnprd_t *ctx) {
+	return ctx->flap_suspects ? ctx->flap_checked + 1 : 0;
+}
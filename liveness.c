@@ -0,0 +1,288 @@
+/*
+ * UPnP relay daemon - liveness checks
+ *
+ * A device that crashes or loses power does not send a byebye, so it would
+ * stay cached until device_timeout passes, and controllers would keep trying
+ * to reach it. With liveness_interval set, the relay checks the HTTP endpoint
+ * of each LOCATION every liveness_interval seconds, by connecting to it or,
+ * with liveness_http, by sending it a HEAD request. All devices behind one
+ * host:port share a single check. An endpoint that fails liveness_failures
+ * checks in a row, LIVENESS_RETRY seconds apart, is considered dead, and its
+ * devices are removed as if they had said byebye.
+ *
+ * Checks are non-blocking sockets driven from upnprd_poll(), at most
+ * liveness_concurrency at a time. Endpoints live in a fixed-size table; once
+ * none of their devices is cached anymore, they are dropped when due.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Seconds a check may take
+#define LIVENESS_TIMEOUT 5
+
+// Seconds between checks of an endpoint that failed, until it is given up on
+#define LIVENESS_RETRY 10
+
+// Probe states
+#define PROBE_CONNECTING 1
+#define PROBE_WAITING 2     // For the response to a HEAD request
+
+static int same_endpoint(struct sockaddr_in *a, struct sockaddr_in *b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* Whether device is served by endpoint */
+static int device_on_endpoint(device_t *device, struct liveness_endpoint *endpoint) {
+	struct sockaddr_in addr;
+	const char *host, *path;
+	size_t host_length;
+	return parse_http_location(device->location, &addr, &host, &host_length, &path) && same_endpoint(&addr, &endpoint->addr);
+}
+
+void liveness_device_added(upnprd_t *ctx, device_t *device) {
+	if(!ctx->config.liveness_interval) {
+		return;
+	}
+	struct sockaddr_in addr;
+	const char *host, *path;
+	size_t host_length;
+	if(!parse_http_location(device->location, &addr, &host, &host_length, &path)) {
+		return;
+	}
+
+	struct liveness_endpoint *free_slot = NULL;
+	int i;
+	for(i=0; i<LIVENESS_ENDPOINTS; i++) {
+		struct liveness_endpoint *endpoint = &ctx->liveness_endpoints[i];
+		if(!endpoint->addr.sin_port) {
+			if(!free_slot) {
+				free_slot = endpoint;
+			}
+		}
+		else if(same_endpoint(&endpoint->addr, &addr)) {
+			return;
+		}
+	}
+	if(!free_slot) {
+		// Not checked, the device times out as usual
+		return;
+	}
+
+	// The device just announced itself, so the first check can wait
+	memset(free_slot, 0, sizeof(*free_slot));
+	free_slot->addr = addr;
+	snprintf(free_slot->path, sizeof(free_slot->path), "%s", path);
+	free_slot->next_check = ctx->now + ctx->config.liveness_interval;
+}
+
+/* Remove the devices of a dead endpoint */
+static void evict_endpoint(upnprd_t *ctx, struct liveness_endpoint *endpoint) {
+	debugf("Endpoint %s:%d is dead\n", inet_ntoa(endpoint->addr.sin_addr), ntohs(endpoint->addr.sin_port));
+	LOCK(ctx);
+	device_t *device = ctx->root_device;
+	while(device) {
+		device_t *next = device->next;
+		if(device_on_endpoint(device, endpoint)) {
+			debugf("[%s] Unreachable, removing\n", device->usn);
+			sync_device_gone(ctx, device);
+			tunnel_device_gone(ctx, device);
+			delete_device(ctx, device);
+			ctx->stats.devices_unreachable++;
+		}
+		device = next;
+	}
+	UNLOCK(ctx);
+	memset(endpoint, 0, sizeof(*endpoint));
+}
+
+static void end_probe(upnprd_t *ctx, struct liveness_probe *probe, int alive) {
+	struct liveness_endpoint *endpoint = probe->endpoint;
+	close(probe->fd);
+	probe->fd = -1;
+	probe->endpoint = NULL;
+	endpoint->probing = 0;
+
+	if(alive) {
+		endpoint->failures = 0;
+		endpoint->next_check = ctx->now + ctx->config.liveness_interval;
+		return;
+	}
+	ctx->stats.liveness_failures++;
+	if(++endpoint->failures >= ctx->config.liveness_failures) {
+		evict_endpoint(ctx, endpoint);
+		return;
+	}
+	endpoint->next_check = ctx->now + (ctx->config.liveness_interval < LIVENESS_RETRY ? ctx->config.liveness_interval : LIVENESS_RETRY);
+}
+
+static void probe_io(upnprd_t *ctx, struct liveness_probe *probe) {
+	if(probe->state == PROBE_CONNECTING) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if(getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+			end_probe(ctx, probe, 0);
+			return;
+		}
+		if(!ctx->config.liveness_http) {
+			end_probe(ctx, probe, 1);
+			return;
+		}
+
+		// HTTP/1.0, such that the server closes the connection after
+		// answering. The request fits any socket buffer.
+		char request[256];
+		int request_length = snprintf(request, sizeof(request), "HEAD %s HTTP/1.0\r\nHOST: %s:%d\r\n\r\n",
+			probe->endpoint->path, inet_ntoa(probe->endpoint->addr.sin_addr), ntohs(probe->endpoint->addr.sin_port));
+		if(send(probe->fd, request, request_length, MSG_DONTWAIT | MSG_NOSIGNAL) != request_length) {
+			end_probe(ctx, probe, 0);
+			return;
+		}
+		probe->state = PROBE_WAITING;
+		return;
+	}
+
+	// Any status line will do, even an error means the server is there
+	char response[8];
+	ssize_t nbytes = recv(probe->fd, response, sizeof(response), MSG_DONTWAIT);
+	if(nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	end_probe(ctx, probe, nbytes >= 5 && strncmp(response, "HTTP/", 5) == 0);
+}
+
+static void start_probe(upnprd_t *ctx, struct liveness_probe *probe, struct liveness_endpoint *endpoint) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd < 0) {
+		// Try again later, this says nothing about the endpoint
+		endpoint->next_check = ctx->now + LIVENESS_RETRY;
+		return;
+	}
+	ctx->stats.liveness_probes++;
+	probe->fd = fd;
+	probe->endpoint = endpoint;
+	probe->started = ctx->now;
+	probe->state = PROBE_CONNECTING;
+	endpoint->probing = 1;
+	if(connect(fd, (struct sockaddr *)&endpoint->addr, sizeof(endpoint->addr)) < 0 && errno != EINPROGRESS) {
+		end_probe(ctx, probe, 0);
+	}
+}
+
+/* Start checks of the endpoints that are due, up to the configured concurrency */
+static void start_probes(upnprd_t *ctx) {
+	int slot = 0;
+	int i;
+	for(i=0; i<LIVENESS_ENDPOINTS; i++) {
+		struct liveness_endpoint *endpoint = &ctx->liveness_endpoints[i];
+		if(!endpoint->addr.sin_port || endpoint->probing || endpoint->next_check > ctx->now) {
+			continue;
+		}
+		while(slot < ctx->config.liveness_concurrency && ctx->liveness_probes[slot].fd >= 0) {
+			slot++;
+		}
+		if(slot >= ctx->config.liveness_concurrency) {
+			return;
+		}
+
+		// Drop endpoints whose devices are all gone, instead of checking them
+		int used = 0;
+		LOCK(ctx);
+		device_t *device;
+		for(device = ctx->root_device; device && !used; device = device->next) {
+			used = device_on_endpoint(device, endpoint);
+		}
+		UNLOCK(ctx);
+		if(!used) {
+			memset(endpoint, 0, sizeof(*endpoint));
+			continue;
+		}
+		start_probe(ctx, &ctx->liveness_probes[slot], endpoint);
+	}
+}
+
+void liveness_setup(upnprd_t *ctx) {
+	int i;
+	for(i=0; i<LIVENESS_PROBES; i++) {
+		ctx->liveness_probes[i].fd = -1;
+	}
+}
+
+int liveness_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	int highest_fd = -1;
+	int i;
+	for(i=0; i<LIVENESS_PROBES; i++) {
+		struct liveness_probe *probe = &ctx->liveness_probes[i];
+		if(probe->fd >= 0) {
+			FD_SET(probe->fd, probe->state == PROBE_CONNECTING ? writefds : readfds);
+			if(probe->fd > highest_fd) {
+				highest_fd = probe->fd;
+			}
+		}
+	}
+	return highest_fd;
+}
+
+void liveness_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	int i;
+	for(i=0; i<LIVENESS_PROBES; i++) {
+		struct liveness_probe *probe = &ctx->liveness_probes[i];
+		if(probe->fd < 0) {
+			continue;
+		}
+		if(FD_ISSET(probe->fd, probe->state == PROBE_CONNECTING ? writefds : readfds)) {
+			probe_io(ctx, probe);
+		}
+		else if(probe->started + LIVENESS_TIMEOUT <= ctx->now) {
+			end_probe(ctx, probe, 0);
+		}
+	}
+	if(ctx->config.liveness_interval) {
+		start_probes(ctx);
+	}
+}
+
+/* When liveness_poll() next has work that no descriptor signals, 0 if never */
+time_t liveness_deadline(upnprd_t *ctx) {
+	time_t deadline = 0;
+	int i;
+	for(i=0; i<LIVENESS_PROBES; i++) {
+		struct liveness_probe *probe = &ctx->liveness_probes[i];
+		if(probe->fd >= 0 && (!deadline || probe->started + LIVENESS_TIMEOUT < deadline)) {
+			deadline = probe->started + LIVENESS_TIMEOUT;
+		}
+	}
+	if(ctx->config.liveness_interval) {
+		for(i=0; i<LIVENESS_ENDPOINTS; i++) {
+			struct liveness_endpoint *endpoint = &ctx->liveness_endpoints[i];
+			if(endpoint->addr.sin_port && !endpoint->probing && (!deadline || endpoint->next_check < deadline)) {
+				deadline = endpoint->next_check;
+			}
+		}
+	}
+	return deadline;
+}
+
+void liveness_close(upnprd_t *ctx) {
+	int i;
+	for(i=0; i<LIVENESS_PROBES; i++) {
+		if(ctx->liveness_probes[i].fd >= 0) {
+			close(ctx->liveness_probes[i].fd);
+		}
+	}
+}
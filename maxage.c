@@ -0,0 +1,90 @@
+/*
+ * UPnP relay daemon - adaptive max-age
+ *
+ * Controllers search again once the CACHE-CONTROL max-age of our replies
+ * runs out, so a fixed max-age sets the rate of searches we answer. With
+ * max_age_adaptive set, the max-age of each device is derived from the device
+ * itself instead: the time left of the lifetime it announced with its last
+ * alive (max_age if it did not announce one), plus, for devices that keep
+ * refreshing on schedule, up to MAXAGE_EXTENSIONS more lifetimes, one per
+ * MAXAGE_STABLE_REFRESHES regular refreshes in a row. A refresh arriving
+ * later than a quarter interval past the usual one starts the count over. The
+ * result is bounded by max_age_min and max_age_max, and by the time left
+ * until the device times out of our cache.
+ *
+ * The value is formatted into the device record at most once per second, such
+ * that replies still only reference stored strings.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Seconds between alives below which they are copies of one announcement, or
+// replies to our own discovery
+#define MAXAGE_MIN_GAP 10
+
+// Regular refreshes in a row per lifetime added, and the most lifetimes added
+#define MAXAGE_STABLE_REFRESHES 4
+#define MAXAGE_EXTENSIONS 3
+
+static unsigned int lifetime(upnprd_t *ctx, device_t *device) {
+	return device->announced_max_age ? device->announced_max_age : ctx->config.max_age;
+}
+
+void maxage_seen(upnprd_t *ctx, device_t *device, unsigned int announced, int is_new) {
+	if(announced) {
+		device->announced_max_age = announced;
+	}
+	device->max_age_computed = 0;
+	if(is_new) {
+		return;
+	}
+
+	// Called before last_seen is updated
+	time_t gap = ctx->now - device->last_seen;
+	if(gap < MAXAGE_MIN_GAP) {
+		return;
+	}
+	unsigned int interval = device->refresh_interval;
+	if(gap > lifetime(ctx, device) || (interval && gap > interval + interval / 4)) {
+		// Late, it might as well have been gone
+		device->regular_refreshes = 0;
+	}
+	else if(interval && gap >= interval - interval / 4 && device->regular_refreshes < 255) {
+		device->regular_refreshes++;
+	}
+	device->refresh_interval = interval ? (3 * interval + gap) / 4 : gap;
+}
+
+void maxage_update(upnprd_t *ctx, device_t *device) {
+	if(device->max_age_length && device->max_age_computed == ctx->now) {
+		return;
+	}
+	device->max_age_computed = ctx->now;
+
+	struct upnprd_config *config = &ctx->config;
+	long max_age = device->last_seen + lifetime(ctx, device) - ctx->now;
+	unsigned int extensions = device->regular_refreshes / MAXAGE_STABLE_REFRESHES;
+	max_age += (long)lifetime(ctx, device) * (extensions < MAXAGE_EXTENSIONS ? extensions : MAXAGE_EXTENSIONS);
+
+	long remaining = device->last_seen + config->device_timeout - ctx->now;
+	if(max_age > remaining) {
+		max_age = remaining;
+	}
+	if(max_age > (long)config->max_age_max) {
+		max_age = config->max_age_max;
+	}
+	if(max_age < (long)config->max_age_min) {
+		max_age = config->max_age_min;
+	}
+	device->max_age_length = snprintf(device->max_age, sizeof(device->max_age), "%ld", max_age);
+}
@@ -0,0 +1,129 @@
+/*
+ * UPnP relay daemon - overload detection and load shedding
+ *
+ * Searches are the expensive part of the relay's work: each one makes it reply
+ * with many messages. Under a flood of them, the relay would fall behind ever
+ * further, queueing replies (or, in the THREADS build, starting sender
+ * threads) without bound. Three signals tell when this happens:
+ *
+ *  - depth: replies queued, or sender threads running in the THREADS build
+ *  - lag: how long datagrams waited in the socket buffer before we got to
+ *    them, taken from their kernel receive timestamps
+ *  - memory: bytes held by cached devices and queued replies
+ *
+ * Each signal is compared against its threshold, and the relay sheds load in
+ * tiers: From one times the threshold on, it only answers searches for a
+ * specific ST, with the matching devices only. From two times, it answers
+ * those only if the requester did not get an answer recently. From four times,
+ * it drops all searches. Announcements are always processed, so the cache
+ * stays current. The relay enters a tier as soon as a signal calls for it, and
+ * steps back down one tier at a time once the signals stayed below it for
+ * OVERLOAD_HOLD seconds.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Seconds the signals must stay below a tier before it is left
+#define OVERLOAD_HOLD 5
+
+// Seconds after which a requester counts as a first-time requester again
+#define OVERLOAD_REPEAT_INTERVAL 60
+
+/* The tier a signal calls for */
+static int signal_level(unsigned long value, unsigned long threshold) {
+	if(!threshold || value < threshold) {
+		return OVERLOAD_NONE;
+	}
+	if(value < 2 * threshold) {
+		return OVERLOAD_TARGETED;
+	}
+	if(value < 4 * threshold) {
+		return OVERLOAD_FIRST_TIME;
+	}
+	return OVERLOAD_DROP;
+}
+
+void overload_update(upnprd_t *ctx) {
+	struct upnprd_config *config = &ctx->config;
+
+	// Everything here is only touched by the thread calling upnprd_poll(),
+	// except for the number of sender threads
+	#ifdef THREADS
+		unsigned long depth = __atomic_load_n(&ctx->active_threads, __ATOMIC_RELAXED);
+		unsigned long memory = ctx->device_bytes;
+	#else
+		unsigned long depth = ctx->send_queued;
+		unsigned long memory = ctx->device_bytes + ctx->send_queued * sizeof(struct send_queue_entry);
+	#endif
+	ctx->stats.overload_depth = depth;
+	ctx->stats.overload_lag_ms = ctx->receive_lag_ms;
+	ctx->stats.overload_memory_kb = memory / 1024;
+
+	int level = signal_level(depth, config->overload_depth);
+	int lag_level = signal_level(ctx->receive_lag_ms, config->overload_lag_ms);
+	int memory_level = signal_level(memory / 1024, config->overload_memory);
+	if(lag_level > level) {
+		level = lag_level;
+	}
+	if(memory_level > level) {
+		level = memory_level;
+	}
+
+	if(level >= ctx->overload_state) {
+		ctx->overload_calm_since = ctx->now;
+	}
+	if(level > ctx->overload_state) {
+		debugf("Overload: entering tier %d (depth %lu, lag %lu ms, memory %lu KiB)\n", level, depth, ctx->stats.overload_lag_ms, memory / 1024);
+		ctx->overload_state = level;
+		unsigned long *entered[] = { &ctx->stats.overload_targeted, &ctx->stats.overload_first_time, &ctx->stats.overload_drop };
+		(*entered[level - 1])++;
+	}
+	else if(level < ctx->overload_state && ctx->overload_calm_since + OVERLOAD_HOLD <= ctx->now) {
+		// One tier per hold time. The relay may have slept through
+		// several, if no traffic arrived.
+		time_t steps = (ctx->now - ctx->overload_calm_since) / OVERLOAD_HOLD;
+		ctx->overload_state = steps >= ctx->overload_state - level ? level : ctx->overload_state - steps;
+		ctx->overload_calm_since += steps * OVERLOAD_HOLD;
+		debugf("Overload: back to tier %d\n", ctx->overload_state);
+	}
+	ctx->stats.overload_state = ctx->overload_state;
+}
+
+/* Whether a search for st is for something specific, rather than everything */
+static int is_targeted(const char *st) {
+	return st[0] && strcmp(st, "ssdp:all") != 0;
+}
+
+int overload_admit_search(upnprd_t *ctx, struct sockaddr_in *addr, const char *st) {
+	int state = ctx->overload_state;
+	struct overload_requester *requester = &ctx->overload_requesters[(addr->sin_addr.s_addr * 2654435769u) >> (32 - OVERLOAD_REQUESTERS_BITS)];
+	int first_time = requester->addr != addr->sin_addr.s_addr || requester->answered + OVERLOAD_REPEAT_INTERVAL <= ctx->now;
+
+	if(state == OVERLOAD_DROP || (state >= OVERLOAD_TARGETED && !is_targeted(st)) || (state >= OVERLOAD_FIRST_TIME && !first_time)) {
+		ctx->stats.searches_shed++;
+		return 0;
+	}
+	requester->addr = addr->sin_addr.s_addr;
+	requester->answered = ctx->now;
+	return 1;
+}
+
+int overload_device_matches(device_t *device, const char *st) {
+	if(strcmp(device->st, st) == 0) {
+		return 1;
+	}
+	// Searches for a uuid match all USNs of that device
+	size_t length = strlen(st);
+	return strncmp(st, "uuid:", 5) == 0 && strncmp(device->usn, st, length) == 0 &&
+		(device->usn[length] == 0 || device->usn[length] == ':');
+}
@@ -0,0 +1,161 @@
+/*
+ * UPnP relay daemon - reply plans
+ *
+ * Most searches are for one of a handful of targets (ssdp:all,
+ * upnp:rootdevice, a few device types) and arrive on a handful of interfaces,
+ * yet each one used to walk the whole cache and test every device against the
+ * requestee's zone, visibility and search target. A reply plan is the result
+ * of such a walk: the devices to send, in cache order. Plans are kept for the
+ * last REPLY_PLANS distinct searches, keyed by the zone and visibility bit of
+ * the ingress interface, and by the ST while searches are filtered by it (see
+ * overload.c). Interfaces sharing a zone and visibility share their plans.
+ *
+ * ctx->store_generation changes whenever the selection could: devices being
+ * stored or freed, a device becoming visible on more interfaces, and the
+ * filters being recompiled. A plan built in an older generation is rebuilt on
+ * its next use. What depends on the request itself, the requestee's address,
+ * the reply budget and the max-ages, is still checked per reply.
+ *
+ * In fixed-footprint mode, the plans are preallocated for pool_devices
+ * devices at startup. Otherwise, they grow on demand and keep their size.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+/* Whether a device may be sent to a requestee, given its visibility_bit() */
+static inline int device_visible(device_t *device, int visibility) {
+	return visibility == VISIBILITY_ALL || device->visible_all ||
+		(visibility >= 0 && (device->visible_on[visibility >> 6] >> (visibility & 63)) & 1);
+}
+
+/*
+ * Whether a device is sent in reply to searches from an interface in zone
+ * with visibility bit visibility, for st if set. See _send_cache_to_real().
+ */
+int plan_selects(device_t *device, unsigned char zone, int visibility, const char *st) {
+	return (!zone || (device->zones & zone)) && device_visible(device, visibility) && (!st || overload_device_matches(device, st));
+}
+
+/* Returns 0, or -1 if the plans could not be preallocated */
+int plan_setup(upnprd_t *ctx) {
+	// Generation 0 marks unused plans
+	ctx->store_generation = 1;
+	unsigned int capacity = ctx->config.pool_devices;
+	if(!capacity) {
+		return 0;
+	}
+	int i;
+	for(i=0; i<REPLY_PLANS; i++) {
+		struct reply_plan *plan = &ctx->reply_plans[i];
+		plan->devices = (device_t **)xmalloc(ctx, UPNPRD_ALLOC_REPLY, capacity * sizeof(device_t *));
+		if(!plan->devices) {
+			plan_free(ctx);
+			return -1;
+		}
+		plan->capacity = capacity;
+	}
+	return 0;
+}
+
+void plan_free(upnprd_t *ctx) {
+	int i;
+	for(i=0; i<REPLY_PLANS; i++) {
+		struct reply_plan *plan = &ctx->reply_plans[i];
+		if(plan->devices) {
+			xfree(ctx, plan->devices);
+		}
+		memset(plan, 0, sizeof(*plan));
+	}
+}
+
+/* Returns 0, or -1 if the plan's devices did not fit */
+static int build(upnprd_t *ctx, struct reply_plan *plan) {
+	const char *st = plan->filtered ? plan->st : NULL;
+	plan->count = 0;
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		if(!plan_selects(device, plan->zone, plan->visibility, st)) {
+			continue;
+		}
+		if(plan->count == plan->capacity) {
+			// Preallocated plans hold all pooled devices, so this
+			// does not happen in fixed-footprint mode
+			if(ctx->device_pool.capacity) {
+				return -1;
+			}
+			unsigned int capacity = plan->capacity ? plan->capacity * 2 : REPLY_PLAN_MIN;
+			device_t **devices = (device_t **)xmalloc(ctx, UPNPRD_ALLOC_REPLY, capacity * sizeof(device_t *));
+			if(!devices) {
+				return -1;
+			}
+			if(plan->devices) {
+				memcpy(devices, plan->devices, plan->count * sizeof(device_t *));
+				xfree(ctx, plan->devices);
+			}
+			plan->devices = devices;
+			plan->capacity = capacity;
+		}
+		plan->devices[plan->count++] = device;
+	}
+	plan->generation = ctx->store_generation;
+	ctx->stats.reply_plans_built++;
+	return 0;
+}
+
+/*
+ * The plan for searches from an interface in zone with visibility bit
+ * visibility, for st if set, built if need be. Returns NULL if there is none,
+ * and the caller must select the devices itself then. The plan is valid until
+ * the lock is released. The caller must hold the lock.
+ */
+struct reply_plan *plan_get(upnprd_t *ctx, unsigned char zone, int visibility, const char *st) {
+	if(st && strlen(st) >= sizeof(ctx->reply_plans[0].st)) {
+		return NULL;
+	}
+
+	struct reply_plan *plan = NULL;
+	struct reply_plan *oldest = &ctx->reply_plans[0];
+	int i;
+	for(i=0; i<REPLY_PLANS; i++) {
+		struct reply_plan *candidate = &ctx->reply_plans[i];
+		if(candidate->generation && candidate->zone == zone && candidate->visibility == visibility &&
+				candidate->filtered == (st != NULL) && (!st || strcmp(candidate->st, st) == 0)) {
+			plan = candidate;
+			break;
+		}
+		if(candidate->used < oldest->used) {
+			oldest = candidate;
+		}
+	}
+
+	if(plan && plan->generation == ctx->store_generation) {
+		ctx->stats.reply_plan_hits++;
+	}
+	else {
+		if(!plan) {
+			// Replace the plan used least recently
+			plan = oldest;
+			plan->zone = zone;
+			plan->visibility = visibility;
+			plan->filtered = st != NULL;
+			strcpy(plan->st, st ? st : "");
+		}
+		if(build(ctx, plan) < 0) {
+			plan->generation = 0;
+			return NULL;
+		}
+	}
+	plan->used = ++ctx->reply_plan_clock;
+	return plan;
+}
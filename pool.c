@@ -0,0 +1,75 @@
+/*
+ * UPnP relay daemon - fixed size object pools
+ *
+ * Used for the fixed-footprint mode: All objects of a pool are allocated in
+ * one chunk when the pool is created, and handed out from a free list
+ * afterwards. Pools never grow; pool_get() returns NULL once all objects are
+ * in use, and the caller has to evict something or drop what it was doing.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+struct pool_object {
+	struct pool_object *next;
+};
+
+int pool_init(upnprd_t *ctx, struct pool *pool, size_t object_size, unsigned int capacity) {
+	memset(pool, 0, sizeof(*pool));
+	if(capacity == 0) {
+		return 0;
+	}
+
+	// Keep all objects aligned like malloc() would
+	const size_t alignment = sizeof(max_align_t);
+	object_size = (object_size + alignment - 1) & ~(alignment - 1);
+
+	pool->memory = xmalloc(ctx, UPNPRD_ALLOC_SETUP, object_size * capacity);
+	if(!pool->memory) {
+		return -1;
+	}
+	pool->object_size = object_size;
+	pool->capacity = capacity;
+
+	unsigned int i;
+	for(i=capacity; i>0; i--) {
+		struct pool_object *object = (struct pool_object *)((char *)pool->memory + (i - 1) * object_size);
+		object->next = pool->free_list;
+		pool->free_list = object;
+	}
+	return 0;
+}
+
+void *pool_get(struct pool *pool) {
+	struct pool_object *object = pool->free_list;
+	if(object) {
+		pool->free_list = object->next;
+		pool->used++;
+	}
+	return object;
+}
+
+void pool_put(struct pool *pool, void *ptr) {
+	struct pool_object *object = (struct pool_object *)ptr;
+	object->next = pool->free_list;
+	pool->free_list = object;
+	pool->used--;
+}
+
+void pool_destroy(upnprd_t *ctx, struct pool *pool) {
+	if(pool->memory) {
+		xfree(ctx, pool->memory);
+	}
+	memset(pool, 0, sizeof(*pool));
+}
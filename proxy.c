@@ -0,0 +1,798 @@
+/*
+ * UPnP relay daemon - description proxy
+ *
+ * Controllers fetch the description XML of every device they find from its
+ * LOCATION. Across a routed link, and from slow embedded devices, this can take
+ * seconds. With proxy_port set, the relay fetches each description once,
+ * caches it and serves it itself: LOCATIONs in replies are rewritten to
+ *
+ *   http://<relay>:<proxy_port>/<id>.xml
+ *
+ * where <relay> is the address the search was sent to, and <id> a hash of the
+ * original LOCATION. Several devices sharing a LOCATION share one cache entry.
+ *
+ * Descriptions are fetched as soon as a device is first seen. A cached copy is
+ * served without asking the device again for proxy_max_age seconds. After
+ * that, the next request still gets the cached copy, but triggers a
+ * revalidation with If-None-Match and If-Modified-Since, so a slow device never
+ * delays a controller once its description is known. Relative URLs in the
+ * description must still resolve against the device. Many controllers ignore
+ * <URLBase>, which UDA 1.1 deprecated, so the relative values of the *URL
+ * elements (SCPDURL, controlURL, eventSubURL, presentationURL, an icon's url)
+ * are made absolute, against the <URLBase> if there is one and the original
+ * LOCATION otherwise.
+ *
+ * Everything runs in the caller's event loop: The connections from controllers
+ * and the fetches from devices are non-blocking sockets in fixed-size tables.
+ * Only http:// LOCATIONs with an IPv4 address are proxied; replies on other
+ * devices are sent unchanged.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Seconds a fetch or a controller's connection may take
+#define PROXY_FETCH_TIMEOUT 10
+#define PROXY_CLIENT_TIMEOUT 15
+
+// Seconds before a failed fetch is retried
+#define PROXY_RETRY 30
+
+// Entry states
+#define PROXY_IDLE 0
+#define PROXY_PENDING 1     // Waiting for a free fetch slot
+#define PROXY_FETCHING 2
+
+// Client states
+#define CLIENT_READING 1
+#define CLIENT_WAITING 2    // For the fetch of client->waiting
+#define CLIENT_WRITING 3
+
+/* FNV-1a, never 0, which marks unused entries */
+static uint32_t location_id(const char *location) {
+	uint32_t hash = 2166136261u;
+	while(*location) {
+		hash = (hash ^ (unsigned char)*location++) * 16777619u;
+	}
+	return hash ? hash : 1;
+}
+
+/** CACHE ENTRIES ****************************************/
+static void document_unref(upnprd_t *ctx, struct proxy_document *document) {
+	if(document && --document->refs == 0) {
+		xfree(ctx, document);
+	}
+}
+
+static struct proxy_entry *find_entry(upnprd_t *ctx, uint32_t id) {
+	int i;
+	for(i=0; i<PROXY_ENTRIES; i++) {
+		if(ctx->proxy_entries[i].id == id) {
+			return &ctx->proxy_entries[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add an entry for location, to be fetched. If the table is full, the entry
+ * used least recently is reused, unless all are being fetched.
+ */
+static struct proxy_entry *add_entry(upnprd_t *ctx, uint32_t id, const char *location) {
+	struct proxy_entry *victim = NULL;
+	int i;
+	for(i=0; i<PROXY_ENTRIES; i++) {
+		struct proxy_entry *entry = &ctx->proxy_entries[i];
+		if(!entry->id) {
+			victim = entry;
+			break;
+		}
+		if(entry->state == PROXY_IDLE && (!victim || entry->used < victim->used)) {
+			victim = entry;
+		}
+	}
+	if(!victim) {
+		return NULL;
+	}
+
+	document_unref(ctx, victim->document);
+	memset(victim, 0, sizeof(*victim));
+	victim->id = id;
+	strcpy(victim->location, location);
+	victim->used = ctx->now;
+	victim->state = PROXY_PENDING;
+	return victim;
+}
+
+void proxy_device_added(upnprd_t *ctx, device_t *device) {
+	device->proxy_path[0] = 0;
+	if(ctx->proxy_fd < 0 || device->location_length >= PROXY_LOCATION_SIZE) {
+		return;
+	}
+	struct sockaddr_in addr;
+	const char *host, *path;
+	size_t host_length;
+	if(!parse_http_location(device->location, &addr, &host, &host_length, &path)) {
+		return;
+	}
+
+	uint32_t id = location_id(device->location);
+	snprintf(device->proxy_path, sizeof(device->proxy_path), "%08x.xml", id);
+
+	// Fetch descriptions right away, such that the first controller asking
+	// for them does not have to wait
+	if(!find_entry(ctx, id)) {
+		add_entry(ctx, id, device->location);
+	}
+}
+
+size_t proxy_prefix(upnprd_t *ctx, struct in_addr local, char *buffer) {
+	if(ctx->proxy_fd < 0 || local.s_addr == htonl(INADDR_ANY)) {
+		return 0;
+	}
+	char address[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &local, address, sizeof(address));
+	return snprintf(buffer, PROXY_PREFIX_SIZE, "http://%s:%u/", address, ctx->config.proxy_port);
+}
+
+/** CONNECTIONS FROM CONTROLLERS *************************/
+static void close_client(upnprd_t *ctx, struct proxy_client *client) {
+	close(client->fd);
+	client->fd = -1;
+	document_unref(ctx, client->document);
+	client->document = NULL;
+	client->waiting = NULL;
+}
+
+static void respond(upnprd_t *ctx, struct proxy_client *client, struct proxy_document *document, const char *status) {
+	if(document) {
+		client->header_length = snprintf(client->buffer, sizeof(client->buffer),
+			"HTTP/1.1 200 OK\r\nCONTENT-TYPE: text/xml; charset=\"utf-8\"\r\nCONTENT-LENGTH: %zu\r\nCONNECTION: close\r\n\r\n", document->length);
+		document->refs++;
+	}
+	else {
+		client->header_length = snprintf(client->buffer, sizeof(client->buffer),
+			"HTTP/1.1 %s\r\nCONTENT-LENGTH: 0\r\nCONNECTION: close\r\n\r\n", status);
+	}
+	client->document = document;
+	client->waiting = NULL;
+	client->offset = 0;
+	client->state = CLIENT_WRITING;
+}
+
+/* Find the device a request is for, if its entry was not cached */
+static struct proxy_entry *entry_for_request(upnprd_t *ctx, uint32_t id) {
+	char path[PROXY_PATH_SIZE];
+	snprintf(path, sizeof(path), "%08x.xml", id);
+
+	struct proxy_entry *entry = NULL;
+	LOCK(ctx);
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		if(strcmp(device->proxy_path, path) == 0) {
+			entry = add_entry(ctx, id, device->location);
+			break;
+		}
+	}
+	UNLOCK(ctx);
+	return entry;
+}
+
+static void handle_request(upnprd_t *ctx, struct proxy_client *client) {
+	ctx->stats.proxy_requests++;
+
+	// GET /<id>.xml
+	char *end;
+	uint32_t id = 0;
+	if(strncmp(client->buffer, "GET /", 5) == 0) {
+		id = strtoul(client->buffer + 5, &end, 16);
+		if(end != client->buffer + 13 || strncmp(end, ".xml ", 5) != 0) {
+			id = 0;
+		}
+	}
+	struct proxy_entry *entry = NULL;
+	if(id) {
+		entry = find_entry(ctx, id);
+		if(!entry) {
+			entry = entry_for_request(ctx, id);
+		}
+	}
+	if(!entry) {
+		respond(ctx, client, NULL, "404 Not Found");
+		return;
+	}
+	entry->used = ctx->now;
+
+	if(entry->document) {
+		// Serve the cached copy even if it is due for revalidation
+		ctx->stats.proxy_hits++;
+		respond(ctx, client, entry->document, NULL);
+		if(entry->state == PROXY_IDLE && entry->validated + ctx->config.proxy_max_age <= ctx->now && entry->retry <= ctx->now) {
+			entry->state = PROXY_PENDING;
+		}
+	}
+	else if(entry->state == PROXY_IDLE && entry->retry > ctx->now) {
+		respond(ctx, client, NULL, "502 Bad Gateway");
+	}
+	else {
+		if(entry->state == PROXY_IDLE) {
+			entry->state = PROXY_PENDING;
+		}
+		client->waiting = entry;
+		client->state = CLIENT_WAITING;
+	}
+}
+
+static void client_read(upnprd_t *ctx, struct proxy_client *client) {
+	ssize_t nbytes = recv(client->fd, client->buffer + client->offset, sizeof(client->buffer) - 1 - client->offset, MSG_DONTWAIT);
+	if(nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if(nbytes <= 0) {
+		close_client(ctx, client);
+		return;
+	}
+	client->offset += nbytes;
+	client->buffer[client->offset] = 0;
+	if(strstr(client->buffer, "\r\n\r\n")) {
+		handle_request(ctx, client);
+	}
+	else if(client->offset == sizeof(client->buffer) - 1) {
+		respond(ctx, client, NULL, "400 Bad Request");
+	}
+}
+
+static void client_write(upnprd_t *ctx, struct proxy_client *client) {
+	struct iovec iov[2];
+	int count = 0;
+	if(client->offset < client->header_length) {
+		iov[count].iov_base = client->buffer + client->offset;
+		iov[count++].iov_len = client->header_length - client->offset;
+	}
+	if(client->document) {
+		size_t sent = client->offset > client->header_length ? client->offset - client->header_length : 0;
+		iov[count].iov_base = PROXY_DOCUMENT_DATA(client->document) + sent;
+		iov[count++].iov_len = client->document->length - sent;
+	}
+
+	struct msghdr msg = { NULL, 0, iov, count, NULL, 0, 0 };
+	ssize_t nbytes = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(nbytes < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			close_client(ctx, client);
+		}
+		return;
+	}
+	client->offset += nbytes;
+	if(client->offset == client->header_length + (client->document ? client->document->length : 0)) {
+		close_client(ctx, client);
+	}
+}
+
+static void accept_clients(upnprd_t *ctx) {
+	int fd;
+	while((fd = accept4(ctx->proxy_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		struct proxy_client *client = NULL;
+		int i;
+		for(i=0; i<PROXY_CLIENTS; i++) {
+			if(ctx->proxy_clients[i].fd < 0) {
+				client = &ctx->proxy_clients[i];
+				break;
+			}
+		}
+		if(!client) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->state = CLIENT_READING;
+		client->offset = 0;
+		client->started = ctx->now;
+	}
+}
+
+/** FETCHES FROM DEVICES *********************************/
+/* Answer the controllers waiting for an entry, after its fetch ended */
+static void wake_clients(upnprd_t *ctx, struct proxy_entry *entry) {
+	int i;
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		struct proxy_client *client = &ctx->proxy_clients[i];
+		if(client->fd >= 0 && client->waiting == entry) {
+			respond(ctx, client, entry->document, "502 Bad Gateway");
+		}
+	}
+}
+
+/* Give up on an entry's fetch for now, and answer its waiting controllers */
+static void fetch_failed(upnprd_t *ctx, struct proxy_entry *entry) {
+	debugf("Failed to fetch %s\n", entry->location);
+	ctx->stats.proxy_failures++;
+	entry->retry = ctx->now + PROXY_RETRY;
+	entry->state = PROXY_IDLE;
+	wake_clients(ctx, entry);
+}
+
+static void end_fetch(upnprd_t *ctx, struct proxy_fetch *fetch, int failed) {
+	struct proxy_entry *entry = fetch->entry;
+	close(fetch->fd);
+	fetch->fd = -1;
+	fetch->entry = NULL;
+
+	if(failed) {
+		fetch_failed(ctx, entry);
+		return;
+	}
+	entry->state = PROXY_IDLE;
+	wake_clients(ctx, entry);
+}
+
+/* Copy the value of a response header, or clear value if it is missing or too long */
+static void copy_header(const char *headers, const char *name, char *value, size_t size) {
+	value[0] = 0;
+	const char *start = strcasestr(headers, name);
+	if(!start) {
+		return;
+	}
+	start += strlen(name);
+	start += strspn(start, " \t");
+	size_t length = strcspn(start, "\r\n");
+	if(length < size) {
+		memcpy(value, start, length);
+		value[length] = 0;
+	}
+}
+
+/* Whether an element holds a URL, like SCPDURL or an icon's url */
+static int is_url_element(const char *name, size_t length) {
+	return length >= 3 && strncasecmp(name + length - 3, "url", 3) == 0;
+}
+
+/*
+ * How much of base, an http:// URL up to and including the last slash of its
+ * path, goes in front of the URL value to make it absolute: Nothing if it
+ * already is, the scheme for //host references, the scheme and host for
+ * absolute paths, and all of it for relative paths.
+ */
+static size_t url_prefix_length(const char *base, const char *value, size_t length) {
+	size_t scheme = 0;
+	while(scheme < length && (isalnum((unsigned char)value[scheme]) || memchr("+-.", value[scheme], 3))) {
+		scheme++;
+	}
+	if(!length || (scheme < length && value[scheme] == ':' && isalpha((unsigned char)value[0]))) {
+		return 0;
+	}
+	if(value[0] == '/') {
+		return length > 1 && value[1] == '/' ? 5 : (size_t)(strchr(base + 7, '/') - base);
+	}
+	return strlen(base);
+}
+
+/*
+ * Copy a description to out, if set, resolving the relative values of its URL
+ * elements against base. Returns the length of the result.
+ */
+static size_t resolve_urls(const char *body, size_t length, const char *base, char *out) {
+	const char *end = body + length;
+	const char *copied = body;
+	size_t written = 0;
+	const char *tag = body;
+	while((tag = memchr(tag, '<', end - tag))) {
+		const char *name = ++tag;
+		size_t name_length = 0;
+		while(name + name_length < end && (isalnum((unsigned char)name[name_length]) || memchr(":_.-", name[name_length], 4))) {
+			name_length++;
+		}
+		const char *close = memchr(name + name_length, '>', end - name - name_length);
+		if(!close) {
+			break;
+		}
+		if(close[-1] == '/' || !is_url_element(name, name_length)) {
+			continue;
+		}
+		const char *value = close + 1;
+		while(value < end && isspace((unsigned char)*value)) {
+			value++;
+		}
+		const char *value_end = memchr(value, '<', end - value);
+		if(!value_end) {
+			break;
+		}
+		size_t prefix = url_prefix_length(base, value, value_end - value);
+		if(out && prefix) {
+			memcpy(out + written, copied, value - copied);
+			memcpy(out + written + (value - copied), base, prefix);
+		}
+		if(prefix) {
+			written += value - copied + prefix;
+			copied = value;
+		}
+		tag = value_end;
+	}
+	if(out) {
+		memcpy(out + written, copied, end - copied);
+	}
+	return written + (end - copied);
+}
+
+/*
+ * The base relative URLs in a description resolve against, into base: its
+ * <URLBase> if it has one, the LOCATION it was retrieved from otherwise, up to
+ * the last slash of the path. Returns 0 if that is no http:// URL, or would
+ * need escaping in XML.
+ */
+static int description_base(struct proxy_entry *entry, const char *body, size_t length, char *base, size_t size) {
+	const char *url = entry->location;
+	size_t url_length = strlen(url);
+	const char *url_base = memmem(body, length, "<URLBase>", 9);
+	if(url_base) {
+		url = url_base + 9;
+		const char *url_end = memchr(url, '<', length - (url - body));
+		if(!url_end) {
+			return 0;
+		}
+		while(url < url_end && isspace((unsigned char)*url)) {
+			url++;
+		}
+		url_length = url_end - url;
+		while(url_length && isspace((unsigned char)url[url_length - 1])) {
+			url_length--;
+		}
+	}
+	url_length = strcspn(url, "?#<") < url_length ? strcspn(url, "?#<") : url_length;
+	if(url_length <= 7 || strncasecmp(url, "http://", 7) != 0 || url_length + 2 > size) {
+		return 0;
+	}
+	memcpy(base, url, url_length);
+	base[url_length] = 0;
+	if(strpbrk(base, "<>&\"' \t\r\n")) {
+		return 0;
+	}
+
+	// Keep the path up to its last slash, and make sure it has one
+	char *slash = strrchr(base + 7, '/');
+	if(slash) {
+		slash[1] = 0;
+	}
+	else {
+		strcat(base, "/");
+	}
+	return 1;
+}
+
+/*
+ * Store a fetched description. Served by the relay, relative URLs in it would
+ * resolve against the relay, so they are made absolute, see above.
+ */
+static struct proxy_document *make_document(upnprd_t *ctx, struct proxy_entry *entry, const char *body, size_t length) {
+	char base[PROXY_LOCATION_SIZE + 1];
+	int resolve = description_base(entry, body, length, base, sizeof(base));
+	size_t resolved_length = resolve ? resolve_urls(body, length, base, NULL) : length;
+
+	struct proxy_document *document = (struct proxy_document *)xmalloc(ctx, UPNPRD_ALLOC_PROXY, sizeof(struct proxy_document) + resolved_length);
+	if(!document) {
+		return NULL;
+	}
+	document->refs = 1;
+	document->length = resolved_length;
+	if(resolve) {
+		resolve_urls(body, length, base, PROXY_DOCUMENT_DATA(document));
+	}
+	else {
+		memcpy(PROXY_DOCUMENT_DATA(document), body, length);
+	}
+	return document;
+}
+
+/* Process a complete response */
+static void complete_fetch(upnprd_t *ctx, struct proxy_fetch *fetch) {
+	struct proxy_entry *entry = fetch->entry;
+	char *buffer = fetch->buffer;
+	buffer[fetch->length] = 0;
+
+	char *body = strstr(buffer, "\r\n\r\n");
+	int status = 0;
+	if(!body || sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) {
+		end_fetch(ctx, fetch, 1);
+		return;
+	}
+	*body = 0;
+	body += 4;
+	size_t length = fetch->length - (body - buffer);
+
+	if(status == 304 && entry->document) {
+		ctx->stats.proxy_not_modified++;
+		entry->validated = ctx->now;
+		end_fetch(ctx, fetch, 0);
+		return;
+	}
+	if(status != 200) {
+		end_fetch(ctx, fetch, 1);
+		return;
+	}
+
+	// Trust Content-Length over the end of the connection, if given
+	char content_length[16];
+	copy_header(buffer, "\nContent-Length:", content_length, sizeof(content_length));
+	if(content_length[0]) {
+		size_t expected = strtoul(content_length, NULL, 10);
+		if(expected > length) {
+			end_fetch(ctx, fetch, 1);
+			return;
+		}
+		length = expected;
+	}
+
+	struct proxy_document *document = make_document(ctx, entry, body, length);
+	if(!document) {
+		end_fetch(ctx, fetch, 1);
+		return;
+	}
+	document_unref(ctx, entry->document);
+	entry->document = document;
+	entry->validated = ctx->now;
+	copy_header(buffer, "\nETag:", entry->etag, sizeof(entry->etag));
+	copy_header(buffer, "\nLast-Modified:", entry->last_modified, sizeof(entry->last_modified));
+	end_fetch(ctx, fetch, 0);
+}
+
+static void start_fetch(upnprd_t *ctx, struct proxy_fetch *fetch, struct proxy_entry *entry) {
+	struct sockaddr_in addr;
+	const char *host, *path;
+	size_t host_length;
+	if(!parse_http_location(entry->location, &addr, &host, &host_length, &path)) {
+		fetch_failed(ctx, entry);
+		return;
+	}
+
+	// HTTP/1.0, such that the response is never chunked
+	int length = snprintf(fetch->buffer, PROXY_DOCUMENT_SIZE, "GET %s HTTP/1.0\r\nHOST: %.*s\r\nCONNECTION: close\r\n", path, (int)host_length, host);
+	if(entry->document && entry->etag[0]) {
+		length += snprintf(fetch->buffer + length, PROXY_DOCUMENT_SIZE - length, "IF-NONE-MATCH: %s\r\n", entry->etag);
+	}
+	if(entry->document && entry->last_modified[0]) {
+		length += snprintf(fetch->buffer + length, PROXY_DOCUMENT_SIZE - length, "IF-MODIFIED-SINCE: %s\r\n", entry->last_modified);
+	}
+	length += snprintf(fetch->buffer + length, PROXY_DOCUMENT_SIZE - length, "\r\n");
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		fd = -1;
+	}
+	if(fd < 0) {
+		fetch_failed(ctx, entry);
+		return;
+	}
+
+	ctx->stats.proxy_fetches++;
+	fetch->fd = fd;
+	fetch->entry = entry;
+	fetch->started = ctx->now;
+	fetch->request_length = length;
+	fetch->length = 0;
+	fetch->sending = 1;
+	entry->state = PROXY_FETCHING;
+}
+
+static void fetch_io(upnprd_t *ctx, struct proxy_fetch *fetch) {
+	ssize_t nbytes;
+	if(fetch->sending) {
+		// The connection is established once the socket is writable
+		nbytes = send(fetch->fd, fetch->buffer + fetch->length, fetch->request_length - fetch->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(nbytes >= 0) {
+			fetch->length += nbytes;
+			if(fetch->length == fetch->request_length) {
+				fetch->sending = 0;
+				fetch->length = 0;
+			}
+			return;
+		}
+	}
+	else {
+		// Keep a byte for the terminator. A description that does not
+		// fit is not cached.
+		nbytes = recv(fetch->fd, fetch->buffer + fetch->length, PROXY_DOCUMENT_SIZE - 1 - fetch->length, MSG_DONTWAIT);
+		if(nbytes == 0) {
+			complete_fetch(ctx, fetch);
+			return;
+		}
+		if(nbytes > 0) {
+			fetch->length += nbytes;
+			if(fetch->length == PROXY_DOCUMENT_SIZE - 1) {
+				end_fetch(ctx, fetch, 1);
+			}
+			return;
+		}
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		end_fetch(ctx, fetch, 1);
+	}
+}
+
+/* Start fetches for pending entries, as long as there are free slots */
+static void start_fetches(upnprd_t *ctx) {
+	int slot = 0;
+	int i;
+	for(i=0; i<PROXY_ENTRIES; i++) {
+		struct proxy_entry *entry = &ctx->proxy_entries[i];
+		if(entry->state != PROXY_PENDING) {
+			continue;
+		}
+		while(slot < PROXY_FETCHES && ctx->proxy_fetches[slot].fd >= 0) {
+			slot++;
+		}
+		if(slot == PROXY_FETCHES) {
+			return;
+		}
+		start_fetch(ctx, &ctx->proxy_fetches[slot], entry);
+	}
+}
+
+/** EVENT LOOP *******************************************/
+int proxy_setup(upnprd_t *ctx) {
+	ctx->proxy_fd = -1;
+	if(!ctx->config.proxy_port) {
+		return 0;
+	}
+
+	int i;
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		ctx->proxy_clients[i].fd = -1;
+	}
+	for(i=0; i<PROXY_FETCHES; i++) {
+		ctx->proxy_fetches[i].fd = -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd < 0) {
+		return -2;
+	}
+	static unsigned int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(ctx->config.proxy_port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, PROXY_CLIENTS) < 0) {
+		close(fd);
+		return -4;
+	}
+
+	// One receive buffer per fetch, the size of the largest description
+	ctx->proxy_buffers = (char *)xmalloc(ctx, UPNPRD_ALLOC_SETUP, PROXY_FETCHES * PROXY_DOCUMENT_SIZE);
+	if(!ctx->proxy_buffers) {
+		close(fd);
+		return -2;
+	}
+	for(i=0; i<PROXY_FETCHES; i++) {
+		ctx->proxy_fetches[i].buffer = ctx->proxy_buffers + i * PROXY_DOCUMENT_SIZE;
+	}
+	ctx->proxy_fd = fd;
+	return 0;
+}
+
+int proxy_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	FD_SET(ctx->proxy_fd, readfds);
+	int highest_fd = ctx->proxy_fd;
+	int i;
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		struct proxy_client *client = &ctx->proxy_clients[i];
+		if(client->fd < 0 || client->state == CLIENT_WAITING) {
+			continue;
+		}
+		FD_SET(client->fd, client->state == CLIENT_READING ? readfds : writefds);
+		if(client->fd > highest_fd) {
+			highest_fd = client->fd;
+		}
+	}
+	for(i=0; i<PROXY_FETCHES; i++) {
+		struct proxy_fetch *fetch = &ctx->proxy_fetches[i];
+		if(fetch->fd < 0) {
+			continue;
+		}
+		FD_SET(fetch->fd, fetch->sending ? writefds : readfds);
+		if(fetch->fd > highest_fd) {
+			highest_fd = fetch->fd;
+		}
+	}
+	return highest_fd;
+}
+
+void proxy_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	int i;
+	for(i=0; i<PROXY_FETCHES; i++) {
+		struct proxy_fetch *fetch = &ctx->proxy_fetches[i];
+		if(fetch->fd < 0) {
+			continue;
+		}
+		if(FD_ISSET(fetch->fd, fetch->sending ? writefds : readfds)) {
+			fetch_io(ctx, fetch);
+		}
+		else if(fetch->started + PROXY_FETCH_TIMEOUT <= ctx->now) {
+			end_fetch(ctx, fetch, 1);
+		}
+	}
+
+	if(FD_ISSET(ctx->proxy_fd, readfds)) {
+		accept_clients(ctx);
+	}
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		struct proxy_client *client = &ctx->proxy_clients[i];
+		if(client->fd < 0) {
+			continue;
+		}
+		if(client->state == CLIENT_READING && FD_ISSET(client->fd, readfds)) {
+			client_read(ctx, client);
+		}
+		else if(client->state == CLIENT_WRITING && FD_ISSET(client->fd, writefds)) {
+			client_write(ctx, client);
+		}
+		if(client->fd >= 0 && client->started + PROXY_CLIENT_TIMEOUT <= ctx->now) {
+			close_client(ctx, client);
+		}
+	}
+
+	start_fetches(ctx);
+}
+
+/* When proxy_poll() next has a timeout to enforce, 0 if never */
+time_t proxy_deadline(upnprd_t *ctx) {
+	time_t deadline = 0;
+	int i;
+	for(i=0; i<PROXY_FETCHES; i++) {
+		struct proxy_fetch *fetch = &ctx->proxy_fetches[i];
+		if(fetch->fd >= 0 && (!deadline || fetch->started + PROXY_FETCH_TIMEOUT < deadline)) {
+			deadline = fetch->started + PROXY_FETCH_TIMEOUT;
+		}
+	}
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		struct proxy_client *client = &ctx->proxy_clients[i];
+		if(client->fd >= 0 && (!deadline || client->started + PROXY_CLIENT_TIMEOUT < deadline)) {
+			deadline = client->started + PROXY_CLIENT_TIMEOUT;
+		}
+	}
+	return deadline;
+}
+
+void proxy_close(upnprd_t *ctx) {
+	if(ctx->proxy_fd < 0) {
+		return;
+	}
+	close(ctx->proxy_fd);
+	int i;
+	for(i=0; i<PROXY_CLIENTS; i++) {
+		if(ctx->proxy_clients[i].fd >= 0) {
+			close_client(ctx, &ctx->proxy_clients[i]);
+		}
+	}
+	for(i=0; i<PROXY_FETCHES; i++) {
+		if(ctx->proxy_fetches[i].fd >= 0) {
+			close(ctx->proxy_fetches[i].fd);
+		}
+	}
+	for(i=0; i<PROXY_ENTRIES; i++) {
+		document_unref(ctx, ctx->proxy_entries[i].document);
+	}
+	xfree(ctx, ctx->proxy_buffers);
+}
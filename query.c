@@ -0,0 +1,525 @@
+/*
+ * UPnP relay daemon - local query API
+ *
+ * Local programs that need devices would otherwise send an M-SEARCH of their
+ * own and wait out its MX, making every device on the network answer. With
+ * query_socket set, the relay answers them from its cache instead, over a Unix
+ * stream socket at that path. Requests are lines of the form
+ *
+ *   all
+ *   st <ST>          Devices of that type, like an M-SEARCH for it
+ *   usn <USN>        The device with that USN
+ *   uuid <prefix>    Devices whose UUID starts with prefix
+ *
+ * Each is answered with one line per device, and a line ending the answer:
+ *
+ *   device\t<USN>\t<ST>\t<LOCATION>
+ *   end\t<number of devices>
+ *
+ * or with "error\t<message>". A client may send any number of requests without
+ * waiting for the answers, which come in order.
+ *
+ * Programs showing the device list can subscribe to changes instead of
+ * polling, with
+ *
+ *   subscribe [<ST>]
+ *
+ * The connection then receives a snapshot of the devices of that type (all if
+ * none is given), and from then on an event for each device added, changed or
+ * removed:
+ *
+ *   resync
+ *   added\t<USN>\t<ST>\t<LOCATION>     One per device of the snapshot
+ *   synced\t<number of devices>
+ *   added\t<USN>\t<ST>\t<LOCATION>
+ *   changed\t<USN>\t<ST>\t<LOCATION>
+ *   removed\t<USN>\t<ST>\t<LOCATION>
+ *
+ * Whatever else it sends is ignored. A device changes when it announces a new
+ * LOCATION from the same address, see update_device(). Events wait in a ring
+ * of QUERY_EVENTS per subscriber, where those of the same device are
+ * coalesced, e.g. added and removed again cancel out. If a subscriber falls so
+ * far behind that its ring overflows, its events are dropped, and it is sent
+ * a new snapshot starting with "resync" instead, after which it is current
+ * again. Subscribers never hold up the relay.
+ *
+ * Answers are written into a fixed buffer per client. If one does not fit,
+ * the rest is written once the client read enough; devices are in the order
+ * they were cached in, so the answer continues after the serial of the last
+ * device written, unaffected by devices removed in the meantime.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Requests
+#define QUERY_NONE 0
+#define QUERY_ALL 1
+#define QUERY_ST 2
+#define QUERY_USN 3
+#define QUERY_UUID 4
+#define QUERY_SUBSCRIBE 5
+
+// Events
+#define QUERY_EVENT_NONE 0
+#define QUERY_EVENT_ADDED 1
+#define QUERY_EVENT_CHANGED 2
+#define QUERY_EVENT_REMOVED 3
+
+static const char *event_names[] = { NULL, "added", "changed", "removed" };
+
+// Subscription snapshots
+#define SNAPSHOT_NONE 0
+#define SNAPSHOT_DUE 1
+#define SNAPSHOT_RUNNING 2
+
+static void close_client(struct query_client *client) {
+	close(client->fd);
+	client->fd = -1;
+}
+
+static int query_matches(struct query_client *client, device_t *device) {
+	switch(client->query) {
+		case QUERY_ST:
+			return strcmp(client->argument, "ssdp:all") == 0 || overload_device_matches(device, client->argument);
+		case QUERY_USN:
+			return strcmp(device->usn, client->argument) == 0;
+		case QUERY_UUID:
+			return strncmp(device->usn, "uuid:", 5) == 0 && strncmp(device->usn + 5, client->argument, strlen(client->argument)) == 0;
+		case QUERY_SUBSCRIBE:
+			return !client->argument[0] || strcmp(client->argument, "ssdp:all") == 0 || overload_device_matches(device, client->argument);
+		default:
+			return 1;
+	}
+}
+
+/* Append a line to the client's output, unless it does not fit */
+static int append(struct query_client *client, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	size_t room = QUERY_BUFFER_SIZE - client->output_length;
+	int length = vsnprintf(client->output + client->output_length, room, format, args);
+	va_end(args);
+	if(length < 0 || (size_t)length >= room) {
+		return -1;
+	}
+	client->output_length += length;
+	return 0;
+}
+
+/*
+ * Write as many of the matching devices after client->cursor as fit, as lines
+ * starting with kind. Returns 1 once all are written. The caller must hold the
+ * lock.
+ */
+static int write_devices(upnprd_t *ctx, struct query_client *client, const char *kind) {
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		if(device->serial <= client->cursor || !query_matches(client, device)) {
+			continue;
+		}
+		if(append(client, "%s\t%s\t%s\t%s\n", kind, device->usn, device->st, device->location) < 0) {
+			if(client->output_length == 0) {
+				// Larger than the whole buffer, leave it out
+				client->cursor = device->serial;
+				continue;
+			}
+			return 0;
+		}
+		client->cursor = device->serial;
+		client->count++;
+	}
+	return 1;
+}
+
+/* Write as much of the current answer as fits */
+static void answer(upnprd_t *ctx, struct query_client *client) {
+	LOCK(ctx);
+	int done = write_devices(ctx, client, "device");
+	UNLOCK(ctx);
+	if(done && append(client, "end\t%lu\n", client->count) == 0) {
+		client->query = QUERY_NONE;
+	}
+}
+
+/* Start over with a snapshot, dropping the queued events */
+static void resync(struct query_client *client) {
+	client->events_start = client->events_count = 0;
+	client->snapshot = SNAPSHOT_DUE;
+	client->cursor = 0;
+	client->count = 0;
+}
+
+/* Write queued events and the snapshot, as far as they fit */
+static void deliver(upnprd_t *ctx, struct query_client *client) {
+	LOCK(ctx);
+	// Events first: While a snapshot is written, only those of devices it
+	// has passed already are queued
+	while(client->events_count) {
+		struct query_event *event = &client->events[client->events_start];
+		if(event->type != QUERY_EVENT_NONE) {
+			if(QUERY_BUFFER_SIZE - client->output_length < event->length) {
+				UNLOCK(ctx);
+				return;
+			}
+			memcpy(client->output + client->output_length, event->line, event->length);
+			client->output_length += event->length;
+			ctx->stats.subscription_events++;
+		}
+		client->events_start = (client->events_start + 1) % QUERY_EVENTS;
+		client->events_count--;
+	}
+
+	if(client->snapshot == SNAPSHOT_DUE && append(client, "resync\n") == 0) {
+		client->snapshot = SNAPSHOT_RUNNING;
+	}
+	if(client->snapshot == SNAPSHOT_RUNNING && write_devices(ctx, client, "added") && append(client, "synced\t%lu\n", client->count) == 0) {
+		client->snapshot = SNAPSHOT_NONE;
+	}
+	UNLOCK(ctx);
+}
+
+static int subscription_pending(struct query_client *client) {
+	return client->events_count || client->snapshot != SNAPSHOT_NONE;
+}
+
+/* Queue an event for a subscriber, coalescing it with a queued one of the same device */
+static void queue_event(upnprd_t *ctx, struct query_client *client, device_t *device, int type) {
+	if(client->snapshot == SNAPSHOT_DUE || (client->snapshot == SNAPSHOT_RUNNING && device->serial > client->cursor)) {
+		// The snapshot has yet to get to it
+		return;
+	}
+
+	struct query_event *event = NULL;
+	unsigned int i;
+	for(i=0; i<client->events_count; i++) {
+		struct query_event *queued = &client->events[(client->events_start + i) % QUERY_EVENTS];
+		if(queued->type != QUERY_EVENT_NONE && queued->usn_length == device->usn_length && memcmp(queued->line + queued->usn_offset, device->usn, device->usn_length) == 0) {
+			event = queued;
+			break;
+		}
+	}
+	if(event) {
+		if(event->type == QUERY_EVENT_ADDED && type == QUERY_EVENT_REMOVED) {
+			// The subscriber never knew about it
+			event->type = QUERY_EVENT_NONE;
+			return;
+		}
+		if(event->type == QUERY_EVENT_ADDED) {
+			type = QUERY_EVENT_ADDED;
+		}
+		else if(event->type == QUERY_EVENT_REMOVED && type == QUERY_EVENT_ADDED) {
+			type = QUERY_EVENT_CHANGED;
+		}
+	}
+	else if(client->events_count < QUERY_EVENTS) {
+		event = &client->events[(client->events_start + client->events_count++) % QUERY_EVENTS];
+	}
+	else {
+		ctx->stats.subscription_resyncs++;
+		resync(client);
+		return;
+	}
+
+	int length = snprintf(event->line, sizeof(event->line), "%s\t%s\t%s\t%s\n", event_names[type], device->usn, device->st, device->location);
+	if(length < 0 || (size_t)length >= sizeof(event->line)) {
+		// Too long to queue, the snapshot will have it
+		ctx->stats.subscription_resyncs++;
+		resync(client);
+		return;
+	}
+	event->type = type;
+	event->serial = device->serial;
+	event->usn_offset = strlen(event_names[type]) + 1;
+	event->usn_length = device->usn_length;
+	event->length = length;
+}
+
+static void device_event(upnprd_t *ctx, device_t *device, int type) {
+	if(ctx->query_fd < 0) {
+		return;
+	}
+	int i;
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		struct query_client *client = &ctx->query_clients[i];
+		if(client->fd >= 0 && client->query == QUERY_SUBSCRIBE && query_matches(client, device)) {
+			queue_event(ctx, client, device, type);
+		}
+	}
+}
+
+/* Called with the lock held, after the device was stored */
+void query_device_added(upnprd_t *ctx, device_t *device) {
+	device_event(ctx, device, QUERY_EVENT_ADDED);
+}
+
+/* Called with the lock held, after the device was removed from the list */
+void query_device_removed(upnprd_t *ctx, device_t *device) {
+	device_event(ctx, device, QUERY_EVENT_REMOVED);
+}
+
+/* Parse the next complete request line, if any, into client->query */
+static void next_request(upnprd_t *ctx, struct query_client *client) {
+	char *end = memchr(client->request, '\n', client->request_length);
+	if(!end) {
+		return;
+	}
+	*end = 0;
+	if(end > client->request && end[-1] == '\r') {
+		end[-1] = 0;
+	}
+	size_t used = end + 1 - client->request;
+
+	static const struct {
+		const char *name;
+		int query;
+	} requests[] = { { "all", QUERY_ALL }, { "st", QUERY_ST }, { "usn", QUERY_USN }, { "uuid", QUERY_UUID }, { "subscribe", QUERY_SUBSCRIBE } };
+	char *argument = client->request + strcspn(client->request, " ");
+	if(*argument) {
+		*argument++ = 0;
+	}
+	int i;
+	for(i=0; i<sizeof(requests)/sizeof(requests[0]); i++) {
+		// all takes no argument, subscribe an optional one
+		if(strcmp(client->request, requests[i].name) == 0 && (requests[i].query == QUERY_SUBSCRIBE || (requests[i].query == QUERY_ALL) == !*argument)) {
+			client->query = requests[i].query;
+			break;
+		}
+	}
+	if(client->query == QUERY_NONE) {
+		if(client->request[0]) {
+			append(client, "error\tunknown request\n");
+		}
+	}
+	else {
+		ctx->stats.queries++;
+		snprintf(client->argument, sizeof(client->argument), "%s", argument);
+		client->cursor = 0;
+		client->count = 0;
+		if(client->query == QUERY_SUBSCRIBE) {
+			resync(client);
+		}
+	}
+
+	memmove(client->request, client->request + used, client->request_length - used);
+	client->request_length -= used;
+	if(client->query == QUERY_SUBSCRIBE) {
+		// Nothing after this is read
+		client->request_length = 0;
+	}
+}
+
+/* Answer the requests received so far, as far as the output buffer allows */
+static void process(upnprd_t *ctx, struct query_client *client) {
+	while(client->output_length < QUERY_BUFFER_SIZE / 2) {
+		if(client->query == QUERY_NONE) {
+			size_t before = client->request_length;
+			next_request(ctx, client);
+			if(client->request_length == before) {
+				return;
+			}
+		}
+		if(client->query == QUERY_SUBSCRIBE) {
+			deliver(ctx, client);
+			return;
+		}
+		if(client->query != QUERY_NONE) {
+			size_t before = client->output_length;
+			answer(ctx, client);
+			if(client->query != QUERY_NONE && client->output_length == before) {
+				return;
+			}
+		}
+	}
+}
+
+static void client_read(upnprd_t *ctx, struct query_client *client) {
+	ssize_t nbytes = recv(client->fd, client->request + client->request_length, sizeof(client->request) - client->request_length, MSG_DONTWAIT);
+	if(nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if(nbytes == 0) {
+		// Answer what was asked before hanging up
+		client->closing = 1;
+		return;
+	}
+	if(nbytes < 0) {
+		close_client(client);
+		return;
+	}
+	if(client->query == QUERY_SUBSCRIBE) {
+		return;
+	}
+	client->request_length += nbytes;
+	if(client->request_length == sizeof(client->request) && !memchr(client->request, '\n', client->request_length)) {
+		// Too long to be a request
+		close_client(client);
+	}
+}
+
+static void client_write(struct query_client *client) {
+	ssize_t nbytes = send(client->fd, client->output + client->output_sent, client->output_length - client->output_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(nbytes < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			close_client(client);
+		}
+		return;
+	}
+	client->output_sent += nbytes;
+	if(client->output_sent == client->output_length) {
+		client->output_sent = client->output_length = 0;
+	}
+}
+
+static void accept_clients(upnprd_t *ctx) {
+	int fd;
+	while((fd = accept4(ctx->query_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		struct query_client *client = NULL;
+		int i;
+		for(i=0; i<QUERY_CLIENTS; i++) {
+			if(ctx->query_clients[i].fd < 0) {
+				client = &ctx->query_clients[i];
+				break;
+			}
+		}
+		if(!client) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->request_length = 0;
+		client->output_length = client->output_sent = 0;
+		client->query = QUERY_NONE;
+		client->closing = 0;
+		client->events_count = 0;
+		client->snapshot = SNAPSHOT_NONE;
+	}
+}
+
+/** EVENT LOOP *******************************************/
+int query_setup(upnprd_t *ctx) {
+	ctx->query_fd = -1;
+	if(!ctx->config.query_socket[0]) {
+		return 0;
+	}
+
+	int i;
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		ctx->query_clients[i].fd = -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd < 0) {
+		return -2;
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctx->config.query_socket);
+
+	// A socket left behind by an instance that did not exit cleanly
+	unlink(addr.sun_path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, QUERY_CLIENTS) < 0) {
+		close(fd);
+		return -4;
+	}
+
+	// Output buffers, followed by the event rings
+	ctx->query_buffers = (char *)xmalloc(ctx, UPNPRD_ALLOC_SETUP, QUERY_CLIENTS * (QUERY_BUFFER_SIZE + QUERY_EVENTS * sizeof(struct query_event)));
+	if(!ctx->query_buffers) {
+		close(fd);
+		unlink(addr.sun_path);
+		return -2;
+	}
+	struct query_event *events = (struct query_event *)(ctx->query_buffers + QUERY_CLIENTS * QUERY_BUFFER_SIZE);
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		ctx->query_clients[i].output = ctx->query_buffers + i * QUERY_BUFFER_SIZE;
+		ctx->query_clients[i].events = events + i * QUERY_EVENTS;
+	}
+	ctx->query_fd = fd;
+	return 0;
+}
+
+int query_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	FD_SET(ctx->query_fd, readfds);
+	int highest_fd = ctx->query_fd;
+	int i;
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		struct query_client *client = &ctx->query_clients[i];
+		if(client->fd < 0) {
+			continue;
+		}
+		if(!client->closing && client->request_length < sizeof(client->request)) {
+			FD_SET(client->fd, readfds);
+		}
+		// Also with answers still to be written, which happens once
+		// there is room for them
+		if(client->output_length || (client->query == QUERY_SUBSCRIBE ? subscription_pending(client) : client->query != QUERY_NONE) || memchr(client->request, '\n', client->request_length)) {
+			FD_SET(client->fd, writefds);
+		}
+		if(client->fd > highest_fd) {
+			highest_fd = client->fd;
+		}
+	}
+	return highest_fd;
+}
+
+void query_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	if(FD_ISSET(ctx->query_fd, readfds)) {
+		accept_clients(ctx);
+	}
+	int i;
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		struct query_client *client = &ctx->query_clients[i];
+		if(client->fd >= 0 && FD_ISSET(client->fd, readfds)) {
+			client_read(ctx, client);
+		}
+		if(client->fd >= 0) {
+			process(ctx, client);
+		}
+		// Right away, the socket is most likely writable
+		if(client->fd >= 0 && client->output_length) {
+			client_write(client);
+		}
+		if(client->fd >= 0 && client->closing && client->query == QUERY_SUBSCRIBE) {
+			close_client(client);
+		}
+		if(client->fd >= 0 && client->closing && !client->output_length && client->query == QUERY_NONE && !memchr(client->request, '\n', client->request_length)) {
+			close_client(client);
+		}
+	}
+}
+
+void query_close(upnprd_t *ctx) {
+	if(ctx->query_fd < 0) {
+		return;
+	}
+	close(ctx->query_fd);
+	ctx->query_fd = -1;
+	unlink(ctx->config.query_socket);
+	int i;
+	for(i=0; i<QUERY_CLIENTS; i++) {
+		if(ctx->query_clients[i].fd >= 0) {
+			close_client(&ctx->query_clients[i]);
+		}
+	}
+	xfree(ctx, ctx->query_buffers);
+}
@@ -0,0 +1,1614 @@
+/*
+ * UPnP relay daemon - relay instance
+ *
+ * This file holds everything a single relay instance does: Listening for SSDP
+ * traffic, caching NOTIFYs and answering M-SEARCHes from the cache. All state
+ * lives in a struct upnprd, see upnprd.h for the API.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+static const char *parse_headers[] = { "\nlocation: ", "\nnt: ", "\nusn: " };
+
+static const char *discovery_message_format = "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\nMX: %u\r\nST: ssdp:all\r\n\r\n";
+
+#ifndef THREADS
+static void device_unref(upnprd_t *ctx, device_t *device);
+#endif
+
+/** REPLY TEMPLATE ***************************************/
+/*
+ * Replies are sent as an iovec of the static fragments below, interleaved
+ * with the device's stored strings, so they never need to be formatted or
+ * copied. With the description proxy, the LOCATION is made of a prefix
+ * pointing at the relay and the device's proxy_path instead.
+ */
+static const char reply_location[] = "HTTP/1.1 200 OK\r\nLOCATION: ";
+static const char reply_max_age[] = "\r\nSERVER: UPnP Cache\r\nCACHE-CONTROL: max-age=";
+static const char reply_st[] = "\r\nEXT:\r\nST: ";
+static const char reply_usn[] = "\r\nUSN: ";
+static const char reply_end[] = "\r\n\r\n";
+
+// Evaluates iov once, such that it may be iov[n++]
+#define SET_IOV(iov, base, len) do { struct iovec *_iov = (iov); _iov->iov_base = (void *)(base); _iov->iov_len = (len); } while(0)
+
+/*
+ * Fill iov with the reply on device, using prefix (see proxy_prefix()) for
+ * its LOCATION if prefix_length is non-zero. Returns the number of entries
+ * used.
+ */
+static int reply_iov(upnprd_t *ctx, device_t *device, struct iovec *iov, const char *prefix, size_t prefix_length) {
+	int n = 0;
+	SET_IOV(&iov[n++], reply_location, sizeof(reply_location) - 1);
+	if(prefix_length && device->proxy_path[0]) {
+		SET_IOV(&iov[n++], prefix, prefix_length);
+		SET_IOV(&iov[n++], device->proxy_path, PROXY_PATH_SIZE - 1);
+	}
+	else {
+		SET_IOV(&iov[n++], device->location, device->location_length);
+	}
+	SET_IOV(&iov[n++], reply_max_age, sizeof(reply_max_age) - 1);
+	if(ctx->config.max_age_adaptive && device->max_age_length) {
+		SET_IOV(&iov[n++], device->max_age, device->max_age_length);
+	}
+	else {
+		SET_IOV(&iov[n++], ctx->max_age, ctx->max_age_length);
+	}
+	SET_IOV(&iov[n++], reply_st, sizeof(reply_st) - 1);
+	SET_IOV(&iov[n++], device->st, device->st_length);
+	SET_IOV(&iov[n++], reply_usn, sizeof(reply_usn) - 1);
+	SET_IOV(&iov[n++], device->usn, device->usn_length);
+	SET_IOV(&iov[n++], reply_end, sizeof(reply_end) - 1);
+	return n;
+}
+
+/* The size of the reply on device */
+static size_t reply_length(upnprd_t *ctx, device_t *device, size_t prefix_length) {
+	size_t location_length = prefix_length && device->proxy_path[0] ? prefix_length + PROXY_PATH_SIZE - 1 : device->location_length;
+	return sizeof(reply_location) + sizeof(reply_max_age) + sizeof(reply_st) + sizeof(reply_usn) + sizeof(reply_end) - 5 +
+		location_length + (ctx->config.max_age_adaptive && device->max_age_length ? device->max_age_length : ctx->max_age_length) + device->st_length + device->usn_length;
+}
+
+#ifndef THREADS
+static int discovery_iov(upnprd_t *ctx, struct iovec *iov) {
+	SET_IOV(&iov[0], ctx->discovery_message, ctx->discovery_message_length);
+	return 1;
+}
+#endif
+
+/** CONCURRENCY HANDLING *********************************/
+#ifdef THREADS
+	static int spawn_thread(upnprd_t *ctx, void *(*start_routine)(void *), void *arg) {
+		pthread_t thread;
+		LOCK(ctx);
+		if(pthread_create(&thread, NULL, start_routine, arg) != 0) {
+			UNLOCK(ctx);
+			return -1;
+		}
+		ctx->active_threads++;
+		UNLOCK(ctx);
+		pthread_detach(thread);
+		return 0;
+	}
+
+	/*
+	 * Arguments for sender threads. They are recycled through
+	 * ctx->spare_thread_args instead of being freed.
+	 */
+	struct thread_arg {
+		upnprd_t *ctx;
+		int fd;
+		struct sockaddr_in addr;
+		struct in_addr local;
+		unsigned char zone;
+		int visibility;
+		size_t budget;
+
+		// Only devices matching st are sent, if filtered is set
+		unsigned char filtered;
+		char st[128];
+
+		struct thread_arg *next;
+	};
+
+	static struct thread_arg *get_thread_arg(upnprd_t *ctx) {
+		LOCK(ctx);
+		struct thread_arg *arg;
+		if(ctx->thread_pool.capacity) {
+			// In fixed-footprint mode, the pool also bounds the number
+			// of concurrent sender threads
+			arg = (struct thread_arg *)pool_get(&ctx->thread_pool);
+		}
+		else {
+			arg = ctx->spare_thread_args;
+			if(arg) {
+				ctx->spare_thread_args = arg->next;
+			}
+		}
+		UNLOCK(ctx);
+		if(!arg && !ctx->thread_pool.capacity) {
+			arg = (struct thread_arg *)xmalloc(ctx, UPNPRD_ALLOC_REPLY, sizeof(struct thread_arg));
+		}
+		if(arg) {
+			arg->ctx = ctx;
+		}
+		else {
+			LOCK(ctx);
+			ctx->stats.sends_dropped++;
+			UNLOCK(ctx);
+		}
+		return arg;
+	}
+
+	static void put_thread_arg(struct thread_arg *arg) {
+		upnprd_t *ctx = arg->ctx;
+		LOCK(ctx);
+		if(ctx->thread_pool.capacity) {
+			pool_put(&ctx->thread_pool, arg);
+		}
+		else {
+			arg->next = ctx->spare_thread_args;
+			ctx->spare_thread_args = arg;
+		}
+		UNLOCK(ctx);
+	}
+
+	static void thread_done(upnprd_t *ctx) {
+		LOCK(ctx);
+		if(--ctx->active_threads == 0) {
+			pthread_cond_broadcast(&ctx->threads_done);
+		}
+		UNLOCK(ctx);
+	}
+#else
+	/*
+	 * Queue a message in the given class. Replies (device != NULL) reference
+	 * the device, which is kept alive until they are sent, and carry the
+	 * address their search was sent to; without a device, the discovery
+	 * message is sent.
+	 */
+	static void sendto_queue(upnprd_t *ctx, int class, int sockfd, device_t *device, struct sockaddr_in *dest_addr, struct in_addr *multicast_if_addr, struct in_addr *local_addr) {
+		struct send_queue_entry *entry;
+		if(ctx->send_pool.capacity) {
+			// Fixed-footprint mode. Drop the message if the queue is full.
+			entry = (struct send_queue_entry *)pool_get(&ctx->send_pool);
+		}
+		else if(ctx->spare_entries) {
+			entry = ctx->spare_entries;
+			ctx->spare_entries = entry->next;
+		}
+		else {
+			entry = (struct send_queue_entry *)xmalloc(ctx, UPNPRD_ALLOC_SEND, sizeof(struct send_queue_entry));
+		}
+		if(!entry) {
+			ctx->stats.sends_dropped++;
+			return;
+		}
+
+		entry->fd = sockfd;
+		if(multicast_if_addr) {
+			entry->multicast_if_addr = *multicast_if_addr;
+		}
+		else {
+			entry->multicast_if_addr.s_addr = htonl(INADDR_ANY);
+		}
+		entry->local_addr.s_addr = local_addr ? local_addr->s_addr : htonl(INADDR_ANY);
+		entry->dest_addr = *dest_addr;
+		entry->device = device;
+		if(device) {
+			device->refs++;
+		}
+		entry->queued_ms = ctx->now_ms;
+		entry->next = NULL;
+		ctx->send_queued++;
+
+		*ctx->send_classes[class].tail = entry;
+		ctx->send_classes[class].tail = &entry->next;
+	}
+
+	/* Remove the entry at *iter from the queue of class */
+	static void sendto_dequeue(upnprd_t *ctx, struct send_class *class, struct send_queue_entry **iter) {
+		struct send_queue_entry *done = *iter;
+		*iter = done->next;
+		if(!*iter) {
+			class->tail = iter;
+		}
+		ctx->send_queued--;
+		if(done->device) {
+			device_unref(ctx, done->device);
+		}
+		if(ctx->send_pool.capacity) {
+			pool_put(&ctx->send_pool, done);
+		}
+		else {
+			done->next = ctx->spare_entries;
+			ctx->spare_entries = done;
+		}
+	}
+
+	static int sendto_prep_fd_set(upnprd_t *ctx, fd_set *writefds) {
+		int highest_fd = 0;
+		int class;
+		for(class=0; class<SEND_CLASSES; class++) {
+			struct send_queue_entry *iter;
+			for(iter = ctx->send_classes[class].queue; iter; iter = iter->next) {
+				FD_SET(iter->fd, writefds);
+				if(iter->fd > highest_fd) {
+					highest_fd = iter->fd;
+				}
+			}
+		}
+		return highest_fd;
+	}
+
+	/* Account for a message of class that was sent */
+	static void sendto_sent(upnprd_t *ctx, struct send_class *class, struct send_queue_entry *entry) {
+		unsigned long latency = ctx->now_ms - entry->queued_ms;
+		class->latency_ms = class->sent ? (7 * class->latency_ms + latency) / 8 : latency;
+		if(latency > class->latency_max_ms) {
+			class->latency_max_ms = latency;
+		}
+		class->sent++;
+	}
+
+	/*
+	 * Send up to limit messages of a class, on sockets that are writable.
+	 * Returns the number of messages sent or given up on.
+	 */
+	static int sendto_send_class(upnprd_t *ctx, struct send_class *class, fd_set *writefds, int limit) {
+		struct mmsghdr msgs[SEND_BATCH];
+		struct iovec iovs[SEND_BATCH][REPLY_IOVECS];
+		int done = 0;
+
+		// LOCATION prefixes for the description proxy, formatted again
+		// only when the address of the searches changes
+		char prefixes[SEND_BATCH][PROXY_PREFIX_SIZE];
+
+		struct send_queue_entry **iter = &class->queue;
+		while(*iter && done < limit) {
+			int fd = (*iter)->fd;
+			if(!FD_ISSET(fd, writefds)) {
+				iter = &((*iter)->next);
+				continue;
+			}
+
+			// If there is a multicast address to set, set it, and send
+			// this message on its own. If setting it fails, give up on the
+			// message.
+			int multicast = (*iter)->multicast_if_addr.s_addr != htonl(INADDR_ANY);
+			if(multicast && setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &((*iter)->multicast_if_addr), sizeof(struct in_addr)) < 0) {
+				sendto_dequeue(ctx, class, iter);
+				done++;
+				continue;
+			}
+
+			// Batch up the following unicast messages on the same socket
+			int count = 0;
+			const char *prefix = NULL;
+			size_t prefix_length = 0;
+			struct in_addr prefix_addr = { htonl(INADDR_ANY) };
+			struct send_queue_entry *entry;
+			for(entry = *iter; entry && count < SEND_BATCH && done + count < limit && entry->fd == fd; entry = entry->next) {
+				if(count > 0 && entry->multicast_if_addr.s_addr != htonl(INADDR_ANY)) {
+					break;
+				}
+				memset(&msgs[count], 0, sizeof(msgs[count]));
+				msgs[count].msg_hdr.msg_name = &entry->dest_addr;
+				msgs[count].msg_hdr.msg_namelen = sizeof(entry->dest_addr);
+				msgs[count].msg_hdr.msg_iov = iovs[count];
+				if(entry->device) {
+					if(entry->local_addr.s_addr != prefix_addr.s_addr) {
+						prefix_addr = entry->local_addr;
+						prefix = prefixes[count];
+						prefix_length = proxy_prefix(ctx, prefix_addr, prefixes[count]);
+					}
+					msgs[count].msg_hdr.msg_iovlen = reply_iov(ctx, entry->device, iovs[count], prefix, prefix_length);
+				}
+				else {
+					msgs[count].msg_hdr.msg_iovlen = discovery_iov(ctx, iovs[count]);
+				}
+				count++;
+				if(multicast) {
+					break;
+				}
+			}
+
+			// Try to send the messages. If unsuccessful, check for EAGAIN
+			// and retry later if found, else give up on the first message
+			int sent = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+			if(sent < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					FD_CLR(fd, writefds);
+					continue;
+				}
+				sendto_dequeue(ctx, class, iter);
+				done++;
+				continue;
+			}
+			done += sent;
+			while(sent-- > 0) {
+				sendto_sent(ctx, class, *iter);
+				sendto_dequeue(ctx, class, iter);
+			}
+		}
+		return done;
+	}
+
+	/*
+	 * Send queued messages while sockets are writable. The classes take
+	 * turns, sending up to their weight in messages per turn, so that
+	 * replies go out first without starving background traffic.
+	 */
+	static void sendto_send(upnprd_t *ctx, fd_set *writefds) {
+		unsigned int weights[SEND_CLASSES] = { ctx->config.send_weight_interactive, ctx->config.send_weight_background };
+		int progress = 1;
+		while(progress) {
+			progress = 0;
+			int class;
+			for(class=0; class<SEND_CLASSES; class++) {
+				if(ctx->send_classes[class].queue && sendto_send_class(ctx, &ctx->send_classes[class], writefds, weights[class]) > 0) {
+					progress = 1;
+				}
+			}
+		}
+	}
+#endif
+
+/** SOCKET SETUP **************************/
+static int create_socket() {
+	int fd;
+	static unsigned int yes = 1;
+
+	if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		return -2;
+	}
+
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+		close(fd);
+		return -3;
+	}
+
+	return fd;
+}
+
+static int setup_multicast_listener(upnprd_t *ctx) {
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+
+	int fd = create_socket();
+	if(fd < 0) {
+		return fd;
+	}
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(ctx->config.port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -4;
+	}
+
+	// Have the ingress interface reported with each message. Without it,
+	// only per-interface limits are lost.
+	static unsigned int yes = 1;
+	setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
+
+	// ..and when it arrived, to tell how far we are behind
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes));
+
+	mreq.imr_multiaddr.s_addr = inet_addr("239.255.255.250");
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+	/* For each interface, add to multicast group */
+	struct ifconf ifc = {0};
+	char buf[1024] = {0};
+	struct ifreq *ifr = NULL;
+	ifc.ifc_len = sizeof(buf);
+	ifc.ifc_buf = buf;
+	ioctl(fd, SIOCGIFCONF, &ifc);
+	ifr = ifc.ifc_req;
+	int i;
+	for(i=0; i<(ifc.ifc_len/sizeof(struct ifreq)); i++) {
+		mreq.imr_interface.s_addr = ((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr.s_addr;
+		#ifdef DEBUG
+		int failed = 0;
+		#endif
+		// Retry once, this is a workaround I found on the web for an error found on a AVM
+		// home-router
+		if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+			if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+				#ifdef DEBUG
+				char ip[64];
+				inet_ntop(AF_INET, &((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr, ip, 64);
+				debugf("Failed to add to multicast group %s\n", ip);
+				failed = 1;
+				#endif
+			}
+		}
+		#ifdef DEBUG
+		if(!failed) {
+			char ip[64];
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr, ip, 64);
+			debugf("Joined multicast group on interface with ip %s\n", ip);
+		}
+		#endif
+	}
+
+	return fd;
+}
+
+/*
+ * Setup the socket our own M-SEARCHes are sent from, on an ephemeral port,
+ * such that we can tell them from other traffic when they are looped back.
+ * Sets ctx->discovery_port. Returns the socket, or a negative error code.
+ */
+static int setup_discovery_socket(upnprd_t *ctx) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		return -2;
+	}
+
+	struct sockaddr_in addr;
+	socklen_t addr_length = sizeof(addr);
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr *)&addr, &addr_length) < 0) {
+		close(fd);
+		return -4;
+	}
+	ctx->discovery_port = addr.sin_port;
+
+	// Replies to our searches are received like those on the listener
+	static unsigned int yes = 1;
+	setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes));
+
+	// Whether our own multicasts reach listeners on this host, see self.c
+	unsigned char loop = ctx->config.multicast_loop;
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+	return fd;
+}
+
+/** CLOCK ***********************************************/
+void clock_update(upnprd_t *ctx) {
+	struct timespec ts;
+	#ifdef CLOCK_MONOTONIC_COARSE
+		// Seconds are all we need, and the coarse clock is cheaper
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	#else
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	#endif
+	LOCK(ctx);
+	ctx->now = ts.tv_sec;
+	ctx->now_ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	UNLOCK(ctx);
+}
+
+/* SEARCH RELATED STUFF *********************/
+device_t *find_device_by_usn(upnprd_t *ctx, char *usn) {
+	device_t *search = ctx->root_device;
+	while(search) {
+		int cmp = strcmp(usn, search->usn);
+		if(cmp == 0) {
+			break;
+		}
+		search = search->next;
+	}
+	return search;
+}
+
+void store_device(upnprd_t *ctx, device_t *device) {
+	device_t **search = &ctx->root_device;
+	while(*search) {
+		search = &((*search)->next);
+	}
+	device->next = NULL;
+	*search = device;
+	ctx->store_generation++;
+}
+
+static void release_device(upnprd_t *ctx, device_t *device) {
+	ctx->device_bytes -= sizeof(device_t) + ctx->visibility_words * sizeof(uint64_t) + device->location_length + device->st_length + device->usn_length + 3;
+	if(ctx->device_pool.capacity) {
+		pool_put(&ctx->device_pool, device);
+	}
+	else {
+		xfree(ctx, device);
+	}
+}
+
+/*
+ * Free a device that has been removed from the list. If replies on it are
+ * still queued, this is deferred until they have been sent.
+ */
+static void free_device(upnprd_t *ctx, device_t *device) {
+	flap_device_freed(ctx, device);
+	query_device_removed(ctx, device);
+	ctx->store_generation++;
+	ctx->stats.devices--;
+	ctx->shm_dirty = 1;
+	if(device->refs) {
+		device->removed = 1;
+		return;
+	}
+	release_device(ctx, device);
+}
+
+#ifndef THREADS
+static void device_unref(upnprd_t *ctx, device_t *device) {
+	if(--device->refs == 0 && device->removed) {
+		release_device(ctx, device);
+	}
+}
+#endif
+
+/*
+ * Make room in a full device pool by dropping the device that has not been
+ * seen for the longest time
+ */
+static void evict_device(upnprd_t *ctx) {
+	device_t **oldest = NULL;
+	device_t **device;
+	for(device = &ctx->root_device; *device; device = &((*device)->next)) {
+		if(!oldest || (*device)->last_seen < (*oldest)->last_seen) {
+			oldest = device;
+		}
+	}
+	if(oldest) {
+		device_t *evicted = *oldest;
+		debugf("[%s] Evicted to make room\n", evicted->usn);
+		*oldest = evicted->next;
+		free_device(ctx, evicted);
+		ctx->stats.devices_evicted++;
+	}
+}
+
+static device_t *alloc_device(upnprd_t *ctx, size_t strings_size) {
+	if(!ctx->device_pool.capacity) {
+		return (device_t *)xmalloc(ctx, UPNPRD_ALLOC_STORE, sizeof(device_t) + ctx->visibility_words * sizeof(uint64_t) + strings_size);
+	}
+
+	if(strings_size > ctx->config.pool_string_bytes) {
+		return NULL;
+	}
+	device_t *device = (device_t *)pool_get(&ctx->device_pool);
+	if(!device) {
+		evict_device(ctx);
+		device = (device_t *)pool_get(&ctx->device_pool);
+	}
+	return device;
+}
+
+static void remove_device(upnprd_t *ctx, device_t *device) {
+	device_t *search = ctx->root_device;
+	if(search == device) {
+		ctx->root_device = device->next;
+		return;
+	}
+	while(search) {
+		if(search->next == device) {
+			search->next = device->next;
+			break;
+		}
+		search = search->next;
+	}
+}
+
+/* Remove a device from the list and free it. The caller must hold the lock. */
+void delete_device(upnprd_t *ctx, device_t *device) {
+	remove_device(ctx, device);
+	free_device(ctx, device);
+}
+
+void remove_outdated_devices(upnprd_t *ctx) {
+	device_t **device = &ctx->root_device;
+	while(*device) {
+		if((*device)->last_seen + ctx->config.device_timeout < ctx->now) {
+			debugf("[%s] Timed out, removing\n", (*device)->usn);
+			device_t *old = *device;
+			*device = (*device)->next;
+			free_device(ctx, old);
+		}
+		else {
+			device = &((*device)->next);
+		}
+	}
+}
+
+/** MESSAGE PARSING **************************************/
+/*
+ * The max-age directive of a CACHE-CONTROL header value, 0 if there is none.
+ * Directives are separated by commas, e.g. "no-cache, max-age = 1800".
+ */
+static unsigned int parse_max_age(const char *value) {
+	while(*value && *value != '\r' && *value != '\n') {
+		value += strspn(value, " \t,");
+		if(strncasecmp(value, "max-age", 7) == 0) {
+			const char *number = value + 7 + strspn(value + 7, " \t");
+			if(*number == '=') {
+				number += 1 + strspn(number + 1, " \t\"");
+				return *number >= '0' && *number <= '9' ? strtoul(number, NULL, 10) : 0;
+			}
+		}
+		value += strcspn(value, ",\r\n");
+	}
+	return 0;
+}
+
+/*
+ * Parse a NOTIFY or M-SEARCH response in place. The header values in msg
+ * point into buffer afterwards.
+ */
+void parse_ssdp_headers(char *buffer, struct ssdp_headers *msg) {
+	// First, check if this is a byebye or alive message
+	// If unable to determine, assume alive
+	msg->is_alive = 1;
+	char *nts_pos = strcasestr(buffer, "NTS: ssdp:");
+	if(nts_pos != NULL && strncmp(nts_pos + 10, "byebye", 6) == 0) {
+		msg->is_alive = 0;
+	}
+
+	// CACHE-CONTROL, before the other headers are cut off
+	msg->max_age = 0;
+	char *cache_control = strcasestr(buffer, "\ncache-control:");
+	if(cache_control != NULL) {
+		msg->max_age = parse_max_age(cache_control + 15);
+	}
+
+	// Parse sdp, location and nt/st headers
+	char **headers = msg->headers;
+	int i;
+	for(i=0; i<3; i++) {
+		headers[i] = strcasestr(buffer, parse_headers[i]);
+		if(headers[i] == NULL) {
+			if(i == ST) {
+				// Service type is a special case, because it is called
+				// ST in M-SEARCH responses, but NT in NOTIFY announcements
+				headers[i] = strcasestr(buffer, "\nST: ");
+				if(headers[i] == NULL) {
+					headers[i] = "";
+				}
+				else {
+					headers[i] += 5;
+				}
+			}
+			else {
+				headers[i] = "";
+			}
+		}
+		else {
+			headers[i] += strlen(parse_headers[i]);
+		}
+	}
+	for(i=0; i<3; i++) {
+		char *nullme = strchr(headers[i], '\r');
+		if(nullme != NULL) {
+			*nullme = 0;
+		}
+	}
+}
+
+/*
+ * Split an http:// LOCATION into the device's address, the host:port part and
+ * the path to request. Returns 0 unless the host is an IPv4 address.
+ */
+int parse_http_location(const char *location, struct sockaddr_in *addr, const char **host, size_t *host_length, const char **path) {
+	if(strncmp(location, "http://", 7) != 0) {
+		return 0;
+	}
+	location += 7;
+	size_t length = strcspn(location, ":/");
+	char address[INET_ADDRSTRLEN];
+	if(length >= sizeof(address)) {
+		return 0;
+	}
+	memcpy(address, location, length);
+	address[length] = 0;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	if(inet_pton(AF_INET, address, &addr->sin_addr) != 1) {
+		return 0;
+	}
+	unsigned long port = 80;
+	if(location[length] == ':') {
+		char *end;
+		port = strtoul(location + length + 1, &end, 10);
+		if(!port || port > 65535 || (*end && *end != '/')) {
+			return 0;
+		}
+		length = end - location;
+	}
+	addr->sin_port = htons(port);
+
+	*host = location;
+	*host_length = length;
+	*path = location[length] ? location + length : "/";
+	return 1;
+}
+
+/*
+ * Update the device list from a parsed message
+ */
+void update_device(upnprd_t *ctx, struct ssdp_headers *msg, struct sockaddr_in *addr, int ifindex) {
+	char **headers = msg->headers;
+	unsigned char is_alive = msg->is_alive;
+
+	LOCK(ctx);
+
+	// Check if the address is already known
+	device_t *device = find_device_by_usn(ctx, headers[USN]);
+
+	// Restarted with its description elsewhere, e.g. on another port.
+	// Replace it, which subscribers, peers and the other end of the tunnel
+	// see as a removal followed by an addition, unless the filters reject
+	// the new record. The new record keeps what we learned about the
+	// device.
+	int moved = 0;
+	device_t carried;
+	if(device != NULL && is_alive == 1 && device->addr.sin_addr.s_addr == addr->sin_addr.s_addr && strcmp(device->location, headers[LOCATION]) != 0) {
+		debugf("[%s] Moved to %s\n", headers[USN], headers[LOCATION]);
+		flap_alive(ctx, device);
+		maxage_seen(ctx, device, msg->max_age, 0);
+		visibility_save(ctx, device);
+		sync_device_gone(ctx, device);
+		tunnel_device_gone(ctx, device);
+		carried = *device;
+		delete_device(ctx, device);
+		device = NULL;
+		moved = 1;
+	}
+
+	if(device != NULL) {
+		// Is known. If this is a bye-bye, remove it (unless dampened, see
+		// flap.c), elsewise update the timestamp and proceed
+		if(is_alive == 1) {
+			// debugf("[%s] Received keep-alive\n", headers[USN]);
+			maxage_seen(ctx, device, msg->max_age, 0);
+			device->last_seen = ctx->now;
+			visibility_seen(ctx, device, ifindex, 0);
+			flap_alive(ctx, device);
+			sync_device_seen(ctx, device);
+			tunnel_device_seen(ctx, device);
+		}
+		else {
+			debugf("[%s] Device is down\n", headers[USN]);
+			if(!ctx->config.ignore_down_messages && flap_byebye(ctx, device) == FLAP_REMOVE) {
+				sync_device_gone(ctx, device);
+				tunnel_device_gone(ctx, device);
+				delete_device(ctx, device);
+			}
+		}
+		UNLOCK(ctx);
+		return;
+	}
+
+	// Do nothing if an unknown device reports it is going offline
+	if(is_alive == 0) {
+		UNLOCK(ctx);
+		return;
+	}
+
+	// Store the new device, unless the filters reject it, or its sender or
+	// interface add devices faster than allowed. Filtered devices do not
+	// count against the latter.
+	unsigned char zones;
+	if(!filter_device(ctx, headers, &zones)) {
+		UNLOCK(ctx);
+		return;
+	}
+	if(!moved && !admit_device(ctx, addr->sin_addr, ifindex)) {
+		debugf("[%s] Not admitted\n", headers[USN]);
+		UNLOCK(ctx);
+		return;
+	}
+	device = create_device(ctx, headers, addr, zones);
+	if(device && moved) {
+		memcpy(device->versions, carried.versions, sizeof(device->versions));
+		device->flap_penalty = carried.flap_penalty;
+		device->flap_updated = carried.flap_updated;
+		device->flap_suppressed = carried.flap_suppressed;
+		device->announced_max_age = carried.announced_max_age;
+		device->refresh_interval = carried.refresh_interval;
+		device->regular_refreshes = carried.regular_refreshes;
+		visibility_restore(ctx, device);
+	}
+	if(device) {
+		visibility_seen(ctx, device, ifindex, !moved);
+		maxage_seen(ctx, device, msg->max_age, 1);
+		sync_device_seen(ctx, device);
+		tunnel_device_seen(ctx, device);
+	}
+
+	UNLOCK(ctx);
+}
+
+/*
+ * Create and store a new device, admitted to zones by filter_device(). The
+ * caller must hold the lock. Returns NULL if there was no room for it.
+ */
+device_t *create_device(upnprd_t *ctx, char **headers, struct sockaddr_in *addr, unsigned char zones) {
+	debugf("[%s] Device is now alive\n  Location: %s\n  ST: %s\n", headers[USN], headers[LOCATION], headers[ST]);
+	device_t *new_device = alloc_device(ctx, strlen(headers[LOCATION]) + strlen(headers[ST]) + strlen(headers[USN]) + 3);
+	if(new_device == NULL) {
+		// Fail silently. This is absolutely fine.
+		debugf(" ...but out of memory\n");
+		ctx->stats.devices_dropped++;
+		return NULL;
+	}
+	memset(new_device, 0, sizeof(device_t));
+
+	new_device->location_length = strlen(headers[LOCATION]);
+	new_device->st_length = strlen(headers[ST]);
+	new_device->usn_length = strlen(headers[USN]);
+	new_device->visible_on = (uint64_t *)(new_device + 1);
+	memset(new_device->visible_on, 0, ctx->visibility_words * sizeof(uint64_t));
+	new_device->location = (char *)(new_device->visible_on + ctx->visibility_words);
+	new_device->st = new_device->location + new_device->location_length + 1;
+	new_device->usn = new_device->st + new_device->st_length + 1;
+	strcpy(new_device->location, headers[LOCATION]);
+	strcpy(new_device->st, headers[ST]);
+	strcpy(new_device->usn, headers[USN]);
+
+	new_device->serial = ++ctx->device_serial;
+	new_device->last_seen = ctx->now;
+	new_device->addr = *addr;
+	new_device->zones = zones;
+	new_device->visible_all = 1;
+	proxy_device_added(ctx, new_device);
+	liveness_device_added(ctx, new_device);
+
+	store_device(ctx, new_device);
+	query_device_added(ctx, new_device);
+	ctx->stats.devices++;
+	ctx->device_bytes += sizeof(device_t) + ctx->visibility_words * sizeof(uint64_t) + new_device->location_length + new_device->st_length + new_device->usn_length + 3;
+	ctx->shm_dirty = 1;
+	return new_device;
+}
+
+static void parse_notify_message(upnprd_t *ctx, struct sockaddr_in *addr, int ifindex) {
+	struct ssdp_headers msg;
+	parse_ssdp_headers(ctx->buffer, &msg);
+	update_device(ctx, &msg, addr, ifindex);
+}
+
+/** SENDING *********************************************/
+static void _send_m_search_multicast_real(upnprd_t *ctx, int fd);
+static void _send_cache_to_real(upnprd_t *ctx, int fd, struct sockaddr_in *addr, struct in_addr local, unsigned char zone, int visibility, size_t budget, const char *st);
+
+#ifdef THREADS
+	/* Thread wrapper around send_m_search_multicast */
+	static void *_send_m_search_multicast_thread(struct thread_arg *arg);
+
+	static void send_m_search_multicast(upnprd_t *ctx, int fd) {
+		struct thread_arg *arg = get_thread_arg(ctx);
+		if(!arg) {
+			return;
+		}
+		arg->fd = fd;
+		if(spawn_thread(ctx, (void *(*)(void *))_send_m_search_multicast_thread, (void *)arg) < 0) {
+			put_thread_arg(arg);
+		}
+	}
+
+	static void *_send_m_search_multicast_thread(struct thread_arg *arg) {
+		upnprd_t *ctx = arg->ctx;
+		_send_m_search_multicast_real(ctx, arg->fd);
+		put_thread_arg(arg);
+		thread_done(ctx);
+		return NULL;
+	}
+
+	/* Thread wrapper around send_cache_to */
+	static void *_send_cache_to_thread(struct thread_arg *arg);
+
+	static void send_cache_to(upnprd_t *ctx, int fd, struct sockaddr_in *addr, struct in_addr local, unsigned char zone, int visibility, size_t budget, const char *st) {
+		struct thread_arg *arg = get_thread_arg(ctx);
+		if(!arg) {
+			return;
+		}
+		arg->fd = fd;
+		arg->addr = *addr;
+		arg->local = local;
+		arg->zone = zone;
+		arg->visibility = visibility;
+		arg->budget = budget;
+		arg->filtered = st != NULL;
+		if(st && snprintf(arg->st, sizeof(arg->st), "%s", st) >= sizeof(arg->st)) {
+			// Too long to be a valid ST
+			arg->st[0] = 0;
+		}
+		if(spawn_thread(ctx, (void *(*)(void *))_send_cache_to_thread, (void *)arg) < 0) {
+			put_thread_arg(arg);
+		}
+	}
+
+	static void *_send_cache_to_thread(struct thread_arg *arg) {
+		upnprd_t *ctx = arg->ctx;
+		_send_cache_to_real(ctx, arg->fd, &(arg->addr), arg->local, arg->zone, arg->visibility, arg->budget, arg->filtered ? arg->st : NULL);
+		put_thread_arg(arg);
+		thread_done(ctx);
+		return NULL;
+	}
+#else
+	static void send_m_search_multicast(upnprd_t *ctx, int fd) {
+		_send_m_search_multicast_real(ctx, fd);
+	}
+
+	static void send_cache_to(upnprd_t *ctx, int fd, struct sockaddr_in *addr, struct in_addr local, unsigned char zone, int visibility, size_t budget, const char *st) {
+		_send_cache_to_real(ctx, fd, addr, local, zone, visibility, budget, st);
+	}
+#endif
+
+#ifdef THREADS
+/* Send a batch of messages, blocking until all are sent or one failed */
+static void send_batch(int fd, struct mmsghdr *msgs, int count) {
+	while(count > 0) {
+		int sent = sendmmsg(fd, msgs, count, 0);
+		if(sent < 0) {
+			#ifdef DEBUG
+			perror("  sendmmsg");
+			#endif
+			return;
+		}
+		msgs += sent;
+		count -= sent;
+	}
+}
+#endif
+
+static void _send_m_search_multicast_real(upnprd_t *ctx, int fd) {
+	struct sockaddr_in addr;
+
+	debugf("Sending out M-SEARCH\n");
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("239.255.255.250");
+	addr.sin_port = htons(ctx->config.port);
+
+	struct ifconf ifc = {0};
+	char buf[1024] = {0};
+	struct ifreq *ifr = NULL;
+	ifc.ifc_len = sizeof(buf);
+	ifc.ifc_buf = buf;
+	ioctl(fd, SIOCGIFCONF, &ifc);
+	ifr = ifc.ifc_req;
+	int i;
+	for(i=0; i<(ifc.ifc_len/sizeof(struct ifreq)); i++) {
+		#ifdef DEBUG
+			char ip[64];
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr, ip, 64);
+			debugf(" sending out via IP %s\n", ip);
+		#endif
+		#ifdef THREADS
+			// The socket option and the sendto() must not be interleaved
+			// with another sender thread's
+			LOCK(ctx);
+			if(setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr, sizeof(struct in_addr)) < 0) {
+				UNLOCK(ctx);
+				continue;
+			}
+			if(sendto(fd, ctx->discovery_message, ctx->discovery_message_length, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				#ifdef DEBUG
+				perror("  sendto");
+				#endif
+			}
+			UNLOCK(ctx);
+		#else
+			sendto_queue(ctx, SEND_BACKGROUND, fd, NULL, &addr, &(((struct sockaddr_in *)&ifr[i].ifr_addr)->sin_addr), NULL);
+		#endif
+	}
+}
+
+/* The device to consider after search, from the plan if there is one */
+static inline device_t *next_device(struct reply_plan *plan, device_t *search, unsigned int *position) {
+	if(!plan) {
+		return search->next;
+	}
+	return ++*position < plan->count ? plan->devices[*position] : NULL;
+}
+
+/*
+ * Reply to an M-SEARCH sent to our address local with all cached devices, up
+ * to budget bytes. SIZE_MAX means unlimited. If zone is set, only devices
+ * admitted to that zone are sent, and if st is set, only devices matching it.
+ * visibility is the result of visibility_bit() for the requestee's interface.
+ */
+static void _send_cache_to_real(upnprd_t *ctx, int fd, struct sockaddr_in *addr, struct in_addr local, unsigned char zone, int visibility, size_t budget, const char *st) {
+	#ifdef THREADS
+		struct mmsghdr msgs[SEND_BATCH];
+		struct iovec iovs[SEND_BATCH][REPLY_IOVECS];
+		int count = 0;
+	#endif
+	char prefix[PROXY_PREFIX_SIZE];
+	size_t prefix_length = proxy_prefix(ctx, local, prefix);
+
+	debugf("Received M-SEARCH request from %s\n", inet_ntoa(addr->sin_addr));
+
+	// Walk through the devices planned for this kind of search, see plan.c,
+	// or through all devices if there is no plan
+	LOCK(ctx);
+	struct reply_plan *plan = plan_get(ctx, zone, visibility, st);
+	unsigned int position = 0;
+	device_t *search = plan ? (plan->count ? plan->devices[0] : NULL) : ctx->root_device;
+	for(; search; search = next_device(plan, search, &position)) {
+		// Check if the current device should be sent. It should not if it is
+		// definetively known to the requestee.
+		if(search->addr.sin_addr.s_addr != addr->sin_addr.s_addr && (plan || plan_selects(search, zone, visibility, st))) {
+			if(ctx->config.max_age_adaptive) {
+				maxage_update(ctx, search);
+			}
+			if(budget != SIZE_MAX) {
+				size_t length = reply_length(ctx, search, prefix_length);
+				if(length > budget) {
+					ctx->stats.replies_limited++;
+					continue;
+				}
+				budget -= length;
+			}
+
+			// Send information on the current device
+			#ifdef THREADS
+				memset(&msgs[count], 0, sizeof(msgs[count]));
+				msgs[count].msg_hdr.msg_name = addr;
+				msgs[count].msg_hdr.msg_namelen = sizeof(*addr);
+				msgs[count].msg_hdr.msg_iov = iovs[count];
+				msgs[count].msg_hdr.msg_iovlen = reply_iov(ctx, search, iovs[count], prefix, prefix_length);
+				if(++count == SEND_BATCH) {
+					send_batch(fd, msgs, count);
+					count = 0;
+				}
+			#else
+				sendto_queue(ctx, SEND_INTERACTIVE, fd, search, addr, NULL, &local);
+			#endif
+		}
+	}
+	#ifdef THREADS
+		send_batch(fd, msgs, count);
+	#endif
+	budget_refund(ctx, addr, budget);
+
+	// Clean-up, re-scan for other devices every now and then
+	int sweep = 0;
+	if(ctx->last_service_sweep + ctx->config.sweep_interval < ctx->now) {
+		ctx->last_service_sweep = ctx->now;
+		remove_outdated_devices(ctx);
+		sweep = 1;
+	}
+	UNLOCK(ctx);
+
+	if(sweep) {
+		#ifdef THREADS
+			// Already running in a sender thread
+			_send_m_search_multicast_real(ctx, ctx->discovery_fd);
+		#else
+			send_m_search_multicast(ctx, ctx->discovery_fd);
+		#endif
+	}
+}
+
+/* Send our own M-SEARCH, refreshing the cache */
+void discover_devices(upnprd_t *ctx) {
+	send_m_search_multicast(ctx, ctx->discovery_fd);
+}
+
+/** PUBLIC API ******************************************/
+static void apply_config(upnprd_t *ctx, const struct upnprd_config *config) {
+	// Keep the settings that only take effect in upnprd_init()
+	struct upnprd_config old = ctx->config;
+	ctx->config = *config;
+	ctx->config.port = old.port;
+	ctx->config.pool_devices = old.pool_devices;
+	ctx->config.pool_string_bytes = old.pool_string_bytes;
+	ctx->config.pool_send_entries = old.pool_send_entries;
+	ctx->config.pool_threads = old.pool_threads;
+	ctx->config.sync_port = old.sync_port;
+	ctx->config.standby_priority = old.standby_priority;
+	ctx->config.standby_interval = old.standby_interval;
+	ctx->config.tunnel_port = old.tunnel_port;
+	ctx->config.proxy_port = old.proxy_port;
+	strcpy(ctx->config.query_socket, old.query_socket);
+	strcpy(ctx->config.shm_name, old.shm_name);
+	ctx->config.shm_size = old.shm_size;
+	ctx->config.visibility_interfaces = old.visibility_interfaces;
+
+	// The peers were validated when the configuration was loaded
+	ctx->sync_peer_count = sync_parse_peers(config->sync_peers, ctx->sync_peers, SYNC_MAX_PEERS);
+	if(ctx->sync_peer_count < 0) {
+		ctx->sync_peer_count = 0;
+	}
+	if(sync_parse_peers(config->tunnel_peer, &ctx->tunnel_peer, 1) <= 0) {
+		memset(&ctx->tunnel_peer, 0, sizeof(ctx->tunnel_peer));
+	}
+
+	// Interfaces are matched against the new reply_limit_interfaces again
+	memset(ctx->budget_interfaces, 0, sizeof(ctx->budget_interfaces));
+	visibility_reconfigure(ctx);
+
+	ctx->discovery_message_length = snprintf(ctx->discovery_message, sizeof(ctx->discovery_message), discovery_message_format, config->search_mx);
+	ctx->max_age_length = snprintf(ctx->max_age, sizeof(ctx->max_age), "%u", config->max_age);
+}
+
+int upnprd_init(upnprd_t **ctx_out, const struct upnprd_config *config) {
+	upnprd_t *ctx = (upnprd_t *)calloc(1, sizeof(upnprd_t));
+	if(!ctx) {
+		return 1;
+	}
+	ctx->config = *config;
+	apply_config(ctx, config);
+	if(filter_compile(ctx, config, &ctx->filter, NULL, 0) < 0) {
+		free(ctx);
+		return 1;
+	}
+	if(visibility_setup(ctx) < 0) {
+		filter_free(ctx, &ctx->filter);
+		free(ctx);
+		return 1;
+	}
+	if(plan_setup(ctx) < 0) {
+		filter_free(ctx, &ctx->filter);
+		visibility_free(ctx);
+		free(ctx);
+		return 1;
+	}
+
+	// In fixed-footprint mode, preallocate everything needed later on
+	if(config->pool_devices && (
+		pool_init(ctx, &ctx->device_pool, sizeof(device_t) + ctx->visibility_words * sizeof(uint64_t) + config->pool_string_bytes, config->pool_devices) < 0 ||
+		#ifdef THREADS
+			pool_init(ctx, &ctx->thread_pool, sizeof(struct thread_arg), config->pool_threads) < 0
+		#else
+			pool_init(ctx, &ctx->send_pool, sizeof(struct send_queue_entry), config->pool_send_entries) < 0
+		#endif
+	)) {
+		pool_destroy(ctx, &ctx->device_pool);
+		filter_free(ctx, &ctx->filter);
+		visibility_free(ctx);
+		plan_free(ctx);
+		free(ctx);
+		return 1;
+	}
+
+	// Setup a multicast receiver socket for the UPnP group, port SSDP, and
+	// the sockets for other relays
+	ctx->discovery_fd = ctx->sync_fd = ctx->tunnel_fd = ctx->proxy_fd = ctx->query_fd = ctx->timer_fd = -1;
+	liveness_setup(ctx);
+	ctx->fd = setup_multicast_listener(ctx);
+	int err = ctx->fd < 0 ? -ctx->fd : 0;
+	if(!err) {
+		ctx->discovery_fd = setup_discovery_socket(ctx);
+		err = ctx->discovery_fd < 0 ? -ctx->discovery_fd : -sync_setup(ctx);
+	}
+	if(!err) {
+		ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		err = ctx->timer_fd < 0 ? 2 : -standby_setup(ctx);
+	}
+	if(!err) {
+		err = -tunnel_setup(ctx);
+	}
+	if(!err) {
+		err = -proxy_setup(ctx);
+	}
+	if(!err) {
+		err = -query_setup(ctx);
+	}
+	if(!err) {
+		err = -shm_setup(ctx);
+	}
+	if(err) {
+		proxy_close(ctx);
+		query_close(ctx);
+		int fds[] = { ctx->fd, ctx->discovery_fd, ctx->sync_fd, ctx->tunnel_fd, ctx->timer_fd };
+		int i;
+		for(i=0; i<5; i++) {
+			if(fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+		pool_destroy(ctx, &ctx->device_pool);
+		#ifdef THREADS
+			pool_destroy(ctx, &ctx->thread_pool);
+		#else
+			pool_destroy(ctx, &ctx->send_pool);
+		#endif
+		filter_free(ctx, &ctx->filter);
+		visibility_free(ctx);
+		plan_free(ctx);
+		free(ctx);
+		return err;
+	}
+
+	#ifdef THREADS
+		pthread_mutex_init(&ctx->device_list_update_mutex, NULL);
+		pthread_cond_init(&ctx->threads_done, NULL);
+		#ifdef ALLOC_STATS
+			pthread_mutex_init(&ctx->alloc_mutex, NULL);
+		#endif
+	#else
+		int class;
+		for(class=0; class<SEND_CLASSES; class++) {
+			ctx->send_classes[class].tail = &ctx->send_classes[class].queue;
+		}
+	#endif
+
+	clock_update(ctx);
+	self_refresh(ctx);
+	ctx->last_service_sweep = ctx->now;
+	send_m_search_multicast(ctx, ctx->discovery_fd);
+	sync_join(ctx);
+	tunnel_join(ctx);
+
+	*ctx_out = ctx;
+	return 0;
+}
+
+/*
+ * Milliseconds until a deadline, in seconds of ctx->now, is due. Deadlines
+ * already past are retried a second later, as their module could not act on
+ * them yet.
+ */
+static long deadline_ms(upnprd_t *ctx, time_t deadline) {
+	return deadline > ctx->now ? (deadline - ctx->now) * 1000 : 1000;
+}
+
+/*
+ * Arm the timer descriptor for the nearest deadline: heartbeats, timeouts
+ * of liveness checks and proxy connections, and byebye grace periods. These
+ * must pass even while the segment is quiet and the caller's select() has no
+ * timeout.
+ */
+static void arm_timer(upnprd_t *ctx) {
+	clock_update(ctx);
+	long timeout_ms = standby_timeout_ms(ctx);
+	time_t deadlines[] = { liveness_deadline(ctx), flap_deadline(ctx), ctx->proxy_fd >= 0 ? proxy_deadline(ctx) : 0 };
+	int i;
+	for(i=0; i<3; i++) {
+		if(deadlines[i] && (timeout_ms < 0 || deadline_ms(ctx, deadlines[i]) < timeout_ms)) {
+			timeout_ms = deadline_ms(ctx, deadlines[i]);
+		}
+	}
+
+	// A zero it_value disarms the timer, so round up to a nanosecond
+	struct itimerspec timer = { { 0, 0 }, { 0, 0 } };
+	if(timeout_ms >= 0) {
+		timer.it_value.tv_sec = timeout_ms / 1000;
+		timer.it_value.tv_nsec = (timeout_ms % 1000) * 1000000 + 1;
+	}
+	timerfd_settime(ctx->timer_fd, 0, &timer, NULL);
+}
+
+int upnprd_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	int highest_fd = ctx->fd;
+	FD_SET(ctx->fd, readfds);
+	int relay_fds[] = { ctx->discovery_fd, ctx->sync_fd, ctx->tunnel_fd };
+	int i;
+	for(i=0; i<3; i++) {
+		if(relay_fds[i] >= 0) {
+			FD_SET(relay_fds[i], readfds);
+			if(relay_fds[i] > highest_fd) {
+				highest_fd = relay_fds[i];
+			}
+		}
+	}
+	if(ctx->timer_fd > highest_fd) {
+		highest_fd = ctx->timer_fd;
+	}
+	FD_SET(ctx->timer_fd, readfds);
+	arm_timer(ctx);
+	if(ctx->proxy_fd >= 0) {
+		int highest_proxy_fd = proxy_prep_fd_set(ctx, readfds, writefds);
+		if(highest_proxy_fd > highest_fd) {
+			highest_fd = highest_proxy_fd;
+		}
+	}
+	if(ctx->query_fd >= 0) {
+		int highest_query_fd = query_prep_fd_set(ctx, readfds, writefds);
+		if(highest_query_fd > highest_fd) {
+			highest_fd = highest_query_fd;
+		}
+	}
+	int highest_liveness_fd = liveness_prep_fd_set(ctx, readfds, writefds);
+	if(highest_liveness_fd > highest_fd) {
+		highest_fd = highest_liveness_fd;
+	}
+	#ifndef THREADS
+		int highest_write_fd = sendto_prep_fd_set(ctx, writefds);
+		if(highest_write_fd > highest_fd) {
+			highest_fd = highest_write_fd;
+		}
+	#endif
+	return highest_fd;
+}
+
+/*
+ * Receive SSDP messages on fd, the listener or the discovery socket, up to
+ * RECV_BATCH of them before returning to the caller's event loop. Returns 0,
+ * or an error code if the socket failed.
+ */
+static int receive_ssdp(upnprd_t *ctx, int fd) {
+	// Receive timestamps use the wall clock
+	struct timespec batch_start;
+	clock_gettime(CLOCK_REALTIME, &batch_start);
+
+	int received;
+	for(received=0; received<RECV_BATCH; received++) {
+		struct sockaddr_in addr;
+		struct iovec iov = { ctx->buffer, sizeof(ctx->buffer) - 1 };
+		char control[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(struct timespec))];
+		struct msghdr hdr = { &addr, sizeof(addr), &iov, 1, control, sizeof(control), 0 };
+		int nbytes;
+		if((nbytes = recvmsg(fd, &hdr, MSG_DONTWAIT)) < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return 0;
+			}
+			return 7;
+		}
+		ctx->buffer[nbytes] = 0;
+
+		// Our own discovery, looped back
+		if(self_is_own(ctx, &addr)) {
+			ctx->stats.self_dropped++;
+			continue;
+		}
+
+		// The interface the message arrived on, 0 if unknown, and our
+		// address on it
+		int ifindex = 0;
+		struct in_addr local = { htonl(INADDR_ANY) };
+		struct cmsghdr *cmsg;
+		for(cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+			if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+				ifindex = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex;
+				local = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_spec_dst;
+			}
+			else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+				struct timespec arrival;
+				memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+				long lag = (batch_start.tv_sec - arrival.tv_sec) * 1000 + (batch_start.tv_nsec - arrival.tv_nsec) / 1000000;
+				if(lag > 0 && (unsigned long)lag > ctx->receive_lag_ms) {
+					ctx->receive_lag_ms = lag;
+				}
+			}
+		}
+
+		// Depending on message type, update the devices table or reply with cached information
+		if(strncmp(ctx->buffer, "NOTIFY ", 7) == 0 || strncmp(ctx->buffer, "HTTP/1.1 200", 12) == 0) {
+			// This is a notify message. Parse and store.
+			SET_MSG_TYPE(ctx, UPNPRD_MSG_NOTIFY);
+			parse_notify_message(ctx, &addr, ifindex);
+		}
+		else if(strncmp(ctx->buffer, "M-SEARCH ", 9) == 0) {
+			// This is a search request. Reply with all stored messages,
+			// unless we are shedding load or the requester already
+			// received all it may. Under load, only matching devices are
+			// sent.
+			SET_MSG_TYPE(ctx, UPNPRD_MSG_SEARCH);
+			const char *st = "";
+			if(ctx->overload_state != OVERLOAD_NONE || ctx->tunnel_fd >= 0) {
+				struct ssdp_headers msg;
+				parse_ssdp_headers(ctx->buffer, &msg);
+				st = msg.headers[ST];
+			}
+			size_t budget;
+			if(!standby_leading(ctx)) {
+				// Left to the leader, see standby.c
+				ctx->stats.standby_searches++;
+			}
+			else if(overload_admit_search(ctx, &addr, st) && (budget = budget_reserve(ctx, &addr, ifindex, nbytes))) {
+				send_cache_to(ctx, ctx->fd, &addr, local, filter_zone(ctx, ifindex), visibility_bit(ctx, ifindex), budget, ctx->overload_state != OVERLOAD_NONE ? st : NULL);
+
+				// Let the other end of the tunnel look for devices, too
+				tunnel_search(ctx, st);
+			}
+		}
+		SET_MSG_TYPE(ctx, UPNPRD_MSG_NONE);
+	}
+	return 0;
+}
+
+int upnprd_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds) {
+	// One clock read serves the whole batch
+	clock_update(ctx);
+	self_refresh(ctx);
+
+	#ifndef THREADS
+		sendto_send(ctx, writefds);
+	#endif
+	#ifdef ALLOC_STATS
+		alloc_stats_sample(ctx);
+	#endif
+
+	// Check for overload with what is left after sending
+	overload_update(ctx);
+
+	if(ctx->sync_fd >= 0 && FD_ISSET(ctx->sync_fd, readfds)) {
+		SET_MSG_TYPE(ctx, UPNPRD_MSG_SYNC);
+		sync_receive(ctx);
+		SET_MSG_TYPE(ctx, UPNPRD_MSG_NONE);
+	}
+	if(ctx->tunnel_fd >= 0 && FD_ISSET(ctx->tunnel_fd, readfds)) {
+		SET_MSG_TYPE(ctx, UPNPRD_MSG_SYNC);
+		tunnel_receive(ctx);
+		SET_MSG_TYPE(ctx, UPNPRD_MSG_NONE);
+	}
+
+	// The deadlines are checked below either way, so this only resets
+	// the timer
+	if(FD_ISSET(ctx->timer_fd, readfds)) {
+		uint64_t expirations;
+		if(read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+			perror("  read");
+		}
+	}
+
+	// Before receiving, such that searches see the outcome of the election
+	standby_poll(ctx);
+
+	// If nothing is waiting, we are not behind
+	int err = 0;
+	ctx->receive_lag_ms = 0;
+	if(FD_ISSET(ctx->fd, readfds)) {
+		err = receive_ssdp(ctx, ctx->fd);
+	}
+	if(!err && FD_ISSET(ctx->discovery_fd, readfds)) {
+		err = receive_ssdp(ctx, ctx->discovery_fd);
+	}
+
+	// After receiving, such that descriptions of new devices are fetched
+	// right away
+	if(ctx->proxy_fd >= 0) {
+		proxy_poll(ctx, readfds, writefds);
+	}
+	liveness_poll(ctx, readfds, writefds);
+	flap_expire(ctx);
+
+	// After receiving, too, such that answers include this batch
+	if(ctx->query_fd >= 0) {
+		query_poll(ctx, readfds, writefds);
+	}
+
+	// Tell other relays and local readers what changed in this batch
+	sync_flush(ctx);
+	tunnel_flush(ctx);
+	shm_publish(ctx);
+
+	return err;
+}
+
+void upnprd_stats(upnprd_t *ctx, struct upnprd_stats *stats) {
+	LOCK(ctx);
+	*stats = ctx->stats;
+	UNLOCK(ctx);
+
+	#ifndef THREADS
+		struct send_class *interactive = &ctx->send_classes[SEND_INTERACTIVE];
+		struct send_class *background = &ctx->send_classes[SEND_BACKGROUND];
+		stats->sent_interactive = interactive->sent;
+		stats->sent_background = background->sent;
+		stats->latency_interactive_ms = interactive->latency_ms;
+		stats->latency_background_ms = background->latency_ms;
+		stats->latency_max_interactive_ms = interactive->latency_max_ms;
+		stats->latency_max_background_ms = background->latency_max_ms;
+	#endif
+}
+
+void upnprd_reconfigure(upnprd_t *ctx, const struct upnprd_config *config) {
+	// All readers of the configuration hold the lock (or run in this
+	// thread), so this is atomic for them
+	LOCK(ctx);
+	apply_config(ctx, config);
+	standby_reconfigure(ctx);
+
+	// Check devices cached before liveness checks were enabled, too
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		liveness_device_added(ctx, device);
+	}
+	UNLOCK(ctx);
+
+	// Invalid rules were rejected when the configuration was loaded
+	filter_apply(ctx);
+
+	unsigned char loop = ctx->config.multicast_loop;
+	setsockopt(ctx->discovery_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+	// The peers may have changed, catch up with them
+	sync_join(ctx);
+	tunnel_join(ctx);
+}
+
+void upnprd_shutdown(upnprd_t *ctx) {
+	#ifdef THREADS
+		// Wait for sender threads, they reference the instance
+		LOCK(ctx);
+		while(ctx->active_threads > 0) {
+			pthread_cond_wait(&ctx->threads_done, &ctx->device_list_update_mutex);
+		}
+		UNLOCK(ctx);
+
+		while(ctx->spare_thread_args) {
+			struct thread_arg *delete = ctx->spare_thread_args;
+			ctx->spare_thread_args = delete->next;
+			xfree(ctx, delete);
+		}
+		pool_destroy(ctx, &ctx->thread_pool);
+	#else
+		// Drop unsent messages, releasing the devices they reference.
+		// Pooled entries are released with the pool.
+		int class;
+		for(class=0; class<SEND_CLASSES; class++) {
+			while(ctx->send_classes[class].queue) {
+				sendto_dequeue(ctx, &ctx->send_classes[class], &ctx->send_classes[class].queue);
+			}
+		}
+		while(ctx->spare_entries) {
+			struct send_queue_entry *delete = ctx->spare_entries;
+			ctx->spare_entries = delete->next;
+			xfree(ctx, delete);
+		}
+		pool_destroy(ctx, &ctx->send_pool);
+	#endif
+
+	close(ctx->fd);
+	close(ctx->discovery_fd);
+	if(ctx->sync_fd >= 0) {
+		close(ctx->sync_fd);
+	}
+	if(ctx->tunnel_fd >= 0) {
+		close(ctx->tunnel_fd);
+	}
+	close(ctx->timer_fd);
+	proxy_close(ctx);
+	query_close(ctx);
+	liveness_close(ctx);
+	shm_close(ctx);
+	filter_free(ctx, &ctx->filter);
+	visibility_free(ctx);
+
+	while(ctx->root_device) {
+		device_t *delete = ctx->root_device;
+		ctx->root_device = delete->next;
+		free_device(ctx, delete);
+	}
+	pool_destroy(ctx, &ctx->device_pool);
+	plan_free(ctx);
+
+	#ifdef THREADS
+		pthread_mutex_destroy(&ctx->device_list_update_mutex);
+		pthread_cond_destroy(&ctx->threads_done);
+		#ifdef ALLOC_STATS
+			pthread_mutex_destroy(&ctx->alloc_mutex);
+		#endif
+	#endif
+	free(ctx);
+}
@@ -0,0 +1,157 @@
+/*
+ * UPnP relay daemon - self-traffic suppression
+ *
+ * Our own discovery M-SEARCHes are multicast, and with IP_MULTICAST_LOOP
+ * (the default, needed for UPnP servers running on the relay's host to see
+ * them) they come back to our own listener, once per interface. Answering
+ * them would mean sending the whole cache to ourselves. They are sent from a
+ * socket of their own on an ephemeral port, so datagrams from that port on one
+ * of our addresses are dropped right after they are received. UPnP servers on
+ * the relay's host answer and announce from their SSDP port, and are not
+ * affected.
+ *
+ * Our addresses are kept in a small open-addressing hash set, rebuilt from
+ * the interface addresses at startup and every SELF_REFRESH seconds after,
+ * such that addresses coming and going are picked up. They are read with a
+ * netlink dump into a buffer on the stack, which lists secondary addresses
+ * without a label, too, and unlike getifaddrs() does not allocate, as
+ * fixed-footprint mode requires.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+// Seconds between rebuilds of the address set
+#define SELF_REFRESH 30
+
+// Bytes received from the kernel at once while listing the addresses
+#define SELF_DUMP_BUFFER 8192
+
+static unsigned int slot_of(uint32_t address) {
+	return (address * 2654435769u) >> (32 - SELF_ADDRESSES_BITS);
+}
+
+/* Add an address to a set, unless it holds SELF_MAX_ADDRESSES already */
+static void add_address(uint32_t *addresses, unsigned int *count, uint32_t address) {
+	if(*count == SELF_MAX_ADDRESSES) {
+		return;
+	}
+	unsigned int slot = slot_of(address);
+	while(addresses[slot] && addresses[slot] != address) {
+		slot = (slot + 1) & ((1 << SELF_ADDRESSES_BITS) - 1);
+	}
+	if(!addresses[slot]) {
+		addresses[slot] = address;
+		(*count)++;
+	}
+}
+
+/*
+ * Read our IPv4 addresses into a set. Returns 0, or -1 if the kernel could
+ * not be asked.
+ */
+static int list_addresses(uint32_t *addresses) {
+	int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if(fd < 0) {
+		return -1;
+	}
+	struct {
+		struct nlmsghdr header;
+		struct ifaddrmsg message;
+	} request;
+	memset(&request, 0, sizeof(request));
+	request.header.nlmsg_len = sizeof(request);
+	request.header.nlmsg_type = RTM_GETADDR;
+	request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.header.nlmsg_seq = 1;
+	request.message.ifa_family = AF_INET;
+	if(send(fd, &request, sizeof(request), 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	unsigned int count = 0;
+	char buffer[SELF_DUMP_BUFFER] __attribute__((aligned(NLMSG_ALIGNTO)));
+	while(1) {
+		ssize_t nbytes = recv(fd, buffer, sizeof(buffer), 0);
+		if(nbytes <= 0) {
+			close(fd);
+			return -1;
+		}
+		struct nlmsghdr *header;
+		size_t length = nbytes;
+		for(header = (struct nlmsghdr *)buffer; NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+			if(header->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return 0;
+			}
+			if(header->nlmsg_type == NLMSG_ERROR) {
+				close(fd);
+				return -1;
+			}
+			if(header->nlmsg_type != RTM_NEWADDR) {
+				continue;
+			}
+
+			// IFA_LOCAL is our end of point-to-point links, where
+			// IFA_ADDRESS is the peer's. Elsewhere, only the latter
+			// is given.
+			struct ifaddrmsg *message = (struct ifaddrmsg *)NLMSG_DATA(header);
+			struct rtattr *attribute;
+			size_t attributes_length = IFA_PAYLOAD(header);
+			uint32_t address = 0;
+			for(attribute = IFA_RTA(message); RTA_OK(attribute, attributes_length); attribute = RTA_NEXT(attribute, attributes_length)) {
+				if((attribute->rta_type == IFA_LOCAL || (attribute->rta_type == IFA_ADDRESS && !address)) && RTA_PAYLOAD(attribute) == sizeof(address)) {
+					memcpy(&address, RTA_DATA(attribute), sizeof(address));
+				}
+			}
+			if(address) {
+				add_address(addresses, &count, address);
+			}
+		}
+	}
+}
+
+void self_refresh(upnprd_t *ctx) {
+	if(ctx->self_refreshed && ctx->self_refreshed + SELF_REFRESH > ctx->now) {
+		return;
+	}
+	ctx->self_refreshed = ctx->now;
+
+	uint32_t addresses[1 << SELF_ADDRESSES_BITS];
+	memset(addresses, 0, sizeof(addresses));
+	if(list_addresses(addresses) < 0) {
+		// Keep what we know
+		return;
+	}
+	memcpy(ctx->self_addresses, addresses, sizeof(addresses));
+}
+
+int self_is_own(upnprd_t *ctx, struct sockaddr_in *addr) {
+	if(addr->sin_port != ctx->discovery_port) {
+		return 0;
+	}
+	uint32_t address = addr->sin_addr.s_addr;
+	unsigned int slot = slot_of(address);
+	while(ctx->self_addresses[slot]) {
+		if(ctx->self_addresses[slot] == address) {
+			return 1;
+		}
+		slot = (slot + 1) & ((1 << SELF_ADDRESSES_BITS) - 1);
+	}
+	return 0;
+}
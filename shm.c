@@ -0,0 +1,127 @@
+/*
+ * UPnP relay daemon - shared-memory export of the device cache
+ *
+ * Publishes the device table in a POSIX shared-memory object for local
+ * readers, see upnprd_shm.h for the layout and the reader side. The table is
+ * rewritten as a whole at the end of each upnprd_poll() that added or removed
+ * devices. Keep-alives of known devices do not change it, so in the steady
+ * state publishing costs nothing.
+ *
+ * Writes are bracketed by incrementing the sequence number in the header,
+ * which is odd while the table is inconsistent. Readers check it before and
+ * after their pass and retry if it changed, so the relay never blocks on a
+ * reader, and readers never need a system call.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+#include "upnprd_shm.h"
+
+int shm_setup(upnprd_t *ctx) {
+	ctx->shm = NULL;
+	if(!ctx->config.shm_name[0]) {
+		return 0;
+	}
+
+	// Start from scratch, readers still mapping a stale object keep it
+	// until they reopen
+	shm_unlink(ctx->config.shm_name);
+	int fd = shm_open(ctx->config.shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) {
+		return -5;
+	}
+	if(ftruncate(fd, ctx->config.shm_size) < 0) {
+		close(fd);
+		shm_unlink(ctx->config.shm_name);
+		return -5;
+	}
+	void *memory = mmap(NULL, ctx->config.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(memory == MAP_FAILED) {
+		shm_unlink(ctx->config.shm_name);
+		return -5;
+	}
+
+	// ftruncate() zero-filled the object, which is an empty table
+	ctx->shm = (struct upnprd_shm_header *)memory;
+	ctx->shm->version = UPNPRD_SHM_VERSION;
+	ctx->shm->size = ctx->config.shm_size;
+	ctx->shm->updated = time(NULL);
+	__atomic_store_n(&ctx->shm->magic, UPNPRD_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void shm_publish(upnprd_t *ctx) {
+	struct upnprd_shm_header *header = ctx->shm;
+	if(!header || !ctx->shm_dirty) {
+		return;
+	}
+
+	LOCK(ctx);
+	ctx->shm_dirty = 0;
+
+	// The sequence number becomes odd before any record is touched
+	uint32_t sequence = header->sequence + 1;
+	__atomic_store_n(&header->sequence, sequence, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	unsigned char *records = (unsigned char *)header + UPNPRD_SHM_RECORDS_OFFSET;
+	size_t capacity = header->size - UPNPRD_SHM_RECORDS_OFFSET;
+	size_t used = 0;
+	uint32_t devices = 0, dropped = 0;
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		size_t size = (sizeof(struct upnprd_shm_device) + device->location_length + device->st_length + device->usn_length + 3 + 7) & ~7;
+		if(used + size > capacity) {
+			dropped++;
+			continue;
+		}
+		struct upnprd_shm_device *record = (struct upnprd_shm_device *)(records + used);
+		record->size = size;
+		record->addr = device->addr.sin_addr.s_addr;
+		record->location_length = device->location_length;
+		record->st_length = device->st_length;
+		record->usn_length = device->usn_length;
+		record->origin = device->origin == DEVICE_TUNNEL ? UPNPRD_SHM_TUNNEL : UPNPRD_SHM_LOCAL;
+		record->reserved = 0;
+		memcpy(UPNPRD_SHM_LOCATION(record), device->location, device->location_length + 1);
+		memcpy(UPNPRD_SHM_ST(record), device->st, device->st_length + 1);
+		memcpy(UPNPRD_SHM_USN(record), device->usn, device->usn_length + 1);
+		used += size;
+		devices++;
+	}
+	header->devices = devices;
+	header->used = used;
+	header->dropped = dropped;
+	header->generation++;
+	header->updated = time(NULL);
+
+	// ..and even again once all of them are
+	__atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELEASE);
+	UNLOCK(ctx);
+}
+
+void shm_close(upnprd_t *ctx) {
+	if(!ctx->shm) {
+		return;
+	}
+	// Tell readers that still have the object mapped that it is stale
+	__atomic_store_n(&ctx->shm->magic, 0, __ATOMIC_RELEASE);
+	munmap(ctx->shm, ctx->config.shm_size);
+	shm_unlink(ctx->config.shm_name);
+	ctx->shm = NULL;
+}
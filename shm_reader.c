@@ -0,0 +1,138 @@
+/*
+ * UPnP relay daemon - shared-memory reader library
+ *
+ * See upnprd_shm.h. This file is all a reader needs, it does not depend on
+ * the rest of libupnprd.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "upnprd_shm.h"
+
+struct upnprd_shm_reader {
+	const unsigned char *memory;
+	size_t size;
+};
+
+upnprd_shm_reader_t *upnprd_shm_open(const char *name) {
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if(st.st_size < UPNPRD_SHM_RECORDS_OFFSET) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void *memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(memory == MAP_FAILED) {
+		return NULL;
+	}
+
+	const struct upnprd_shm_header *header = (const struct upnprd_shm_header *)memory;
+	if(header->magic != UPNPRD_SHM_MAGIC || header->version != UPNPRD_SHM_VERSION) {
+		munmap(memory, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	upnprd_shm_reader_t *shm = (upnprd_shm_reader_t *)malloc(sizeof(upnprd_shm_reader_t));
+	if(!shm) {
+		munmap(memory, st.st_size);
+		return NULL;
+	}
+	shm->memory = (const unsigned char *)memory;
+	shm->size = st.st_size;
+	return shm;
+}
+
+void upnprd_shm_close(upnprd_shm_reader_t *shm) {
+	munmap((void *)shm->memory, shm->size);
+	free(shm);
+}
+
+const struct upnprd_shm_header *upnprd_shm_header(upnprd_shm_reader_t *shm) {
+	return (const struct upnprd_shm_header *)shm->memory;
+}
+
+uint32_t upnprd_shm_read_begin(upnprd_shm_reader_t *shm) {
+	const struct upnprd_shm_header *header = upnprd_shm_header(shm);
+	uint32_t sequence;
+	while((sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE)) & 1) {
+		// The relay only holds the lock for one pass over its table
+	}
+	return sequence;
+}
+
+int upnprd_shm_read_retry(upnprd_shm_reader_t *shm, uint32_t sequence) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&upnprd_shm_header(shm)->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+/* Check that a record lies within the used part of the mapping and its strings within the record */
+static const struct upnprd_shm_device *checked(upnprd_shm_reader_t *shm, size_t offset) {
+	size_t used = upnprd_shm_header(shm)->used;
+	if(used > shm->size - UPNPRD_SHM_RECORDS_OFFSET) {
+		used = shm->size - UPNPRD_SHM_RECORDS_OFFSET;
+	}
+	size_t end = UPNPRD_SHM_RECORDS_OFFSET + used;
+	if(offset + sizeof(struct upnprd_shm_device) > end) {
+		return NULL;
+	}
+	const struct upnprd_shm_device *device = (const struct upnprd_shm_device *)(shm->memory + offset);
+	size_t size = device->size;
+	if(size < sizeof(struct upnprd_shm_device) || size % 8 || offset + size > end ||
+			sizeof(struct upnprd_shm_device) + device->location_length + device->st_length + device->usn_length + 3 > size) {
+		return NULL;
+	}
+	return device;
+}
+
+const struct upnprd_shm_device *upnprd_shm_first(upnprd_shm_reader_t *shm) {
+	return checked(shm, UPNPRD_SHM_RECORDS_OFFSET);
+}
+
+const struct upnprd_shm_device *upnprd_shm_next(upnprd_shm_reader_t *shm, const struct upnprd_shm_device *device) {
+	return checked(shm, (const unsigned char *)device - shm->memory + device->size);
+}
+
+int upnprd_shm_find_location(upnprd_shm_reader_t *shm, const char *usn, char *location, size_t size) {
+	size_t usn_length = strlen(usn);
+	uint32_t sequence;
+	int found;
+	do {
+		sequence = upnprd_shm_read_begin(shm);
+		found = -1;
+		const struct upnprd_shm_device *device;
+		for(device = upnprd_shm_first(shm); device; device = upnprd_shm_next(shm, device)) {
+			if(device->usn_length == usn_length && memcmp(UPNPRD_SHM_USN(device), usn, usn_length) == 0) {
+				if(device->location_length < size) {
+					memcpy(location, UPNPRD_SHM_LOCATION(device), device->location_length);
+					location[device->location_length] = 0;
+					found = 0;
+				}
+				break;
+			}
+		}
+	} while(upnprd_shm_read_retry(shm, sequence));
+	return found;
+}
@@ -0,0 +1,158 @@
+/*
+ * UPnP relay daemon - active/standby pairs
+ *
+ * Two relays on the same segments would both answer each M-SEARCH with their
+ * whole cache. With standby_priority set, relays synchronizing with each other
+ * (see sync.c) elect a leader among them, and only the leader answers
+ * searches. The others keep receiving announcements and synchronizing, so
+ * their caches are warm when they have to take over.
+ *
+ * Each relay sends a heartbeat with its priority to its peers every
+ * standby_interval seconds. The relay with the highest priority among those
+ * heard from within STANDBY_MISSED intervals leads. On equal priorities the
+ * current leader stays, and if both or neither lead, the higher node id wins.
+ * A relay thus takes over about STANDBY_MISSED intervals after the leader
+ * stopped, and a relay with a higher priority takes over right away.
+ *
+ * A relay that starts only takes the lead once it heard from all its peers,
+ * or after STANDBY_MISSED intervals, such that it does not answer alongside
+ * the leader in the meantime. Heartbeats are due on the instance's timer, see
+ * upnprd_prep_fd_set(), since the caller's event loop may wait without a
+ * timeout.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+static int peer_alive(upnprd_t *ctx, struct standby_peer *peer) {
+	return peer->addr.sin_port && ctx->now_ms - peer->heard_ms < STANDBY_MISSED * ctx->config.standby_interval * 1000;
+}
+
+/* Whether the peer should lead rather than us */
+static int peer_preferred(upnprd_t *ctx, struct standby_peer *peer) {
+	if(peer->priority != ctx->config.standby_priority) {
+		return peer->priority > ctx->config.standby_priority;
+	}
+	if(peer->leader != ctx->standby_leader) {
+		return peer->leader;
+	}
+	return peer->node > ctx->sync_node;
+}
+
+static void elect(upnprd_t *ctx) {
+	int heard = 0, preferred = 0;
+	int i;
+	for(i=0; i<ctx->sync_peer_count; i++) {
+		struct standby_peer *peer = &ctx->standby_peers[i];
+		if(peer_alive(ctx, peer)) {
+			heard++;
+			preferred |= peer_preferred(ctx, peer);
+		}
+	}
+
+	int leader = !preferred && (ctx->standby_leader || heard == ctx->sync_peer_count ||
+		ctx->now_ms - ctx->standby_started_ms >= STANDBY_MISSED * ctx->config.standby_interval * 1000);
+	if(leader != ctx->standby_leader) {
+		debugf("%s\n", leader ? "Taking the lead" : "Standing by");
+		ctx->standby_leader = leader;
+		ctx->stats.standby = !leader;
+		if(leader) {
+			ctx->stats.standby_takeovers++;
+		}
+
+		// Let the peers know right away
+		sync_heartbeat(ctx, ctx->config.standby_priority, leader);
+	}
+}
+
+/* Whether this relay answers searches, i.e. leads or does not take part in elections */
+int standby_leading(upnprd_t *ctx) {
+	return !ctx->standby_enabled || ctx->standby_leader;
+}
+
+/* Called for heartbeats from a synchronization peer. The caller must hold the lock. */
+void standby_heartbeat(upnprd_t *ctx, struct sockaddr_in *addr, uint32_t node, unsigned char priority, unsigned char leader) {
+	if(!ctx->standby_enabled) {
+		return;
+	}
+	int i;
+	for(i=0; i<ctx->sync_peer_count; i++) {
+		if(ctx->sync_peers[i].sin_addr.s_addr == addr->sin_addr.s_addr && ctx->sync_peers[i].sin_port == addr->sin_port) {
+			break;
+		}
+	}
+	if(i == ctx->sync_peer_count) {
+		return;
+	}
+	struct standby_peer *peer = &ctx->standby_peers[i];
+	if(!peer_alive(ctx, peer) || peer->node != node) {
+		// Started, or came back. Answer, such that it need not wait
+		// for our next heartbeat.
+		sync_heartbeat(ctx, ctx->config.standby_priority, ctx->standby_leader);
+	}
+	peer->addr = *addr;
+	peer->node = node;
+	peer->priority = priority;
+	peer->leader = leader;
+	peer->heard_ms = ctx->now_ms;
+	elect(ctx);
+}
+
+/** EVENT LOOP *******************************************/
+/* Returns 0, or a negative error code */
+int standby_setup(upnprd_t *ctx) {
+	ctx->standby_enabled = 0;
+	if(!ctx->config.standby_priority || ctx->sync_fd < 0) {
+		return 0;
+	}
+
+	ctx->standby_enabled = 1;
+	clock_update(ctx);
+	ctx->standby_started_ms = ctx->now_ms;
+	ctx->standby_next_ms = ctx->now_ms + ctx->config.standby_interval * 1000;
+	ctx->stats.standby = 1;
+
+	// The peers answer right away, so we need not wait for the leader's
+	// next heartbeat to know where we stand
+	sync_heartbeat(ctx, ctx->config.standby_priority, 0);
+	return 0;
+}
+
+void standby_reconfigure(upnprd_t *ctx) {
+	if(!ctx->standby_enabled) {
+		return;
+	}
+	// The peers may have changed. Hear from them again before taking
+	// the lead.
+	memset(ctx->standby_peers, 0, sizeof(ctx->standby_peers));
+	ctx->standby_started_ms = ctx->now_ms;
+}
+
+/* Milliseconds until the next heartbeat is due, -1 if disabled */
+long standby_timeout_ms(upnprd_t *ctx) {
+	if(!ctx->standby_enabled) {
+		return -1;
+	}
+	int32_t left = ctx->standby_next_ms - ctx->now_ms;
+	return left > 0 ? left : 0;
+}
+
+void standby_poll(upnprd_t *ctx) {
+	if(!ctx->standby_enabled || (int32_t)(ctx->now_ms - ctx->standby_next_ms) < 0) {
+		return;
+	}
+	ctx->standby_next_ms = ctx->now_ms + ctx->config.standby_interval * 1000;
+	LOCK(ctx);
+	sync_heartbeat(ctx, ctx->config.standby_priority, ctx->standby_leader);
+	elect(ctx);
+	UNLOCK(ctx);
+}
@@ -0,0 +1,92 @@
+/*
+ * UPnP relay daemon - statistics
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+#define COUNTER(name) { #name, offsetof(struct upnprd_stats, name) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} counters[] = {
+	COUNTER(devices),
+	COUNTER(devices_evicted),
+	COUNTER(devices_dropped),
+	COUNTER(sends_dropped),
+	COUNTER(sync_sent),
+	COUNTER(sync_received),
+	COUNTER(sync_rejected),
+	COUNTER(sync_devices_learned),
+	COUNTER(tunnel_bytes_sent),
+	COUNTER(tunnel_bytes_received),
+	COUNTER(tunnel_bytes_uncompressed),
+	COUNTER(tunnel_announcements_sent),
+	COUNTER(tunnel_announcements_received),
+	COUNTER(tunnel_searches_sent),
+	COUNTER(tunnel_searches_received),
+	COUNTER(tunnel_rejected),
+	COUNTER(tunnel_rtt_ms),
+	COUNTER(admissions_rejected),
+	COUNTER(admissions_rejected_interface),
+	COUNTER(sources_quarantined),
+	COUNTER(searches_limited),
+	COUNTER(replies_limited),
+	COUNTER(sent_interactive),
+	COUNTER(sent_background),
+	COUNTER(latency_interactive_ms),
+	COUNTER(latency_background_ms),
+	COUNTER(latency_max_interactive_ms),
+	COUNTER(latency_max_background_ms),
+	COUNTER(overload_state),
+	COUNTER(overload_targeted),
+	COUNTER(overload_first_time),
+	COUNTER(overload_drop),
+	COUNTER(overload_depth),
+	COUNTER(overload_lag_ms),
+	COUNTER(overload_memory_kb),
+	COUNTER(searches_shed),
+	COUNTER(proxy_requests),
+	COUNTER(proxy_hits),
+	COUNTER(proxy_fetches),
+	COUNTER(proxy_not_modified),
+	COUNTER(proxy_failures),
+	COUNTER(liveness_probes),
+	COUNTER(liveness_failures),
+	COUNTER(devices_unreachable),
+	COUNTER(devices_filtered),
+	COUNTER(byebyes_deferred),
+	COUNTER(byebyes_reverted),
+	COUNTER(byebyes_suppressed),
+	COUNTER(self_dropped),
+	COUNTER(visibility_overflow),
+	COUNTER(queries),
+	COUNTER(subscription_events),
+	COUNTER(subscription_resyncs),
+	COUNTER(standby),
+	COUNTER(standby_takeovers),
+	COUNTER(standby_searches),
+	COUNTER(reply_plans_built),
+	COUNTER(reply_plan_hits),
+};
+
+void upnprd_stats_report(upnprd_t *ctx, FILE *out) {
+	struct upnprd_stats stats;
+	upnprd_stats(ctx, &stats);
+
+	int i;
+	for(i=0; i<sizeof(counters)/sizeof(counters[0]); i++) {
+		fprintf(out, "%-30s %lu\n", counters[i].name, *(unsigned long *)((char *)&stats + counters[i].offset));
+	}
+}
@@ -0,0 +1,520 @@
+/*
+ * UPnP relay daemon - relay synchronization
+ *
+ * Relays of one site exchange their caches over unicast UDP, such that a
+ * device seen by any of them can be found through all of them. Each relay
+ * tells its peers about devices appearing, refreshing and going offline, in
+ * one batch per upnprd_poll(). When a relay starts, or its peer list
+ * changes, it sends its whole cache to its peers and asks for theirs in
+ * return (anti-entropy), so a joining relay catches up at once.
+ *
+ * Every device carries a version vector with one counter per relay that
+ * changed it, and updates older than what we have are ignored. Relays do not
+ * forward what they learned from a peer, so peers should form a full mesh.
+ *
+ * Datagram format, all integers in network byte order:
+ *
+ *   header  "USYN" | version (1) | type (1) | entry count (2) | node (4)
+ *   entry   flags (1) | version count (1) |
+ *           LOCATION, ST and USN length (2 each) |
+ *           seconds since last seen (4) | announcer's IPv4 address (4) |
+ *           version count * (node (4) | counter (4)) |
+ *           LOCATION, ST and USN, each NUL terminated
+ *
+ * Heartbeats for leader election (see standby.c) are a header without entries,
+ * followed by the sender's priority (1) and whether it leads (1).
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+#define SYNC_MAGIC "USYN"
+#define SYNC_VERSION 1
+
+#define SYNC_HEADER_SIZE 12
+#define SYNC_ENTRY_SIZE 16
+
+// Datagram types
+#define SYNC_DELTA 1
+#define SYNC_JOIN 2      // Asks the receiver to send its whole cache
+#define SYNC_HEARTBEAT 3 // Leader election, see standby.c
+
+// Entry flags
+#define SYNC_ALIVE 1
+
+/** VERSION VECTORS **************************************/
+static uint32_t version_of(const struct sync_version *versions, int count, uint32_t node) {
+	int i;
+	for(i=0; i<count; i++) {
+		if(versions[i].node == node) {
+			return versions[i].counter;
+		}
+	}
+	return 0;
+}
+
+static void set_version(struct sync_version *versions, uint32_t node, uint32_t counter) {
+	int i, slot = 0;
+	for(i=0; i<SYNC_MAX_NODES; i++) {
+		if(versions[i].node == node) {
+			if(counter > versions[i].counter) {
+				versions[i].counter = counter;
+			}
+			return;
+		}
+		// Prefer an unused entry, else reuse the one with the lowest counter
+		if(versions[slot].node && (!versions[i].node || versions[i].counter < versions[slot].counter)) {
+			slot = i;
+		}
+	}
+	versions[slot].node = node;
+	versions[slot].counter = counter;
+}
+
+#define UPDATE_OLDER 0
+#define UPDATE_SAME 1
+#define UPDATE_NEWER 2
+#define UPDATE_CONCURRENT 3
+
+/* Compare an update's version vector against a device's */
+static int compare_versions(const struct sync_version *update, int update_count, const struct sync_version *local) {
+	int newer = 0, older = 0;
+	int i;
+	for(i=0; i<update_count; i++) {
+		if(update[i].counter > version_of(local, SYNC_MAX_NODES, update[i].node)) {
+			newer = 1;
+		}
+	}
+	for(i=0; i<SYNC_MAX_NODES; i++) {
+		if(local[i].node && local[i].counter > version_of(update, update_count, local[i].node)) {
+			older = 1;
+		}
+	}
+	return newer ? (older ? UPDATE_CONCURRENT : UPDATE_NEWER) : (older ? UPDATE_OLDER : UPDATE_SAME);
+}
+
+/** SENDING *********************************************/
+static void put16(unsigned char *p, uint16_t value) {
+	value = htons(value);
+	memcpy(p, &value, 2);
+}
+
+static void put32(unsigned char *p, uint32_t value) {
+	value = htonl(value);
+	memcpy(p, &value, 4);
+}
+
+static uint16_t get16(const unsigned char *p) {
+	uint16_t value;
+	memcpy(&value, p, 2);
+	return ntohs(value);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+static void send_datagram(upnprd_t *ctx, const void *buf, size_t length, struct sockaddr_in *dest) {
+	if(sendto(ctx->sync_fd, buf, length, MSG_DONTWAIT, (struct sockaddr *)dest, sizeof(*dest)) < 0) {
+		ctx->stats.sends_dropped++;
+	}
+	else {
+		ctx->stats.sync_sent++;
+	}
+}
+
+static void write_header(upnprd_t *ctx, unsigned char *buf, int type, int count) {
+	memcpy(buf, SYNC_MAGIC, 4);
+	buf[4] = SYNC_VERSION;
+	buf[5] = type;
+	put16(buf + 6, count);
+	put32(buf + 8, ctx->sync_node);
+}
+
+/* Send the pending updates to dest, or to all peers if dest is NULL */
+static void flush_to(upnprd_t *ctx, struct sockaddr_in *dest) {
+	if(ctx->sync_out_length == 0) {
+		return;
+	}
+	if(dest) {
+		send_datagram(ctx, ctx->sync_out, ctx->sync_out_length, dest);
+	}
+	else {
+		int i;
+		for(i=0; i<ctx->sync_peer_count; i++) {
+			send_datagram(ctx, ctx->sync_out, ctx->sync_out_length, &ctx->sync_peers[i]);
+		}
+	}
+	ctx->sync_out_length = 0;
+}
+
+/* Add an update on device to the pending datagram, flushing it to dest first if it is full */
+static void append_update(upnprd_t *ctx, device_t *device, int alive, struct sockaddr_in *dest) {
+	int version_count = 0;
+	while(version_count < SYNC_MAX_NODES && device->versions[version_count].node) {
+		version_count++;
+	}
+	size_t size = SYNC_ENTRY_SIZE + version_count * 8 + device->location_length + device->st_length + device->usn_length + 3;
+	if(SYNC_HEADER_SIZE + size > SYNC_DATAGRAM_SIZE) {
+		debugf("[%s] Too large to synchronize\n", device->usn);
+		return;
+	}
+	if(ctx->sync_out_length + size > SYNC_DATAGRAM_SIZE) {
+		flush_to(ctx, dest);
+	}
+	if(ctx->sync_out_length == 0) {
+		write_header(ctx, ctx->sync_out, SYNC_DELTA, 0);
+		ctx->sync_out_length = SYNC_HEADER_SIZE;
+	}
+
+	unsigned char *p = ctx->sync_out + ctx->sync_out_length;
+	p[0] = alive ? SYNC_ALIVE : 0;
+	p[1] = version_count;
+	put16(p + 2, device->location_length);
+	put16(p + 4, device->st_length);
+	put16(p + 6, device->usn_length);
+	put32(p + 8, ctx->now > device->last_seen ? ctx->now - device->last_seen : 0);
+	memcpy(p + 12, &device->addr.sin_addr.s_addr, 4);
+	p += SYNC_ENTRY_SIZE;
+	int i;
+	for(i=0; i<version_count; i++) {
+		put32(p, device->versions[i].node);
+		put32(p + 4, device->versions[i].counter);
+		p += 8;
+	}
+	memcpy(p, device->location, device->location_length + 1);
+	p += device->location_length + 1;
+	memcpy(p, device->st, device->st_length + 1);
+	p += device->st_length + 1;
+	memcpy(p, device->usn, device->usn_length + 1);
+
+	ctx->sync_out_length += size;
+	put16(ctx->sync_out + 6, get16(ctx->sync_out + 6) + 1);
+}
+
+/* Send our whole cache to dest, or to all peers if dest is NULL. The caller must hold the lock. */
+static void send_cache(upnprd_t *ctx, struct sockaddr_in *dest) {
+	// Pending updates are for all peers
+	flush_to(ctx, NULL);
+
+	// Devices from the tunnel are refreshed through the tunnel only, so
+	// they would time out on the peers
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		if(device->origin != DEVICE_TUNNEL) {
+			append_update(ctx, device, 1, dest);
+		}
+	}
+	flush_to(ctx, dest);
+}
+
+/*
+ * Called for devices seen in local SSDP traffic. Tells the peers about new
+ * devices, and about known ones often enough to keep them from timing out.
+ * The caller must hold the lock.
+ */
+void sync_device_seen(upnprd_t *ctx, device_t *device) {
+	if(ctx->sync_fd < 0) {
+		return;
+	}
+	if(device->synced && device->synced + ctx->config.device_timeout / 4 > ctx->now) {
+		return;
+	}
+	set_version(device->versions, ctx->sync_node, version_of(device->versions, SYNC_MAX_NODES, ctx->sync_node) + 1);
+	device->synced = ctx->now;
+	append_update(ctx, device, 1, NULL);
+}
+
+/* Called before a device is removed following a byebye. The caller must hold the lock. */
+void sync_device_gone(upnprd_t *ctx, device_t *device) {
+	if(ctx->sync_fd < 0) {
+		return;
+	}
+	set_version(device->versions, ctx->sync_node, version_of(device->versions, SYNC_MAX_NODES, ctx->sync_node) + 1);
+	append_update(ctx, device, 0, NULL);
+}
+
+void sync_flush(upnprd_t *ctx) {
+	if(ctx->sync_fd < 0) {
+		return;
+	}
+	LOCK(ctx);
+	flush_to(ctx, NULL);
+	UNLOCK(ctx);
+}
+
+/*
+ * Anti-entropy: Ask all peers for their caches, and send them ours
+ */
+void sync_join(upnprd_t *ctx) {
+	if(ctx->sync_fd < 0) {
+		return;
+	}
+	LOCK(ctx);
+	unsigned char join[SYNC_HEADER_SIZE];
+	write_header(ctx, join, SYNC_JOIN, 0);
+	int i;
+	for(i=0; i<ctx->sync_peer_count; i++) {
+		send_datagram(ctx, join, sizeof(join), &ctx->sync_peers[i]);
+	}
+	send_cache(ctx, NULL);
+	UNLOCK(ctx);
+}
+
+/* Send a leader election heartbeat to all peers */
+void sync_heartbeat(upnprd_t *ctx, unsigned char priority, unsigned char leader) {
+	unsigned char heartbeat[SYNC_HEADER_SIZE + 2];
+	write_header(ctx, heartbeat, SYNC_HEARTBEAT, 0);
+	heartbeat[SYNC_HEADER_SIZE] = priority;
+	heartbeat[SYNC_HEADER_SIZE + 1] = leader;
+	int i;
+	for(i=0; i<ctx->sync_peer_count; i++) {
+		send_datagram(ctx, heartbeat, sizeof(heartbeat), &ctx->sync_peers[i]);
+	}
+}
+
+/** RECEIVING *******************************************/
+static int is_peer(upnprd_t *ctx, struct sockaddr_in *addr) {
+	int i;
+	for(i=0; i<ctx->sync_peer_count; i++) {
+		if(ctx->sync_peers[i].sin_addr.s_addr == addr->sin_addr.s_addr && ctx->sync_peers[i].sin_port == addr->sin_port) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Apply one update. The caller must hold the lock. */
+static void apply_update(upnprd_t *ctx, int alive, time_t age, struct in_addr announcer,
+		const struct sync_version *versions, int version_count, char **headers) {
+	device_t *device = find_device_by_usn(ctx, headers[USN]);
+	time_t last_seen = ctx->now - age;
+
+	if(!alive) {
+		if(device && !ctx->config.ignore_down_messages && compare_versions(versions, version_count, device->versions) == UPDATE_NEWER) {
+			debugf("[%s] Device is down according to a peer\n", headers[USN]);
+			tunnel_device_gone(ctx, device);
+			delete_device(ctx, device);
+		}
+		return;
+	}
+
+	if(!device) {
+		unsigned char zones;
+		if(!filter_device(ctx, headers, &zones)) {
+			return;
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr = announcer;
+		device = create_device(ctx, headers, &addr, zones);
+		if(!device) {
+			return;
+		}
+		// Do not announce it back to the peers
+		device->synced = ctx->now;
+		device->last_seen = last_seen;
+		ctx->stats.sync_devices_learned++;
+		tunnel_device_seen(ctx, device);
+	}
+
+	int i;
+	if(compare_versions(versions, version_count, device->versions) >= UPDATE_NEWER) {
+		for(i=0; i<version_count; i++) {
+			set_version(device->versions, versions[i].node, versions[i].counter);
+		}
+	}
+	if(last_seen > device->last_seen) {
+		device->last_seen = last_seen;
+	}
+}
+
+/* Parse and apply a datagram from a peer. Returns -1 if it is malformed. */
+static int apply_datagram(upnprd_t *ctx, unsigned char *buf, size_t length, struct sockaddr_in *peer) {
+	if(length < SYNC_HEADER_SIZE || memcmp(buf, SYNC_MAGIC, 4) != 0 || buf[4] != SYNC_VERSION) {
+		return -1;
+	}
+	int type = buf[5];
+	int count = get16(buf + 6);
+	if(get32(buf + 8) == ctx->sync_node) {
+		// Our own node id, i.e. we are listed as our own peer
+		return -1;
+	}
+
+	if(type == SYNC_JOIN) {
+		send_cache(ctx, peer);
+		return 0;
+	}
+	if(type == SYNC_HEARTBEAT) {
+		if(length < SYNC_HEADER_SIZE + 2) {
+			return -1;
+		}
+		standby_heartbeat(ctx, peer, get32(buf + 8), buf[SYNC_HEADER_SIZE], buf[SYNC_HEADER_SIZE + 1]);
+		return 0;
+	}
+	if(type != SYNC_DELTA) {
+		return -1;
+	}
+
+	unsigned char *p = buf + SYNC_HEADER_SIZE;
+	unsigned char *end = buf + length;
+	while(count-- > 0) {
+		if(end - p < SYNC_ENTRY_SIZE) {
+			return -1;
+		}
+		int alive = p[0] & SYNC_ALIVE;
+		int version_count = p[1];
+		size_t lengths[3] = { get16(p + 2), get16(p + 4), get16(p + 6) };
+		time_t age = get32(p + 8);
+		struct in_addr announcer;
+		memcpy(&announcer.s_addr, p + 12, 4);
+		p += SYNC_ENTRY_SIZE;
+
+		if(version_count > SYNC_MAX_NODES || end - p < version_count * 8) {
+			return -1;
+		}
+		struct sync_version versions[SYNC_MAX_NODES];
+		int i;
+		for(i=0; i<version_count; i++) {
+			versions[i].node = get32(p);
+			versions[i].counter = get32(p + 4);
+			p += 8;
+		}
+
+		// The strings are used in place, so they must be terminated
+		char *headers[3];
+		for(i=0; i<3; i++) {
+			if(end - p < lengths[i] + 1 || p[lengths[i]] != 0 || memchr(p, 0, lengths[i])) {
+				return -1;
+			}
+			headers[i] = (char *)p;
+			p += lengths[i] + 1;
+		}
+
+		apply_update(ctx, alive, age, announcer, versions, version_count, headers);
+	}
+	return 0;
+}
+
+void sync_receive(upnprd_t *ctx) {
+	int received;
+	for(received=0; received<RECV_BATCH; received++) {
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+		int nbytes = recvfrom(ctx->sync_fd, ctx->buffer, sizeof(ctx->buffer), MSG_DONTWAIT, (struct sockaddr *)&addr, &addrlen);
+		if(nbytes < 0) {
+			return;
+		}
+
+		LOCK(ctx);
+		if(!is_peer(ctx, &addr) || apply_datagram(ctx, (unsigned char *)ctx->buffer, nbytes, &addr) < 0) {
+			debugf("Rejected synchronization datagram from %s\n", inet_ntoa(addr.sin_addr));
+			ctx->stats.sync_rejected++;
+		}
+		else {
+			ctx->stats.sync_received++;
+		}
+		UNLOCK(ctx);
+	}
+}
+
+/** SETUP ***********************************************/
+/*
+ * Parse a space separated list of address:port pairs. Returns the number of
+ * peers, or -1 if the list is invalid or too long.
+ */
+int sync_parse_peers(const char *list, struct sockaddr_in *peers, int max_peers) {
+	int count = 0;
+	while(*list) {
+		while(*list == ' ' || *list == '\t') {
+			list++;
+		}
+		if(!*list) {
+			break;
+		}
+		size_t length = strcspn(list, " \t");
+		char peer[32];
+		if(length >= sizeof(peer) || count == max_peers) {
+			return -1;
+		}
+		memcpy(peer, list, length);
+		peer[length] = 0;
+		list += length;
+
+		char *colon = strchr(peer, ':');
+		if(!colon) {
+			return -1;
+		}
+		*colon = 0;
+		char *end;
+		unsigned long port = strtoul(colon + 1, &end, 10);
+		if(*end || end == colon + 1 || port == 0 || port > 65535) {
+			return -1;
+		}
+
+		memset(&peers[count], 0, sizeof(peers[count]));
+		peers[count].sin_family = AF_INET;
+		peers[count].sin_port = htons(port);
+		if(inet_aton(peer, &peers[count].sin_addr) == 0) {
+			return -1;
+		}
+		count++;
+	}
+	return count;
+}
+
+/* Returns 0, or a negative error code */
+int sync_setup(upnprd_t *ctx) {
+	ctx->sync_fd = -1;
+	if(!ctx->config.sync_port) {
+		return 0;
+	}
+
+	// Node ids only need to differ between the relays of a site
+	int random_fd = open("/dev/urandom", O_RDONLY);
+	if(random_fd >= 0) {
+		if(read(random_fd, &ctx->sync_node, sizeof(ctx->sync_node)) != sizeof(ctx->sync_node)) {
+			ctx->sync_node = 0;
+		}
+		close(random_fd);
+	}
+	if(!ctx->sync_node) {
+		ctx->sync_node = time(NULL) ^ (getpid() << 16) ^ (uint32_t)(uintptr_t)ctx;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		return -2;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(ctx->config.sync_port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -4;
+	}
+	ctx->sync_fd = fd;
+	return 0;
+}
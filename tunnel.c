@@ -0,0 +1,655 @@
+/*
+ * UPnP relay daemon - relay-to-relay tunnel
+ *
+ * Connects the caches of two sites over a routed link, where multicast does
+ * not pass. Both ends send each other compact binary records instead of SSDP
+ * text: announcements of the devices they know, byebyes, and searches, which
+ * make the other end run a discovery of its own. Records are batched into one
+ * datagram per upnprd_poll() and their strings are compressed against a
+ * dictionary of the words common in UPnP headers. An export and an import
+ * policy on each end limit which devices cross the link.
+ *
+ * Datagram format, all integers in network byte order:
+ *
+ *   header  "UTUN" | version (1) | type (1) | record count (2) |
+ *           sender's clock in ms (4) | last clock value received (4) |
+ *           ms since it was received (2)
+ *
+ * The echoed clock values give the round trip time. Records start with a
+ * kind byte, followed by varints and compressed strings:
+ *
+ *   announce  kind | age in seconds | LOCATION | ST | USN
+ *   byebye    kind | ST | USN
+ *   search    kind | ST
+ *
+ * If the KIND_SHORT_USN bit is set in kind, the USN is "<sent USN>::<ST>".
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <arpa/inet.h>
+#include <fnmatch.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+#define TUNNEL_MAGIC "UTUN"
+#define TUNNEL_VERSION 1
+#define TUNNEL_HEADER_SIZE 18
+
+// Datagram types
+#define TUNNEL_DATA 1
+#define TUNNEL_ACK 2     // Only carries the clock values
+#define TUNNEL_JOIN 3    // Asks the receiver to announce its whole cache
+
+// Record kinds
+#define KIND_ANNOUNCE 1
+#define KIND_BYEBYE 2
+#define KIND_SEARCH 3
+#define KIND_SHORT_USN 0x80
+
+// Longest string a record may decode to
+#define TUNNEL_MAX_STRING 1024
+
+/** COMPRESSION *****************************************/
+/*
+ * Bytes below 0x80 are literals, 0x80 + i stands for dictionary[i], and 0xff
+ * escapes a literal byte of 0x80 or above. Words must come before their own
+ * prefixes, as the encoder picks the first match.
+ */
+#define WORD(word) { word, sizeof(word) - 1 }
+
+static const struct {
+	const char *word;
+	size_t length;
+} dictionary[] = {
+	WORD("urn:schemas-upnp-org:device:"),
+	WORD("urn:schemas-upnp-org:service:"),
+	WORD("urn:microsoft.com:service:"),
+	WORD("InternetGatewayDevice:"),
+	WORD("ConnectionManager:"),
+	WORD("ContentDirectory:"),
+	WORD("RenderingControl:"),
+	WORD("WANIPConnection:"),
+	WORD("WANCommonInterfaceConfig:"),
+	WORD("X_MS_MediaReceiverRegistrar:"),
+	WORD("MediaRenderer:"),
+	WORD("MediaServer:"),
+	WORD("AVTransport:"),
+	WORD("WANConnectionDevice:"),
+	WORD("WANDevice:"),
+	WORD("Layer3Forwarding:"),
+	WORD("/description.xml"),
+	WORD("/rootDesc.xml"),
+	WORD("/DeviceDescription.xml"),
+	WORD("upnp:rootdevice"),
+	WORD("ssdp:all"),
+	WORD("http://"),
+	WORD("uuid:"),
+	WORD(":49152/"),
+	WORD(":8200/"),
+	WORD(":80/"),
+	WORD("192.168."),
+	WORD("10."),
+	WORD("-0000-"),
+	WORD("0000"),
+	WORD("::"),
+	WORD(".xml"),
+	WORD("desc"),
+	WORD("urn:"),
+	WORD("dial-multiscreen-org:"),
+	WORD("Basic:"),
+	WORD("service:"),
+	WORD("device:"),
+};
+
+#define DICTIONARY_SIZE (sizeof(dictionary)/sizeof(dictionary[0]))
+
+/* Compress a string into out. Returns the length written, or -1 if it did not fit. */
+static int compress_string(const char *in, unsigned char *out, size_t out_size) {
+	size_t length = 0;
+	while(*in) {
+		unsigned int i;
+		for(i=0; i<DICTIONARY_SIZE; i++) {
+			if(*in == dictionary[i].word[0] && strncmp(in, dictionary[i].word, dictionary[i].length) == 0) {
+				break;
+			}
+		}
+		if(length + 2 > out_size) {
+			return -1;
+		}
+		if(i < DICTIONARY_SIZE) {
+			out[length++] = 0x80 + i;
+			in += dictionary[i].length;
+		}
+		else {
+			if((unsigned char)*in >= 0x80) {
+				out[length++] = 0xff;
+			}
+			out[length++] = *in++;
+		}
+	}
+	return length;
+}
+
+/* Decompress length bytes into a NUL terminated string. Returns -1 if malformed or too long. */
+static int decompress_string(const unsigned char *in, size_t length, char *out, size_t out_size) {
+	size_t out_length = 0;
+	const unsigned char *end = in + length;
+	while(in < end) {
+		const char *word;
+		size_t word_length;
+		char literal;
+		if(*in == 0xff) {
+			if(++in == end) {
+				return -1;
+			}
+			literal = *in++;
+			word = &literal;
+			word_length = 1;
+		}
+		else if(*in >= 0x80) {
+			if(*in - 0x80 >= DICTIONARY_SIZE) {
+				return -1;
+			}
+			word = dictionary[*in - 0x80].word;
+			word_length = dictionary[*in++ - 0x80].length;
+		}
+		else {
+			if(*in == 0) {
+				return -1;
+			}
+			literal = *in++;
+			word = &literal;
+			word_length = 1;
+		}
+		if(out_length + word_length >= out_size) {
+			return -1;
+		}
+		memcpy(out + out_length, word, word_length);
+		out_length += word_length;
+	}
+	out[out_length] = 0;
+	return 0;
+}
+
+/** RECORD ENCODING *************************************/
+struct writer {
+	unsigned char *p;
+	unsigned char *end;
+	int failed;
+};
+
+static void put_varint(struct writer *w, unsigned long value) {
+	do {
+		if(w->p == w->end) {
+			w->failed = 1;
+			return;
+		}
+		*w->p++ = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while(value);
+}
+
+static void put_string(struct writer *w, const char *string, size_t length) {
+	// Compress into a scratch buffer first, the length goes in front
+	unsigned char compressed[TUNNEL_MAX_STRING * 2];
+	char copy[TUNNEL_MAX_STRING];
+	if(length >= sizeof(copy)) {
+		w->failed = 1;
+		return;
+	}
+	memcpy(copy, string, length);
+	copy[length] = 0;
+	int compressed_length = compress_string(copy, compressed, sizeof(compressed));
+	if(compressed_length < 0) {
+		w->failed = 1;
+		return;
+	}
+	put_varint(w, compressed_length);
+	if(w->failed || w->end - w->p < compressed_length) {
+		w->failed = 1;
+		return;
+	}
+	memcpy(w->p, compressed, compressed_length);
+	w->p += compressed_length;
+}
+
+struct reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	int failed;
+};
+
+static unsigned long get_varint(struct reader *r) {
+	unsigned long value = 0;
+	int shift = 0;
+	while(1) {
+		if(r->p == r->end || shift > 28) {
+			r->failed = 1;
+			return 0;
+		}
+		unsigned char byte = *r->p++;
+		value |= (unsigned long)(byte & 0x7f) << shift;
+		if(!(byte & 0x80)) {
+			return value;
+		}
+		shift += 7;
+	}
+}
+
+static void get_string(struct reader *r, char *out, size_t out_size) {
+	unsigned long length = get_varint(r);
+	if(r->failed || r->end - r->p < length || decompress_string(r->p, length, out, out_size) < 0) {
+		r->failed = 1;
+		out[0] = 0;
+		return;
+	}
+	r->p += length;
+}
+
+/** POLICY **********************************************/
+/* Check a service type against a space separated list of patterns. An empty list matches anything. */
+static int policy_allows(const char *policy, const char *st) {
+	if(!*policy) {
+		return 1;
+	}
+	while(*policy) {
+		size_t length = strcspn(policy, " \t");
+		if(length > 0) {
+			char pattern[128];
+			if(length < sizeof(pattern)) {
+				memcpy(pattern, policy, length);
+				pattern[length] = 0;
+				if(fnmatch(pattern, st, 0) == 0) {
+					return 1;
+				}
+			}
+			policy += length;
+		}
+		else {
+			policy++;
+		}
+	}
+	return 0;
+}
+
+/** SENDING *********************************************/
+static void put16(unsigned char *p, uint16_t value) {
+	value = htons(value);
+	memcpy(p, &value, 2);
+}
+
+static void put32(unsigned char *p, uint32_t value) {
+	value = htonl(value);
+	memcpy(p, &value, 4);
+}
+
+static uint16_t get16(const unsigned char *p) {
+	uint16_t value;
+	memcpy(&value, p, 2);
+	return ntohs(value);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+static void send_datagram(upnprd_t *ctx, unsigned char *buf, size_t length, int type, int count) {
+	if(!ctx->tunnel_peer.sin_port) {
+		return;
+	}
+
+	// The clock values are filled in last, to keep the delay accurate
+	memcpy(buf, TUNNEL_MAGIC, 4);
+	buf[4] = TUNNEL_VERSION;
+	buf[5] = type;
+	put16(buf + 6, count);
+	put32(buf + 8, ctx->now_ms);
+	put32(buf + 12, ctx->tunnel_echo);
+	uint32_t delay = ctx->now_ms - ctx->tunnel_echo_received;
+	put16(buf + 16, delay > 0xffff ? 0xffff : delay);
+
+	if(sendto(ctx->tunnel_fd, buf, length, MSG_DONTWAIT, (struct sockaddr *)&ctx->tunnel_peer, sizeof(ctx->tunnel_peer)) < 0) {
+		ctx->stats.sends_dropped++;
+		return;
+	}
+	ctx->stats.tunnel_bytes_sent += length;
+	ctx->tunnel_ack_pending = 0;
+}
+
+static void flush(upnprd_t *ctx) {
+	if(ctx->tunnel_out_count == 0) {
+		return;
+	}
+	send_datagram(ctx, ctx->tunnel_out, ctx->tunnel_out_length, TUNNEL_DATA, ctx->tunnel_out_count);
+	ctx->tunnel_out_count = 0;
+	ctx->tunnel_out_length = TUNNEL_HEADER_SIZE;
+}
+
+/*
+ * Encode a record with the given strings (NULL for those the kind does not
+ * have) and add it to the pending datagram
+ */
+static void append_record(upnprd_t *ctx, int kind, time_t age, const char *location, const char *st, const char *usn) {
+	int attempt;
+	for(attempt=0; attempt<2; attempt++) {
+		struct writer w = { ctx->tunnel_out + ctx->tunnel_out_length, ctx->tunnel_out + sizeof(ctx->tunnel_out), 0 };
+
+		// Most USNs are "uuid:<id>::<ST>", and then the ST need not be sent twice
+		size_t usn_length = usn ? strlen(usn) : 0;
+		size_t st_length = st ? strlen(st) : 0;
+		if(usn && st_length > 0 && usn_length > st_length + 2 && strcmp(usn + usn_length - st_length, st) == 0 &&
+				strncmp(usn + usn_length - st_length - 2, "::", 2) == 0) {
+			kind |= KIND_SHORT_USN;
+			usn_length -= st_length + 2;
+		}
+
+		if(w.p == w.end) {
+			w.failed = 1;
+		}
+		else {
+			*w.p++ = kind;
+		}
+		if((kind & ~KIND_SHORT_USN) == KIND_ANNOUNCE) {
+			put_varint(&w, age);
+			put_string(&w, location, strlen(location));
+		}
+		put_string(&w, st, st_length);
+		if(usn) {
+			put_string(&w, usn, usn_length);
+		}
+
+		if(!w.failed) {
+			size_t length = w.p - (ctx->tunnel_out + ctx->tunnel_out_length);
+			ctx->tunnel_out_length += length;
+			ctx->tunnel_out_count++;
+			ctx->stats.tunnel_bytes_uncompressed += 1 + (location ? strlen(location) + 1 : 0) + (st ? strlen(st) + 1 : 0) + (usn ? strlen(usn) + 1 : 0);
+			return;
+		}
+
+		// Did not fit, retry in a fresh datagram
+		if(ctx->tunnel_out_count == 0) {
+			debugf("Record too large for the tunnel\n");
+			return;
+		}
+		flush(ctx);
+		kind &= ~KIND_SHORT_USN;
+	}
+}
+
+static void announce(upnprd_t *ctx, device_t *device) {
+	if(!policy_allows(ctx->config.tunnel_export, device->st)) {
+		return;
+	}
+	append_record(ctx, KIND_ANNOUNCE, ctx->now > device->last_seen ? ctx->now - device->last_seen : 0, device->location, device->st, device->usn);
+	ctx->stats.tunnel_announcements_sent++;
+}
+
+/*
+ * Called for devices this site learned about. Announces new devices, and
+ * known ones often enough to keep them from timing out on the other end.
+ * The caller must hold the lock.
+ */
+void tunnel_device_seen(upnprd_t *ctx, device_t *device) {
+	if(ctx->tunnel_fd < 0 || device->origin == DEVICE_TUNNEL) {
+		return;
+	}
+	if(device->tunneled && device->tunneled + ctx->config.device_timeout / 4 > ctx->now) {
+		return;
+	}
+	device->tunneled = ctx->now;
+	announce(ctx, device);
+}
+
+/* Called before a device of this site is removed following a byebye. The caller must hold the lock. */
+void tunnel_device_gone(upnprd_t *ctx, device_t *device) {
+	if(ctx->tunnel_fd < 0 || device->origin == DEVICE_TUNNEL || !policy_allows(ctx->config.tunnel_export, device->st)) {
+		return;
+	}
+	append_record(ctx, KIND_BYEBYE, 0, NULL, device->st, device->usn);
+}
+
+/* Forward a search to the other end, at most once a second */
+void tunnel_search(upnprd_t *ctx, const char *st) {
+	if(ctx->tunnel_fd < 0 || ctx->tunnel_last_search == ctx->now) {
+		return;
+	}
+	LOCK(ctx);
+	ctx->tunnel_last_search = ctx->now;
+	append_record(ctx, KIND_SEARCH, 0, NULL, st, NULL);
+	ctx->stats.tunnel_searches_sent++;
+	UNLOCK(ctx);
+}
+
+void tunnel_flush(upnprd_t *ctx) {
+	if(ctx->tunnel_fd < 0) {
+		return;
+	}
+	LOCK(ctx);
+	flush(ctx);
+	if(ctx->tunnel_ack_pending) {
+		// Nothing to send, but the other end wants to measure the latency
+		unsigned char ack[TUNNEL_HEADER_SIZE];
+		send_datagram(ctx, ack, sizeof(ack), TUNNEL_ACK, 0);
+	}
+	UNLOCK(ctx);
+}
+
+/* Announce the devices of this site. The caller must hold the lock. */
+static void send_cache(upnprd_t *ctx) {
+	device_t *device;
+	for(device = ctx->root_device; device; device = device->next) {
+		if(device->origin != DEVICE_TUNNEL) {
+			device->tunneled = ctx->now;
+			announce(ctx, device);
+		}
+	}
+	flush(ctx);
+}
+
+/* Ask the other end for its whole cache, and announce ours */
+void tunnel_join(upnprd_t *ctx) {
+	if(ctx->tunnel_fd < 0) {
+		return;
+	}
+	LOCK(ctx);
+	unsigned char join[TUNNEL_HEADER_SIZE];
+	send_datagram(ctx, join, sizeof(join), TUNNEL_JOIN, 0);
+	send_cache(ctx);
+	UNLOCK(ctx);
+}
+
+/** RECEIVING *******************************************/
+static int apply_record(upnprd_t *ctx, struct reader *r) {
+	char location[TUNNEL_MAX_STRING], st[TUNNEL_MAX_STRING], usn[TUNNEL_MAX_STRING];
+	time_t age = 0;
+
+	if(r->p == r->end) {
+		return -1;
+	}
+	int kind = *r->p++;
+	int short_usn = kind & KIND_SHORT_USN;
+	kind &= ~KIND_SHORT_USN;
+	if(kind == KIND_ANNOUNCE) {
+		age = get_varint(r);
+		get_string(r, location, sizeof(location));
+	}
+	else if(kind != KIND_BYEBYE && kind != KIND_SEARCH) {
+		return -1;
+	}
+	get_string(r, st, sizeof(st));
+	if(kind != KIND_SEARCH) {
+		get_string(r, usn, sizeof(usn));
+		if(short_usn && !r->failed) {
+			size_t usn_length = strlen(usn);
+			if(usn_length + strlen(st) + 3 > sizeof(usn)) {
+				return -1;
+			}
+			strcpy(usn + usn_length, "::");
+			strcpy(usn + usn_length + 2, st);
+		}
+	}
+	if(r->failed) {
+		return -1;
+	}
+
+	if(kind == KIND_SEARCH) {
+		// Refresh our cache with a discovery of our own. Its results
+		// travel back as announcements.
+		ctx->stats.tunnel_searches_received++;
+		if(policy_allows(ctx->config.tunnel_export, st) && ctx->tunnel_last_discovery + ctx->config.search_mx < ctx->now) {
+			ctx->tunnel_last_discovery = ctx->now;
+			ctx->tunnel_discovery_pending = 1;
+		}
+		return 0;
+	}
+
+	if(!policy_allows(ctx->config.tunnel_import, st)) {
+		return 0;
+	}
+	device_t *device = find_device_by_usn(ctx, usn);
+	if(kind == KIND_BYEBYE) {
+		if(device && device->origin == DEVICE_TUNNEL && !ctx->config.ignore_down_messages) {
+			debugf("[%s] Device is down according to the tunnel\n", usn);
+			delete_device(ctx, device);
+		}
+		return 0;
+	}
+
+	ctx->stats.tunnel_announcements_received++;
+	if(!device) {
+		char *headers[3] = { location, st, usn };
+		unsigned char zones;
+		if(!filter_device(ctx, headers, &zones)) {
+			return 0;
+		}
+		// The announcer's address is unknown, and on another site anyway
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		device = create_device(ctx, headers, &addr, zones);
+		if(!device) {
+			return 0;
+		}
+		device->origin = DEVICE_TUNNEL;
+		device->last_seen = ctx->now - age;
+	}
+	else if(ctx->now - age > device->last_seen) {
+		device->last_seen = ctx->now - age;
+	}
+	return 0;
+}
+
+static int apply_datagram(upnprd_t *ctx, unsigned char *buf, size_t length) {
+	if(length < TUNNEL_HEADER_SIZE || memcmp(buf, TUNNEL_MAGIC, 4) != 0 || buf[4] != TUNNEL_VERSION) {
+		return -1;
+	}
+	int type = buf[5];
+	int count = get16(buf + 6);
+
+	// Latency, from our own clock value echoed back
+	uint32_t echo = get32(buf + 12);
+	if(echo && echo != ctx->tunnel_last_echo) {
+		uint32_t rtt = ctx->now_ms - echo - get16(buf + 16);
+		if(rtt < 60000) {
+			ctx->stats.tunnel_rtt_ms = ctx->tunnel_last_echo ? (7 * ctx->stats.tunnel_rtt_ms + rtt) / 8 : rtt;
+		}
+		ctx->tunnel_last_echo = echo;
+	}
+	ctx->tunnel_echo = get32(buf + 8);
+	ctx->tunnel_echo_received = ctx->now_ms;
+
+	if(type == TUNNEL_ACK) {
+		return 0;
+	}
+	ctx->tunnel_ack_pending = 1;
+	if(type == TUNNEL_JOIN) {
+		ctx->tunnel_join_pending = 1;
+		return 0;
+	}
+	if(type != TUNNEL_DATA) {
+		return -1;
+	}
+
+	struct reader r = { buf + TUNNEL_HEADER_SIZE, buf + length, 0 };
+	while(count-- > 0) {
+		if(apply_record(ctx, &r) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void tunnel_receive(upnprd_t *ctx) {
+	int received;
+	for(received=0; received<RECV_BATCH; received++) {
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+		int nbytes = recvfrom(ctx->tunnel_fd, ctx->buffer, sizeof(ctx->buffer), MSG_DONTWAIT, (struct sockaddr *)&addr, &addrlen);
+		if(nbytes < 0) {
+			break;
+		}
+
+		LOCK(ctx);
+		if(addr.sin_addr.s_addr != ctx->tunnel_peer.sin_addr.s_addr || addr.sin_port != ctx->tunnel_peer.sin_port ||
+				apply_datagram(ctx, (unsigned char *)ctx->buffer, nbytes) < 0) {
+			debugf("Rejected tunnel datagram from %s\n", inet_ntoa(addr.sin_addr));
+			ctx->stats.tunnel_rejected++;
+		}
+		else {
+			ctx->stats.tunnel_bytes_received += nbytes;
+		}
+		UNLOCK(ctx);
+	}
+
+	// Answer joins and searches once per batch
+	if(ctx->tunnel_join_pending) {
+		ctx->tunnel_join_pending = 0;
+		LOCK(ctx);
+		send_cache(ctx);
+		UNLOCK(ctx);
+	}
+	if(ctx->tunnel_discovery_pending) {
+		ctx->tunnel_discovery_pending = 0;
+		discover_devices(ctx);
+	}
+}
+
+/** SETUP ***********************************************/
+/* Returns 0, or a negative error code */
+int tunnel_setup(upnprd_t *ctx) {
+	ctx->tunnel_fd = -1;
+	ctx->tunnel_out_length = TUNNEL_HEADER_SIZE;
+	if(!ctx->config.tunnel_port) {
+		return 0;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		return -2;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(ctx->config.tunnel_port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -4;
+	}
+	ctx->tunnel_fd = fd;
+	return 0;
+}
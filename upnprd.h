@@ -0,0 +1,463 @@
+/*
+ * UPnP relay daemon - core library
+ *
+ * The relay is implemented as a context object, such that several independent
+ * relay instances can share one process and one event loop. The event loop
+ * itself is owned by the caller:
+ *
+ *   upnprd_config_init(&config);
+ *   upnprd_init(&ctx, &config);
+ *   while(1) {
+ *       highest_fd = upnprd_prep_fd_set(ctx, &readfds, &writefds);
+ *       select(highest_fd + 1, &readfds, &writefds, NULL, NULL);
+ *       upnprd_poll(ctx, &readfds, &writefds);
+ *   }
+ *   upnprd_shutdown(ctx);
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef UPNPRD_H
+#define UPNPRD_H
+
+#include <stdio.h>
+#include <sys/select.h>
+#include <time.h>
+
+/* Opaque relay instance */
+typedef struct upnprd upnprd_t;
+
+struct upnprd_config {
+	// UDP port to listen on for SSDP traffic. 1900 for real deployments,
+	// anything else is useful for testing several instances on loopback.
+	// Only used by upnprd_init(), changing it requires a restart.
+	unsigned short port;
+
+	// Seconds after which devices that did not announce themselves again
+	// are removed from the cache
+	unsigned int device_timeout;
+
+	// Seconds between sweeps for outdated devices, each followed by an
+	// M-SEARCH of our own
+	unsigned int sweep_interval;
+
+	// CACHE-CONTROL max-age advertised in replies. With max_age_adaptive,
+	// it is derived per device from the max-age the device announced and
+	// how regularly it refreshes, see maxage.c, within max_age_min and
+	// max_age_max; max_age then only applies to devices that did not
+	// announce one.
+	unsigned int max_age;
+	unsigned char max_age_adaptive;
+	unsigned int max_age_min;
+	unsigned int max_age_max;
+
+	// MX of our own M-SEARCHes
+	unsigned int search_mx;
+
+	// Keep devices cached even if they announce going offline. Defaults
+	// to on if compiled with IGNORE_DOWN_MESSAGES.
+	unsigned char ignore_down_messages;
+
+	// Whether our own M-SEARCHes are looped back to this host, such that
+	// UPnP servers running on it see them. On by default. Our own
+	// datagrams are dropped on receipt either way.
+	unsigned char multicast_loop;
+
+	// Byebye dampening, see flap.c: A byebye only removes a device if no
+	// alive follows within byebye_grace seconds. Each byebye adds 1000 to
+	// a penalty halving every flap_half_life seconds; beyond
+	// flap_suppress, byebyes are ignored until it fell below flap_reuse.
+	// Zero disables the grace period and the suppression, respectively.
+	unsigned int byebye_grace;
+	unsigned int flap_half_life;
+	unsigned int flap_suppress;
+	unsigned int flap_reuse;
+
+	// Fixed-footprint mode: If pool_devices is non-zero, all device
+	// records, send queue entries (or, in the THREADS build, sender thread
+	// arguments) are preallocated in upnprd_init() and no heap allocations
+	// happen afterwards, except while upnprd_reconfigure() compiles the
+	// filter rules. When a pool is exhausted, the device seen least
+	// recently is evicted, or the outgoing message is dropped.
+	// Only used by upnprd_init(), changing these requires a restart.
+	unsigned int pool_devices;
+
+	// Maximum combined length of LOCATION, ST and USN of pooled devices
+	unsigned int pool_string_bytes;
+
+	unsigned int pool_send_entries;
+	unsigned int pool_threads;
+
+	// File the daemon writes statistics to on SIGUSR1, stderr if empty
+	char stats_file[128];
+
+	// Relay synchronization: If sync_port is non-zero, the instance
+	// exchanges its cache with the relays listed in sync_peers over
+	// unicast UDP on this port, such that devices seen by any of them can
+	// be found through all of them. Only used by upnprd_init(), changing
+	// it requires a restart.
+	unsigned short sync_port;
+
+	// Space separated list of the other relays' address:port, IPv4 only.
+	// All relays of a site should list each other.
+	char sync_peers[256];
+
+	// Active/standby pairs: If standby_priority is non-zero, the relays
+	// listed in sync_peers elect a leader, the one with the highest
+	// priority, and only the leader answers searches. Heartbeats are sent
+	// every standby_interval seconds; a standby relay takes over once the
+	// leader missed three. Requires sync_port. Only used by upnprd_init().
+	unsigned int standby_priority;
+	unsigned int standby_interval;
+
+	// Relay-to-relay tunnel: If tunnel_port is non-zero, the instance
+	// exchanges announcements and searches with the relay at tunnel_peer
+	// (address:port, IPv4) over unicast UDP on this port, connecting the
+	// caches of two sites without multicast routing. Only used by
+	// upnprd_init(), changing it requires a restart.
+	unsigned short tunnel_port;
+	char tunnel_peer[32];
+
+	// Zone policy: Space separated lists of shell patterns. Only devices
+	// whose ST matches one of tunnel_export are announced to the other
+	// end, and only those matching one of tunnel_import are accepted from
+	// it. An empty list matches everything.
+	char tunnel_export[256];
+	char tunnel_import[256];
+
+	// Shared-memory export: If shm_name is set (e.g. "/upnprd"), the
+	// device cache is published read-only in a POSIX shared-memory object
+	// of that name and shm_size bytes, see upnprd_shm.h. Devices that do
+	// not fit are left out. Only used by upnprd_init(), changing them
+	// requires a restart.
+	char shm_name[64];
+	unsigned int shm_size;
+
+	// Admission control for new devices: Each sender may add admit_burst
+	// devices at once, and admit_rate more per minute. A sender that
+	// exceeds this is quarantined, and none of its new devices are cached
+	// for admit_quarantine seconds. The admit_interface_* limits apply to
+	// the sum of all senders on one interface. Devices already cached are
+	// not affected. A rate of zero disables the respective limit.
+	unsigned int admit_rate;
+	unsigned int admit_burst;
+	unsigned int admit_quarantine;
+	unsigned int admit_interface_rate;
+	unsigned int admit_interface_burst;
+
+	// Reply budgets against reflection attacks: Each destination may be
+	// sent reply_burst bytes of replies, plus reply_amplification times
+	// the size of its searches, with both amounts decaying over a few
+	// seconds. Searches beyond that are dropped. The limits apply on the
+	// interfaces matching one of the shell patterns in
+	// reply_limit_interfaces (space separated), or on all if it is empty.
+	// A reply_burst of zero, the default, disables them.
+	unsigned int reply_burst;
+	unsigned int reply_amplification;
+	char reply_limit_interfaces[128];
+
+	// Weights of the send queue's priority classes, in the build without
+	// THREADS: When sockets are congested, replies to searches and our
+	// own background traffic take turns, sending up to this many messages
+	// per turn.
+	unsigned int send_weight_interactive;
+	unsigned int send_weight_background;
+
+	// Overload thresholds: Replies queued (in the THREADS build, sender
+	// threads running), milliseconds datagrams wait before they are
+	// processed, and KiB of memory held by devices and queued replies.
+	// Beyond one of them, searches are answered only if they are for a
+	// specific ST; beyond twice, only if their sender did not get an
+	// answer within the last minute; beyond four times, not at all.
+	// Zero disables a threshold.
+	unsigned int overload_depth;
+	unsigned int overload_lag_ms;
+	unsigned int overload_memory;
+
+	// Description proxy: If proxy_port is non-zero, the instance fetches
+	// the description XML of each device once, serves it over HTTP on this
+	// TCP port, and rewrites LOCATIONs in replies to point there. Cached
+	// descriptions are revalidated with the device when requested more
+	// than proxy_max_age seconds after they were fetched. Only used by
+	// upnprd_init(), changing proxy_port requires a restart. Cached
+	// descriptions come from the heap, also in fixed-footprint mode.
+	unsigned short proxy_port;
+	unsigned int proxy_max_age;
+
+	// Liveness checks: If liveness_interval is non-zero, the instance
+	// connects to the HTTP endpoint of each LOCATION every that many
+	// seconds, with liveness_http also sending a HEAD request, at most
+	// liveness_concurrency endpoints at a time. The devices of an endpoint
+	// that fails liveness_failures checks in a row are removed.
+	unsigned int liveness_interval;
+	unsigned int liveness_failures;
+	unsigned int liveness_concurrency;
+	unsigned char liveness_http;
+
+	// Device filters, see filter.c for the rule syntax: Devices matching a
+	// rule of filter_deny are not cached, nor, if filter_allow is set,
+	// those not matching one of its rules. filter_zones lists entries of
+	// the form <interface glob>=<rule>,<rule>...; searches arriving on an
+	// interface of such a zone are only answered with devices matching
+	// one of its rules.
+	char filter_deny[512];
+	char filter_allow[512];
+	char filter_zones[512];
+
+	// Device visibility, see visibility.c: If visibility_interfaces is
+	// non-zero, interfaces matching one of the globs of visibility_isolate
+	// (space separated) are isolated, up to visibility_interfaces of them.
+	// Searches arriving on an isolated interface are only answered with
+	// the devices announced there, and those not announced on an isolated
+	// interface. visibility_interfaces is only used by upnprd_init().
+	unsigned int visibility_interfaces;
+	char visibility_isolate[256];
+
+	// Local query API: If query_socket is set, local programs may look up
+	// cached devices, or subscribe to changes, over a Unix stream socket
+	// at that path, see query.c for the protocol. Only used by
+	// upnprd_init().
+	char query_socket[108];
+};
+
+/* Fill a configuration with the defaults */
+void upnprd_config_init(struct upnprd_config *config);
+
+/*
+ * Read a configuration file on top of the defaults. Returns 0 on success. On
+ * failure, returns -1, leaves config untouched and stores a message in error.
+ */
+int upnprd_config_load(struct upnprd_config *config, const char *path, char *error, size_t error_size);
+
+/*
+ * Create a relay instance. Returns 0 on success, or a non-zero error code
+ * (suitable as an exit code) on failure, in which case *ctx is untouched.
+ */
+int upnprd_init(upnprd_t **ctx, const struct upnprd_config *config);
+
+/*
+ * Add the instance's file descriptors to the given sets and return the
+ * highest descriptor added. Among them is a timer that fires when the
+ * instance has something to do on its own, so select() needs no timeout.
+ */
+int upnprd_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+
+/*
+ * Process whatever is ready according to the sets returned by select().
+ * Returns 0, or a non-zero error code if the instance failed fatally.
+ */
+int upnprd_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+
+struct upnprd_stats {
+	// Devices currently cached
+	unsigned long devices;
+
+	// Devices evicted to make room for new ones in fixed-footprint mode
+	unsigned long devices_evicted;
+
+	// New devices not cached, because memory ran out or, in
+	// fixed-footprint mode, their headers were too long
+	unsigned long devices_dropped;
+
+	// Outgoing messages dropped, because memory ran out or, in
+	// fixed-footprint mode, the send queue was full
+	unsigned long sends_dropped;
+
+	// Synchronization datagrams sent to and accepted from peers
+	unsigned long sync_sent;
+	unsigned long sync_received;
+
+	// Synchronization datagrams rejected, because they did not come from a
+	// configured peer or were malformed
+	unsigned long sync_rejected;
+
+	// Devices first learned from a peer rather than from SSDP traffic
+	unsigned long sync_devices_learned;
+
+	// Tunnel traffic in bytes, and the size the records sent would have
+	// had without compression
+	unsigned long tunnel_bytes_sent;
+	unsigned long tunnel_bytes_received;
+	unsigned long tunnel_bytes_uncompressed;
+
+	// Tunnel records sent and received
+	unsigned long tunnel_announcements_sent;
+	unsigned long tunnel_announcements_received;
+	unsigned long tunnel_searches_sent;
+	unsigned long tunnel_searches_received;
+
+	// Tunnel datagrams not from the configured peer, or malformed
+	unsigned long tunnel_rejected;
+
+	// Smoothed round trip time to the other end of the tunnel
+	unsigned long tunnel_rtt_ms;
+
+	// New devices not cached, because their sender added too many at
+	// once or is in quarantine for having done so, or because too many
+	// were added on their interface
+	unsigned long admissions_rejected;
+	unsigned long admissions_rejected_interface;
+
+	// Senders put into quarantine
+	unsigned long sources_quarantined;
+
+	// Searches dropped because the budget of their sender was exhausted,
+	// and replies left out because it ran out while replying
+	unsigned long searches_limited;
+	unsigned long replies_limited;
+
+	// Messages sent per priority class, with their smoothed and maximum
+	// time in the send queue. Only counted in the build without THREADS.
+	unsigned long sent_interactive;
+	unsigned long sent_background;
+	unsigned long latency_interactive_ms;
+	unsigned long latency_background_ms;
+	unsigned long latency_max_interactive_ms;
+	unsigned long latency_max_background_ms;
+
+	// Current load shedding tier (0 to 3, see overload_depth), and how
+	// often each tier was entered
+	unsigned long overload_state;
+	unsigned long overload_targeted;
+	unsigned long overload_first_time;
+	unsigned long overload_drop;
+
+	// The overload signals when last checked
+	unsigned long overload_depth;
+	unsigned long overload_lag_ms;
+	unsigned long overload_memory_kb;
+
+	// Searches not answered because of load shedding
+	unsigned long searches_shed;
+
+	// Requests to the description proxy, and those answered from the
+	// cache right away
+	unsigned long proxy_requests;
+	unsigned long proxy_hits;
+
+	// Descriptions fetched from devices, fetches answered with 304 Not
+	// Modified, and fetches that failed
+	unsigned long proxy_fetches;
+	unsigned long proxy_not_modified;
+	unsigned long proxy_failures;
+
+	// Liveness checks started, checks that failed, and devices removed
+	// because their endpoint was found dead
+	unsigned long liveness_probes;
+	unsigned long liveness_failures;
+	unsigned long devices_unreachable;
+
+	// Devices not cached, or removed after a reconfiguration, because of
+	// the device filters
+	unsigned long devices_filtered;
+
+	// Byebyes deferred for the grace period, devices alive again within
+	// it, and byebyes ignored from devices flapping too often
+	unsigned long byebyes_deferred;
+	unsigned long byebyes_reverted;
+	unsigned long byebyes_suppressed;
+
+	// Datagrams of our own dropped on receipt, mostly our discovery
+	// M-SEARCHes looped back
+	unsigned long self_dropped;
+
+	// Isolated interfaces left without a visibility bit, because there
+	// were more than visibility_interfaces
+	unsigned long visibility_overflow;
+
+	// Requests answered through the local query API
+	unsigned long queries;
+
+	// Events written to subscribers, and snapshots sent to subscribers
+	// instead of events that did not fit their queue
+	unsigned long subscription_events;
+	unsigned long subscription_resyncs;
+
+	// 1 while another relay leads and this one stands by, the times this
+	// relay took the lead, and the searches it left to the leader
+	unsigned long standby;
+	unsigned long standby_takeovers;
+	unsigned long standby_searches;
+
+	// Reply plans built, and searches answered from a plan built earlier
+	unsigned long reply_plans_built;
+	unsigned long reply_plan_hits;
+};
+
+/* Take a snapshot of the instance's statistics */
+void upnprd_stats(upnprd_t *ctx, struct upnprd_stats *stats);
+
+/* Print the instance's statistics in human readable form */
+void upnprd_stats_report(upnprd_t *ctx, FILE *out);
+
+/*
+ * Apply a new configuration to a running instance. The change is atomic with
+ * respect to message processing, and the device cache as well as replies
+ * already queued are kept.
+ */
+void upnprd_reconfigure(upnprd_t *ctx, const struct upnprd_config *config);
+
+/* Destroy an instance, releasing all its resources */
+void upnprd_shutdown(upnprd_t *ctx);
+
+#ifdef ALLOC_STATS
+/*
+ * Allocation tracking, only available in builds with ALLOC_STATS defined.
+ *
+ * Every heap allocation of an instance is accounted to the pipeline stage
+ * that made it and to the type of message being handled at the time.
+ */
+enum upnprd_alloc_stage {
+	UPNPRD_ALLOC_SETUP,     // Instance setup and teardown
+	UPNPRD_ALLOC_STORE,     // Device records
+	UPNPRD_ALLOC_REPLY,     // Reply preparation (thread arguments, plans)
+	UPNPRD_ALLOC_SEND,      // Send queue entries
+	UPNPRD_ALLOC_PROXY,     // Cached descriptions
+	UPNPRD_ALLOC_STAGES
+};
+
+enum upnprd_alloc_msg_type {
+	UPNPRD_MSG_NONE,        // Not handling a message, e.g. timers
+	UPNPRD_MSG_NOTIFY,      // NOTIFYs and M-SEARCH responses
+	UPNPRD_MSG_SEARCH,      // M-SEARCH requests
+	UPNPRD_MSG_SYNC,        // Updates from other relays
+	UPNPRD_MSG_TYPES
+};
+
+struct upnprd_alloc_counter {
+	unsigned long allocs;
+	unsigned long frees;
+	size_t live_bytes;
+};
+
+#define UPNPRD_ALLOC_HISTORY 60
+
+struct upnprd_alloc_stats {
+	struct upnprd_alloc_counter counters[UPNPRD_ALLOC_STAGES][UPNPRD_MSG_TYPES];
+
+	size_t live_bytes;
+	size_t peak_bytes;
+
+	// Samples of the heap usage, taken once a minute. The oldest sample
+	// is at history[0].
+	struct {
+		time_t time;
+		size_t live_bytes;
+		size_t peak_bytes;
+	} history[UPNPRD_ALLOC_HISTORY];
+	int history_length;
+};
+
+/* Take a snapshot of the instance's allocation statistics */
+void upnprd_alloc_stats(upnprd_t *ctx, struct upnprd_alloc_stats *stats);
+
+/* Print the instance's allocation statistics in human readable form */
+void upnprd_alloc_report(upnprd_t *ctx, FILE *out);
+#endif
+
+#endif
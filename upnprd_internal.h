@@ -0,0 +1,812 @@
+/*
+ * UPnP relay daemon - library internals
+ *
+ * Definitions shared between the translation units of libupnprd, and with the
+ * benchmarks. Nothing in here is part of the public API.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef UPNPRD_INTERNAL_H
+#define UPNPRD_INTERNAL_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "upnprd.h"
+
+#ifdef DEBUG
+	#define debugf(...) printf(__VA_ARGS__)
+#else
+	#define debugf(...)
+#endif
+
+/* Replies are sent as iovecs, see relay.c */
+#define REPLY_IOVECS 10
+
+/* Maximum number of messages handed to the kernel in one sendmmsg() call */
+#define SEND_BATCH 32
+
+/* Maximum number of messages received in one upnprd_poll() call */
+#define RECV_BATCH 16
+
+struct device;
+struct upnprd_shm_header;
+
+#ifdef THREADS
+	/* If compiled with threads, each reply is sent from its own thread */
+	#include <pthread.h>
+#else
+	/* If compiled without, we use a queue for sending messages which is
+	 * flushed from the caller's select() loop. Entries do not hold the
+	 * message itself, but the device it is about; the message is assembled
+	 * from the device's strings when it is sent. */
+	struct send_queue_entry {
+		int fd;
+		struct in_addr multicast_if_addr;
+		struct sockaddr_in dest_addr;
+
+		// Our address the search was sent to, for the description proxy
+		struct in_addr local_addr;
+
+		// NULL for our own M-SEARCH
+		struct device *device;
+
+		// ctx->now_ms when the entry was queued
+		uint32_t queued_ms;
+
+		struct send_queue_entry *next;
+	};
+
+	/*
+	 * Outgoing messages are queued by priority class. When sockets are
+	 * congested, the classes take turns, each sending as many messages per
+	 * turn as its weight.
+	 */
+	#define SEND_INTERACTIVE 0      // Replies to searches
+	#define SEND_BACKGROUND 1       // Our own discoveries and announcements
+	#define SEND_CLASSES 2
+
+	struct send_class {
+		struct send_queue_entry *queue;
+		struct send_queue_entry **tail;
+
+		// Messages sent, and their smoothed and maximum time in the queue
+		unsigned long sent;
+		unsigned long latency_ms;
+		unsigned long latency_max_ms;
+	};
+#endif
+
+/** ALLOCATION TRACKING *********************************/
+#ifdef ALLOC_STATS
+	void *tracked_malloc(upnprd_t *ctx, int stage, size_t size);
+	void tracked_free(upnprd_t *ctx, void *ptr);
+	void alloc_stats_sample(upnprd_t *ctx);
+
+	#define xmalloc(ctx, stage, size) tracked_malloc(ctx, stage, size)
+	#define xfree(ctx, ptr) tracked_free(ctx, ptr)
+	#define SET_MSG_TYPE(ctx, type) ((ctx)->alloc_msg_type = (type))
+#else
+	#define xmalloc(ctx, stage, size) malloc(size)
+	#define xfree(ctx, ptr) free(ptr)
+	#define SET_MSG_TYPE(ctx, type)
+#endif
+
+/** FIXED SIZE POOLS ************************************/
+struct pool {
+	void *memory;
+	void *free_list;
+	size_t object_size;
+	unsigned int capacity;
+	unsigned int used;
+};
+
+/** RELAY SYNCHRONIZATION ********************************/
+#define SYNC_MAX_PEERS 16
+
+/* Version vector entries per device. If more relays than this update the
+ * same device, the entry with the lowest counter is reused. */
+#define SYNC_MAX_NODES 8
+
+/* Size of outgoing synchronization datagrams, small enough to not fragment */
+#define SYNC_DATAGRAM_SIZE 1400
+
+struct sync_version {
+	uint32_t node;      // Relay the counter belongs to, 0 if unused
+	uint32_t counter;
+};
+
+/** RELAY-TO-RELAY TUNNEL ********************************/
+#define TUNNEL_DATAGRAM_SIZE 1400
+
+/** DESCRIPTION PROXY ************************************/
+#define PROXY_ENTRIES 64                // Descriptions cached
+#define PROXY_CLIENTS 16                // Connections from controllers
+#define PROXY_FETCHES 4                 // Concurrent fetches from devices
+#define PROXY_DOCUMENT_SIZE 65536       // Largest description cached
+#define PROXY_LOCATION_SIZE 256         // Longest LOCATION proxied
+
+// Rewritten LOCATIONs are "http://<address>:<port>/" and "<id>.xml"
+#define PROXY_PREFIX_SIZE 32
+#define PROXY_PATH_SIZE 13
+
+/* A cached description, shared by its entry and the connections sending it */
+struct proxy_document {
+	unsigned int refs;
+	size_t length;
+
+	// Followed by the description itself
+};
+
+#define PROXY_DOCUMENT_DATA(document) ((char *)((document) + 1))
+
+struct proxy_entry {
+	uint32_t id;        // Hash of the LOCATION, 0 if unused
+	char location[PROXY_LOCATION_SIZE];
+	unsigned char state;
+
+	// NULL until fetched, with the validators the device sent
+	struct proxy_document *document;
+	char etag[128];
+	char last_modified[64];
+
+	// In ctx->now seconds: When the document was last fetched or found to
+	// be unchanged, last requested, and when a failed fetch may be retried
+	time_t validated;
+	time_t used;
+	time_t retry;
+};
+
+struct proxy_client {
+	int fd;             // -1 if unused
+	unsigned char state;
+	time_t started;
+
+	// The request, later the response header
+	char buffer[1024];
+	size_t header_length;
+
+	// Bytes received or sent so far
+	size_t offset;
+
+	struct proxy_entry *waiting;
+	struct proxy_document *document;
+};
+
+struct proxy_fetch {
+	int fd;             // -1 if unused
+	struct proxy_entry *entry;
+	time_t started;
+
+	// The request while sending, then the response
+	char *buffer;
+	size_t request_length;
+	size_t length;
+	unsigned char sending;
+};
+
+/** LOCAL QUERIES ****************************************/
+#define QUERY_CLIENTS 8             // Connections from local programs
+#define QUERY_BUFFER_SIZE 8192      // Output buffered per connection
+#define QUERY_EVENTS 32             // Events queued per subscriber
+#define QUERY_EVENT_SIZE 384        // Longest event line
+
+/* A device event not yet written to a subscriber */
+struct query_event {
+	unsigned long serial;
+	unsigned char type;         // QUERY_EVENT_NONE if coalesced away
+	unsigned short usn_offset;  // Of the USN within line
+	unsigned short usn_length;
+	unsigned short length;
+	char line[QUERY_EVENT_SIZE];
+};
+
+struct query_client {
+	int fd;                     // -1 if unused
+	unsigned char closing;      // The client will not send more requests
+
+	// Received requests not answered yet
+	char request[512];
+	size_t request_length;
+
+	// The request being answered, QUERY_NONE if none, and the serial of
+	// the last device considered and the devices written so far
+	int query;
+	char argument[256];
+	unsigned long cursor;
+	unsigned long count;
+
+	// Answers waiting to be sent, QUERY_BUFFER_SIZE bytes
+	char *output;
+	size_t output_length;
+	size_t output_sent;
+
+	// Subscriptions: A ring of QUERY_EVENTS events, and whether a
+	// snapshot of all devices is due or being written (then cursor and
+	// count are as above)
+	struct query_event *events;
+	unsigned int events_start;
+	unsigned int events_count;
+	unsigned char snapshot;
+};
+
+/** ACTIVE/STANDBY ***************************************/
+#define STANDBY_MISSED 3            // Heartbeats missed until a peer is gone
+
+/* A synchronization peer, as far as leader election is concerned */
+struct standby_peer {
+	struct sockaddr_in addr;    // sin_port is 0 if never heard from
+	uint32_t node;
+	uint32_t heard_ms;          // ctx->now_ms of its last heartbeat
+	unsigned char priority;
+	unsigned char leader;
+};
+
+/** LIVENESS CHECKS **************************************/
+#define LIVENESS_ENDPOINTS 256      // Distinct host:port pairs checked
+#define LIVENESS_PROBES 32          // Most checks running at once
+
+struct liveness_endpoint {
+	struct sockaddr_in addr;    // sin_port is 0 if unused
+	char path[128];             // Of the first LOCATION seen, for HEAD
+	unsigned int failures;      // Checks failed in a row
+	time_t next_check;
+	unsigned char probing;
+};
+
+struct liveness_probe {
+	int fd;                     // -1 if unused
+	struct liveness_endpoint *endpoint;
+	time_t started;
+	unsigned char state;
+};
+
+/** DEVICE VISIBILITY ************************************/
+#define VISIBILITY_MIN_TABLE 64     // Smallest interface table, a power of two
+
+// Results of visibility_bit() other than a bit index
+#define VISIBILITY_ALL -1           // Not isolated, sees all devices
+#define VISIBILITY_SHARED -2        // Isolated without a bit, sees shared ones
+
+struct visibility_interface {
+	int ifindex;                // 0 if unused
+	int bit;                    // VISIBILITY_SHARED if none was assigned
+	unsigned char isolated;
+	unsigned char checked;      // Matched against visibility_isolate
+};
+
+/** SELF-TRAFFIC SUPPRESSION *****************************/
+#define SELF_ADDRESSES_BITS 7       // Hash set of our addresses
+#define SELF_MAX_ADDRESSES 96       // Addresses kept, leaving free slots
+
+/** DEVICE FILTERS ***************************************/
+#define FILTER_RULES 64             // Rules in all lists together
+#define FILTER_ZONES 8
+#define FILTER_STATES 4096          // Largest automaton compiled
+#define FILTER_INTERFACES 64        // Interface to zone cache
+
+// Bytes preceding each field's value in the automaton's input
+#define FILTER_TAG_USN 1
+#define FILTER_TAG_ST 2
+#define FILTER_TAG_LOCATION 3
+
+/* The compiled rules, see filter.c. state_count is 0 if there are none. */
+struct filter {
+	unsigned char classes[256];
+	unsigned int class_count;
+	unsigned int state_count;
+	uint16_t *transitions;
+	uint64_t *accepts;
+
+	// Which of the rules accepted by a state are which
+	uint64_t deny;
+	uint64_t allow;
+	uint64_t zone_rules[FILTER_ZONES];
+	char zone_interfaces[FILTER_ZONES][32];
+	int zone_count;
+};
+
+struct filter_interface {
+	int ifindex;
+	unsigned char zone;
+};
+
+/** UPNP DEVICE RELATED DEFINITIONS **********************/
+struct device {
+	// Devices are a list, in the order they were created in, i.e. of
+	// increasing serial
+	struct device *next;
+	unsigned long serial;
+
+	// Timestamps are used for time-outs, in seconds of ctx->now
+	time_t last_seen;
+
+	// The address is needed to avoid sending requestees information on
+	// their own computers and for a possible, future sender-forging feature
+	struct sockaddr_in addr;
+
+	// Those are the headers essential for UPnP M-SEARCH responses
+	char *location;
+	char *st;
+	char *usn;
+	size_t location_length;
+	size_t st_length;
+	size_t usn_length;
+
+	// Queued replies referencing the device. A device removed from the
+	// list is only released once the last of them has been sent.
+	unsigned int refs;
+	unsigned char removed;
+
+	// Version vector for relay synchronization, and the time we last
+	// told our peers about the device
+	struct sync_version versions[SYNC_MAX_NODES];
+	time_t synced;
+
+	// Where the device was learned from, and the time we last announced
+	// it through the tunnel
+	unsigned char origin;
+	time_t tunneled;
+
+	// Path of the LOCATION rewritten by the description proxy, empty if
+	// it is not proxied
+	char proxy_path[PROXY_PATH_SIZE];
+
+	// Zones whose filter_zones rules admit the device, one bit each
+	unsigned char zones;
+
+	// Byebye dampening, see flap.c: When the device said byebye while
+	// within its grace period (0 if it did not), and its flap penalty
+	// as of flap_updated
+	time_t suspect_since;
+	unsigned int flap_penalty;
+	time_t flap_updated;
+	unsigned char flap_suppressed;
+
+	// Interfaces the device is visible on, see visibility.c: Everywhere
+	// if visible_all is set, elsewise on the isolated interfaces whose
+	// bits are set in visible_on. The bitset of ctx->visibility_words
+	// words follows the structure in memory.
+	uint64_t *visible_on;
+	unsigned char visible_all;
+
+	// Adaptive max-age, see maxage.c: The max-age the device announced (0
+	// if it did not), how regularly it refreshes, and the max-age we
+	// advertise for it as of max_age_computed (0 if it needs to be
+	// computed again)
+	unsigned int announced_max_age;
+	unsigned int refresh_interval;
+	unsigned char regular_refreshes;
+	char max_age[12];
+	unsigned char max_age_length;
+	time_t max_age_computed;
+
+	// Below this is a dynamically sized chunk of memory for the three
+	// above strings.
+};
+
+typedef struct device device_t;
+
+#define DEVICE_LOCAL 0      // This site, from SSDP or a synchronized relay
+#define DEVICE_TUNNEL 1     // The other end of the tunnel
+
+#define LOCATION 0
+#define ST 1
+#define USN 2
+
+/* Result of parse_ssdp_headers() */
+struct ssdp_headers {
+	unsigned char is_alive;
+
+	// LOCATION, ST and USN values, pointing into the parsed buffer
+	char *headers[3];
+
+	// CACHE-CONTROL max-age, 0 if there is none
+	unsigned int max_age;
+};
+
+/** ADMISSION CONTROL ************************************/
+// Sizes of the admission tables, powers of two
+#define ADMIT_SOURCES 256
+#define ADMIT_INTERFACES 64
+
+/* Token bucket of a sender address or an interface index */
+struct admit_bucket {
+	uint32_t key;
+	uint32_t updated_ms;
+
+	// Thousandths of a token
+	uint32_t tokens;
+	unsigned char used;
+
+	// In ctx->now seconds
+	time_t quarantined_until;
+};
+
+/** REPLY BUDGETS ****************************************/
+// Sizes of the budget tables, powers of two
+#define REPLY_BUDGETS 256
+#define BUDGET_INTERFACES 64
+
+/* Decaying byte counters of a reply destination */
+struct reply_budget {
+	uint32_t key;
+	uint32_t updated_ms;
+	uint32_t sent;
+	uint32_t received;
+	unsigned char used;
+};
+
+/* Whether reply_limit_interfaces matches an interface */
+struct budget_interface {
+	int ifindex;
+	unsigned char limited;
+};
+
+/** OVERLOAD *********************************************/
+// Load shedding tiers, see overload.c
+#define OVERLOAD_NONE 0
+#define OVERLOAD_TARGETED 1     // Only answer searches for a specific ST
+#define OVERLOAD_FIRST_TIME 2   // ..and only from new requesters
+#define OVERLOAD_DROP 3         // Drop all searches
+
+// Requesters remembered for OVERLOAD_FIRST_TIME, as a power of two
+#define OVERLOAD_REQUESTERS_BITS 10
+
+struct overload_requester {
+	uint32_t addr;
+	time_t answered;
+};
+
+/** REPLY PLANS ******************************************/
+#define REPLY_PLANS 8               // Distinct searches planned
+#define REPLY_PLAN_MIN 64           // Smallest device array, grown by doubling
+
+/* The devices sent in reply to a class of searches, in list order */
+struct reply_plan {
+	unsigned long generation;   // ctx->store_generation when built, 0 if unused
+	unsigned long used;         // ctx->reply_plan_clock when last used
+	unsigned char zone;
+	int visibility;
+	unsigned char filtered;     // Whether only devices matching st are sent
+	char st[128];
+	device_t **devices;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+/** RELAY INSTANCE ***************************************/
+struct upnprd {
+	struct upnprd_config config;
+
+	// Multicast listener socket, also used for sending replies
+	int fd;
+
+	// Socket our own M-SEARCHes are sent from, and its port in network
+	// byte order, see self.c. Replies to them arrive there, too.
+	int discovery_fd;
+	in_port_t discovery_port;
+
+	// Timer descriptor, armed by upnprd_prep_fd_set() for the nearest
+	// deadline no other descriptor would wake the event loop for
+	int timer_fd;
+
+	device_t *root_device;
+
+	// Receive buffer
+	char buffer[2048];
+
+	// Our own M-SEARCH and the max-age of replies, rendered from the
+	// configuration
+	char discovery_message[128];
+	size_t discovery_message_length;
+	char max_age[16];
+	size_t max_age_length;
+
+	// Monotonic time in seconds, read once per upnprd_poll(). All
+	// deadlines use this clock, so they are immune to the wall clock being
+	// stepped, e.g. by NTP on boxes without an RTC. now_ms is the same
+	// clock in milliseconds, wrapping around.
+	time_t now;
+	uint32_t now_ms;
+
+	time_t last_service_sweep;
+
+	struct upnprd_stats stats;
+
+	// Relay synchronization, see sync.c. sync_fd is -1 if disabled.
+	int sync_fd;
+	uint32_t sync_node;
+	struct sockaddr_in sync_peers[SYNC_MAX_PEERS];
+	int sync_peer_count;
+
+	// Pending outgoing updates, sent at the end of each upnprd_poll()
+	unsigned char sync_out[SYNC_DATAGRAM_SIZE];
+	size_t sync_out_length;
+
+	// Relay-to-relay tunnel, see tunnel.c. tunnel_fd is -1 if disabled.
+	int tunnel_fd;
+	struct sockaddr_in tunnel_peer;
+
+	// Pending outgoing records, sent at the end of each upnprd_poll()
+	unsigned char tunnel_out[TUNNEL_DATAGRAM_SIZE];
+	size_t tunnel_out_length;
+	int tunnel_out_count;
+
+	// The peer's last clock value and when we received it, and the last
+	// value of ours it echoed, for latency measurements
+	uint32_t tunnel_echo;
+	uint32_t tunnel_echo_received;
+	uint32_t tunnel_last_echo;
+
+	unsigned char tunnel_ack_pending;
+	unsigned char tunnel_join_pending;
+	unsigned char tunnel_discovery_pending;
+	time_t tunnel_last_search;
+	time_t tunnel_last_discovery;
+
+	// Shared-memory export of the device table, see shm.c. NULL if
+	// disabled. shm_dirty is set whenever a device is added or removed.
+	struct upnprd_shm_header *shm;
+	unsigned char shm_dirty;
+
+	// Rate limits for new devices, see admit.c
+	struct admit_bucket admit_sources[ADMIT_SOURCES];
+	struct admit_bucket admit_interfaces[ADMIT_INTERFACES];
+
+	// Reply budgets per destination, see budget.c. The interface cache is
+	// cleared when the configuration changes.
+	struct reply_budget reply_budgets[REPLY_BUDGETS];
+	struct budget_interface budget_interfaces[BUDGET_INTERFACES];
+
+	// Load shedding, see overload.c. receive_lag_ms is the longest time a
+	// datagram of the last batch waited in the socket buffer, and
+	// device_bytes the memory held by cached devices.
+	int overload_state;
+	time_t overload_calm_since;
+	unsigned long receive_lag_ms;
+	unsigned long device_bytes;
+	struct overload_requester overload_requesters[1 << OVERLOAD_REQUESTERS_BITS];
+
+	// Serial of the last device created
+	unsigned long device_serial;
+
+	// Reply plans, see plan.c. store_generation changes whenever the
+	// devices selected for a search may have.
+	unsigned long store_generation;
+	unsigned long reply_plan_clock;
+	struct reply_plan reply_plans[REPLY_PLANS];
+
+	// Active/standby pairs, see standby.c. standby_next_ms is when the
+	// next heartbeat is due. standby_peers are indexed like sync_peers.
+	unsigned char standby_enabled;
+	unsigned char standby_leader;
+	uint32_t standby_started_ms;
+	uint32_t standby_next_ms;
+	struct standby_peer standby_peers[SYNC_MAX_PEERS];
+
+	// Local query API, see query.c. query_fd is -1 if disabled.
+	int query_fd;
+	struct query_client query_clients[QUERY_CLIENTS];
+	char *query_buffers;
+
+	// Description proxy, see proxy.c. proxy_fd is -1 if disabled.
+	int proxy_fd;
+	struct proxy_entry proxy_entries[PROXY_ENTRIES];
+	struct proxy_client proxy_clients[PROXY_CLIENTS];
+	struct proxy_fetch proxy_fetches[PROXY_FETCHES];
+	char *proxy_buffers;
+
+	// Byebye dampening, see flap.c. flap_suspects counts the devices
+	// within their grace period, flap_checked is when they were last
+	// checked for expiry.
+	unsigned long flap_suspects;
+	time_t flap_checked;
+
+	// Device visibility, see visibility.c. visibility_words is the size
+	// of each device's bitset, 0 if visibility_interfaces is unset.
+	struct visibility_interface *visibility_table;
+	unsigned int visibility_table_size;
+	unsigned int visibility_bits_used;
+	size_t visibility_words;
+	uint64_t *visibility_saved;
+	unsigned char visibility_saved_all;
+
+	// Our addresses, see self.c. 0 marks an empty slot.
+	uint32_t self_addresses[1 << SELF_ADDRESSES_BITS];
+	time_t self_refreshed;
+
+	// Device filters, see filter.c. The interface cache is cleared when
+	// the configuration changes.
+	struct filter filter;
+	struct filter_interface filter_interfaces[FILTER_INTERFACES];
+
+	// Liveness checks, see liveness.c
+	struct liveness_endpoint liveness_endpoints[LIVENESS_ENDPOINTS];
+	struct liveness_probe liveness_probes[LIVENESS_PROBES];
+
+	// Preallocated objects in fixed-footprint mode. Pools with a capacity
+	// of zero are unused, and objects come from the heap instead.
+	struct pool device_pool;
+	#ifdef THREADS
+		struct pool thread_pool;
+	#else
+		struct pool send_pool;
+	#endif
+
+	#ifdef THREADS
+		pthread_mutex_t device_list_update_mutex;
+
+		// Detached sender threads still running; upnprd_shutdown() waits
+		// for them to finish
+		pthread_cond_t threads_done;
+		int active_threads;
+
+		// Arguments of finished threads, for reuse
+		struct thread_arg *spare_thread_args;
+	#else
+		struct send_class send_classes[SEND_CLASSES];
+		unsigned long send_queued;
+
+		// Entries already sent, for reuse. This keeps the steady state
+		// free of heap allocations.
+		struct send_queue_entry *spare_entries;
+	#endif
+
+	#ifdef ALLOC_STATS
+		struct upnprd_alloc_stats alloc_stats;
+		int alloc_history_start;
+		int alloc_msg_type;
+		time_t alloc_last_sample;
+		#ifdef THREADS
+			pthread_mutex_t alloc_mutex;
+		#endif
+	#endif
+};
+
+#ifdef THREADS
+	#define LOCK(ctx) pthread_mutex_lock(&(ctx)->device_list_update_mutex)
+	#define UNLOCK(ctx) pthread_mutex_unlock(&(ctx)->device_list_update_mutex)
+#else
+	#define LOCK(ctx)
+	#define UNLOCK(ctx)
+#endif
+
+
+/** pool.c **********************************************/
+int pool_init(upnprd_t *ctx, struct pool *pool, size_t object_size, unsigned int capacity);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *ptr);
+void pool_destroy(upnprd_t *ctx, struct pool *pool);
+
+/** relay.c *********************************************/
+void clock_update(upnprd_t *ctx);
+void remove_outdated_devices(upnprd_t *ctx);
+device_t *find_device_by_usn(upnprd_t *ctx, char *usn);
+void store_device(upnprd_t *ctx, device_t *device);
+device_t *create_device(upnprd_t *ctx, char **headers, struct sockaddr_in *addr, unsigned char zones);
+void delete_device(upnprd_t *ctx, device_t *device);
+void discover_devices(upnprd_t *ctx);
+void parse_ssdp_headers(char *buffer, struct ssdp_headers *msg);
+int parse_http_location(const char *location, struct sockaddr_in *addr, const char **host, size_t *host_length, const char **path);
+void update_device(upnprd_t *ctx, struct ssdp_headers *msg, struct sockaddr_in *addr, int ifindex);
+
+/** sync.c **********************************************/
+int sync_parse_peers(const char *list, struct sockaddr_in *peers, int max_peers);
+int sync_setup(upnprd_t *ctx);
+void sync_join(upnprd_t *ctx);
+void sync_receive(upnprd_t *ctx);
+void sync_flush(upnprd_t *ctx);
+void sync_device_seen(upnprd_t *ctx, device_t *device);
+void sync_device_gone(upnprd_t *ctx, device_t *device);
+void sync_heartbeat(upnprd_t *ctx, unsigned char priority, unsigned char leader);
+
+/** tunnel.c ********************************************/
+int tunnel_setup(upnprd_t *ctx);
+void tunnel_join(upnprd_t *ctx);
+void tunnel_receive(upnprd_t *ctx);
+void tunnel_flush(upnprd_t *ctx);
+void tunnel_search(upnprd_t *ctx, const char *st);
+void tunnel_device_seen(upnprd_t *ctx, device_t *device);
+void tunnel_device_gone(upnprd_t *ctx, device_t *device);
+
+/** admit.c *********************************************/
+int admit_device(upnprd_t *ctx, struct in_addr source, int ifindex);
+
+/** budget.c ********************************************/
+size_t budget_reserve(upnprd_t *ctx, struct sockaddr_in *dest, int ifindex, size_t request_length);
+void budget_refund(upnprd_t *ctx, struct sockaddr_in *dest, size_t unused);
+
+/** overload.c ******************************************/
+void overload_update(upnprd_t *ctx);
+int overload_admit_search(upnprd_t *ctx, struct sockaddr_in *addr, const char *st);
+int overload_device_matches(device_t *device, const char *st);
+
+/** flap.c **********************************************/
+#define FLAP_REMOVE 0       // The byebye takes effect right away
+#define FLAP_IGNORE 1       // Deferred or suppressed
+
+int flap_byebye(upnprd_t *ctx, device_t *device);
+void flap_alive(upnprd_t *ctx, device_t *device);
+void flap_device_freed(upnprd_t *ctx, device_t *device);
+void flap_expire(upnprd_t *ctx);
+time_t flap_deadline(upnprd_t *ctx);
+
+/** maxage.c ********************************************/
+void maxage_seen(upnprd_t *ctx, device_t *device, unsigned int announced, int is_new);
+void maxage_update(upnprd_t *ctx, device_t *device);
+
+/** visibility.c ****************************************/
+int visibility_setup(upnprd_t *ctx);
+void visibility_free(upnprd_t *ctx);
+void visibility_reconfigure(upnprd_t *ctx);
+int visibility_bit(upnprd_t *ctx, int ifindex);
+void visibility_seen(upnprd_t *ctx, device_t *device, int ifindex, int is_new);
+void visibility_save(upnprd_t *ctx, device_t *device);
+void visibility_restore(upnprd_t *ctx, device_t *device);
+
+/** self.c **********************************************/
+void self_refresh(upnprd_t *ctx);
+int self_is_own(upnprd_t *ctx, struct sockaddr_in *addr);
+
+/** filter.c ********************************************/
+int filter_compile(upnprd_t *ctx, const struct upnprd_config *config, struct filter *filter, char *error, size_t error_size);
+void filter_free(upnprd_t *ctx, struct filter *filter);
+int filter_apply(upnprd_t *ctx);
+int filter_match(upnprd_t *ctx, const char *usn, const char *st, const char *location, unsigned char *zones);
+int filter_device(upnprd_t *ctx, char **headers, unsigned char *zones);
+unsigned char filter_zone(upnprd_t *ctx, int ifindex);
+
+/** standby.c *******************************************/
+int standby_setup(upnprd_t *ctx);
+void standby_reconfigure(upnprd_t *ctx);
+long standby_timeout_ms(upnprd_t *ctx);
+void standby_poll(upnprd_t *ctx);
+int standby_leading(upnprd_t *ctx);
+void standby_heartbeat(upnprd_t *ctx, struct sockaddr_in *addr, uint32_t node, unsigned char priority, unsigned char leader);
+
+/** query.c *********************************************/
+int query_setup(upnprd_t *ctx);
+int query_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void query_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void query_close(upnprd_t *ctx);
+void query_device_added(upnprd_t *ctx, device_t *device);
+void query_device_removed(upnprd_t *ctx, device_t *device);
+
+/** plan.c **********************************************/
+int plan_setup(upnprd_t *ctx);
+void plan_free(upnprd_t *ctx);
+int plan_selects(device_t *device, unsigned char zone, int visibility, const char *st);
+struct reply_plan *plan_get(upnprd_t *ctx, unsigned char zone, int visibility, const char *st);
+
+/** liveness.c ******************************************/
+void liveness_setup(upnprd_t *ctx);
+int liveness_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void liveness_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void liveness_close(upnprd_t *ctx);
+time_t liveness_deadline(upnprd_t *ctx);
+void liveness_device_added(upnprd_t *ctx, device_t *device);
+
+/** proxy.c *********************************************/
+int proxy_setup(upnprd_t *ctx);
+int proxy_prep_fd_set(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void proxy_poll(upnprd_t *ctx, fd_set *readfds, fd_set *writefds);
+void proxy_close(upnprd_t *ctx);
+time_t proxy_deadline(upnprd_t *ctx);
+void proxy_device_added(upnprd_t *ctx, device_t *device);
+size_t proxy_prefix(upnprd_t *ctx, struct in_addr local, char *buffer);
+
+/** shm.c ***********************************************/
+int shm_setup(upnprd_t *ctx);
+void shm_publish(upnprd_t *ctx);
+void shm_close(upnprd_t *ctx);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * UPnP relay daemon - shared-memory export of the device cache
+ *
+ * If configured with shm_name, the relay publishes its device table in a
+ * POSIX shared-memory object of that name, such that other local programs can
+ * look up devices without running their own discovery, and without any system
+ * calls or copying once the object is mapped. This header describes the
+ * layout and the reader library, libupnprd_shm.a:
+ *
+ *   upnprd_shm_reader_t *shm = upnprd_shm_open("/upnprd");
+ *   uint32_t sequence;
+ *   do {
+ *       sequence = upnprd_shm_read_begin(shm);
+ *       const struct upnprd_shm_device *device;
+ *       for(device = upnprd_shm_first(shm); device; device = upnprd_shm_next(shm, device)) {
+ *           ... look at UPNPRD_SHM_USN(device) etc., copy what you need ...
+ *       }
+ *   } while(upnprd_shm_read_retry(shm, sequence));
+ *   upnprd_shm_close(shm);
+ *
+ * The table is protected by a sequence lock: The relay never waits for
+ * readers, and a reader that raced with an update has to discard what it read
+ * and start over. Until upnprd_shm_read_retry() confirmed a pass, the data
+ * may be inconsistent; the iterator stays within the mapping regardless, and
+ * string lengths are bounded by their record.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef UPNPRD_SHM_H
+#define UPNPRD_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPNPRD_SHM_MAGIC 0x75706e70     // "upnp"
+#define UPNPRD_SHM_VERSION 1
+
+struct upnprd_shm_header {
+	// UPNPRD_SHM_MAGIC while the relay is running, 0 once it shut down
+	uint32_t magic;
+	uint32_t version;
+
+	// Odd while the relay is updating the table
+	uint32_t sequence;
+
+	// Size of the whole object in bytes
+	uint32_t size;
+
+	// Records in the table, and the bytes they occupy after the header
+	uint32_t devices;
+	uint32_t used;
+
+	// Devices left out, because the object is too small
+	uint32_t dropped;
+	uint32_t reserved;
+
+	// Incremented on every update
+	uint64_t generation;
+
+	// Wall clock time of the last update
+	int64_t updated;
+};
+
+#define UPNPRD_SHM_LOCAL 0      // Learned on this site
+#define UPNPRD_SHM_TUNNEL 1     // Learned through the relay-to-relay tunnel
+
+struct upnprd_shm_device {
+	// Size of the record, including the strings and padding to a multiple
+	// of 8 bytes
+	uint32_t size;
+
+	// IPv4 address of the announcer in network byte order, 0 if unknown
+	uint32_t addr;
+
+	uint16_t location_length;
+	uint16_t st_length;
+	uint16_t usn_length;
+	uint8_t origin;
+	uint8_t reserved;
+
+	// LOCATION, ST and USN, each NUL terminated
+	char strings[];
+};
+
+#define UPNPRD_SHM_LOCATION(device) ((device)->strings)
+#define UPNPRD_SHM_ST(device) ((device)->strings + (device)->location_length + 1)
+#define UPNPRD_SHM_USN(device) ((device)->strings + (device)->location_length + (device)->st_length + 2)
+
+/* Records start right after the header, each aligned to 8 bytes */
+#define UPNPRD_SHM_RECORDS_OFFSET ((sizeof(struct upnprd_shm_header) + 7) & ~7)
+
+/** READER LIBRARY **************************************/
+typedef struct upnprd_shm_reader upnprd_shm_reader_t;
+
+/* Map the relay's table read-only. Returns NULL and sets errno on failure. */
+upnprd_shm_reader_t *upnprd_shm_open(const char *name);
+
+void upnprd_shm_close(upnprd_shm_reader_t *shm);
+
+/* Start a read pass. Waits while the relay is updating the table. */
+uint32_t upnprd_shm_read_begin(upnprd_shm_reader_t *shm);
+
+/* End a read pass. Returns non-zero if the table changed meanwhile, and the pass must be repeated. */
+int upnprd_shm_read_retry(upnprd_shm_reader_t *shm, uint32_t sequence);
+
+/* Iterate over the devices. Returns NULL at the end of the table. */
+const struct upnprd_shm_device *upnprd_shm_first(upnprd_shm_reader_t *shm);
+const struct upnprd_shm_device *upnprd_shm_next(upnprd_shm_reader_t *shm, const struct upnprd_shm_device *device);
+
+/* The header, e.g. to check whether the relay is still running or the table changed since the last look */
+const struct upnprd_shm_header *upnprd_shm_header(upnprd_shm_reader_t *shm);
+
+/*
+ * Look up a device by USN and copy its LOCATION to location. Returns 0 if
+ * found, -1 if not or if location is too small.
+ */
+int upnprd_shm_find_location(upnprd_shm_reader_t *shm, const char *usn, char *location, size_t size);
+
+#endif
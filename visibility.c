@@ -0,0 +1,194 @@
+/*
+ * UPnP relay daemon - per-interface device visibility
+ *
+ * In deployments with one VLAN interface per room or apartment, a device must
+ * only be served to searches arriving on the interfaces it was seen on.
+ * Interfaces matching visibility_isolate are isolated: Each is assigned a bit
+ * index the first time it is seen, and each device record carries a bitset of
+ * visibility_interfaces bits, with the bits of the isolated interfaces it
+ * announced itself on. Devices seen on any other interface, and those learned
+ * from other relays, are shared and visible everywhere. A search arriving on
+ * an isolated interface is answered with the shared devices and those having
+ * its bit set, which is a single bit test per device however many interfaces
+ * there are.
+ *
+ * Bit indices are never reused while the instance runs. Isolated interfaces
+ * beyond visibility_interfaces get no bit: They only see shared devices, and
+ * their own devices are not served anywhere.
+ *
+ * Copyright (c) 2013-2015, Phillip Berndt
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <fnmatch.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upnprd.h"
+#include "upnprd_internal.h"
+
+int visibility_setup(upnprd_t *ctx) {
+	unsigned int bits = ctx->config.visibility_interfaces;
+	if(!bits) {
+		return 0;
+	}
+
+	// Room for non-isolated interfaces, too, and short probe sequences
+	unsigned int size = VISIBILITY_MIN_TABLE;
+	while(size < bits * 4) {
+		size <<= 1;
+	}
+	ctx->visibility_table = (struct visibility_interface *)xmalloc(ctx, UPNPRD_ALLOC_SETUP, size * sizeof(struct visibility_interface));
+	if(!ctx->visibility_table) {
+		return -1;
+	}
+	memset(ctx->visibility_table, 0, size * sizeof(struct visibility_interface));
+	ctx->visibility_table_size = size;
+	ctx->visibility_words = (bits + 63) / 64;
+
+	// See visibility_save()
+	ctx->visibility_saved = (uint64_t *)xmalloc(ctx, UPNPRD_ALLOC_SETUP, ctx->visibility_words * sizeof(uint64_t));
+	if(!ctx->visibility_saved) {
+		visibility_free(ctx);
+		return -1;
+	}
+	return 0;
+}
+
+void visibility_free(upnprd_t *ctx) {
+	if(ctx->visibility_table) {
+		xfree(ctx, ctx->visibility_table);
+		ctx->visibility_table = NULL;
+	}
+	if(ctx->visibility_saved) {
+		xfree(ctx, ctx->visibility_saved);
+		ctx->visibility_saved = NULL;
+	}
+}
+
+void visibility_reconfigure(upnprd_t *ctx) {
+	// Interfaces are matched against the new visibility_isolate again,
+	// keeping their bits
+	unsigned int i;
+	for(i=0; i<ctx->visibility_table_size; i++) {
+		ctx->visibility_table[i].checked = 0;
+	}
+}
+
+static int interface_isolated(upnprd_t *ctx, int ifindex) {
+	char name[IF_NAMESIZE];
+	if(!if_indextoname(ifindex, name)) {
+		// Gone already, do not let it see more than it may
+		return 1;
+	}
+	const char *patterns = ctx->config.visibility_isolate;
+	char pattern[sizeof(ctx->config.visibility_isolate)];
+	while(*patterns) {
+		size_t length = strcspn(patterns, " \t");
+		if(length) {
+			memcpy(pattern, patterns, length);
+			pattern[length] = 0;
+			if(fnmatch(pattern, name, 0) == 0) {
+				return 1;
+			}
+		}
+		patterns += length;
+		patterns += strspn(patterns, " \t");
+	}
+	return 0;
+}
+
+int visibility_bit(upnprd_t *ctx, int ifindex) {
+	if(!ctx->visibility_words || ifindex <= 0) {
+		return VISIBILITY_ALL;
+	}
+
+	// Interface indices are mostly consecutive, so their low bits make a
+	// good hash
+	unsigned int mask = ctx->visibility_table_size - 1;
+	unsigned int slot = ifindex & mask;
+	unsigned int probes;
+	struct visibility_interface *interface = NULL;
+	for(probes=0; probes<ctx->visibility_table_size; probes++) {
+		struct visibility_interface *candidate = &ctx->visibility_table[slot];
+		if(candidate->ifindex == ifindex) {
+			interface = candidate;
+			break;
+		}
+		if(!candidate->ifindex) {
+			interface = candidate;
+			interface->ifindex = ifindex;
+			interface->bit = VISIBILITY_SHARED;
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+	if(!interface) {
+		// Far more interfaces than configured. Treat them as isolated
+		// without a bit, rather than showing them everything.
+		return VISIBILITY_SHARED;
+	}
+
+	if(!interface->checked) {
+		interface->checked = 1;
+		interface->isolated = interface_isolated(ctx, ifindex);
+		if(interface->isolated && interface->bit < 0) {
+			if(ctx->visibility_bits_used < ctx->config.visibility_interfaces) {
+				interface->bit = ctx->visibility_bits_used++;
+			}
+			else {
+				ctx->stats.visibility_overflow++;
+			}
+		}
+	}
+	return interface->isolated ? interface->bit : VISIBILITY_ALL;
+}
+
+void visibility_seen(upnprd_t *ctx, device_t *device, int ifindex, int is_new) {
+	if(!ctx->visibility_words) {
+		return;
+	}
+	int bit = visibility_bit(ctx, ifindex);
+	if(bit == VISIBILITY_ALL) {
+		if(!device->visible_all) {
+			device->visible_all = 1;
+			ctx->store_generation++;
+		}
+		return;
+	}
+	if(is_new) {
+		device->visible_all = 0;
+		ctx->store_generation++;
+	}
+	// Keep-alives mostly change nothing, and must not invalidate the
+	// reply plans then
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+	if(bit >= 0 && !(device->visible_on[bit >> 6] & mask)) {
+		device->visible_on[bit >> 6] |= mask;
+		ctx->store_generation++;
+	}
+}
+
+/*
+ * Keep the interfaces a device was seen on before its record is freed, for
+ * visibility_restore() to carry them over to the record replacing it
+ */
+void visibility_save(upnprd_t *ctx, device_t *device) {
+	ctx->visibility_saved_all = device->visible_all;
+	if(ctx->visibility_words) {
+		memcpy(ctx->visibility_saved, device->visible_on, ctx->visibility_words * sizeof(uint64_t));
+	}
+}
+
+void visibility_restore(upnprd_t *ctx, device_t *device) {
+	device->visible_all = ctx->visibility_saved_all;
+	if(ctx->visibility_words) {
+		memcpy(device->visible_on, ctx->visibility_saved, ctx->visibility_words * sizeof(uint64_t));
+	}
+	ctx->store_generation++;
+}